@@ -1,46 +1,342 @@
 #include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+#include "cpu_analyzer.h"
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
+#define RB_SIZE      (1 << 24)  // 16 MB
+#define EXIT_RB_SIZE (1 << 18)  // 256 KB
+
 // Ring buffer
 struct {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
-    __uint(max_entries, 1 << 24); // 16 MB
+    __uint(max_entries, RB_SIZE);
 } rb SEC(".maps");
 
+// Thread exit notifications
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, EXIT_RB_SIZE);
+} exit_rb SEC(".maps");
+
+// Per-thread and per-process maps are LRU hashes that userspace sizes from
+// pid_max, the CPU count and --map-budget before loading, so a full map
+// evicts the stalest entry instead of silently refusing new ones.
+
 // Per-thread (TID) start timestamp when descheduled
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __type(key, __u32);   // tid
-    __type(value, __u64); // t0_ns
+    __type(value, struct task_start); // t0
     __uint(max_entries, 16384);
 } offcpu_start SEC(".maps");
 
 // Per-thread blocked start timestamp (when switched out to sleep)
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __type(key, __u32);   // tid
-    __type(value, __u64); // t0_ns
+    __type(value, struct task_start); // t0
     __uint(max_entries, 16384);
 } blocked_start SEC(".maps");
 
-#define BLOCKED_HIST_BUCKETS 64
+// Per-thread time it became runnable again (woken up or preempted)
 struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);   // tid
+    __type(value, struct task_start); // t1
+    __uint(max_entries, 16384);
+} runq_start SEC(".maps");
+
+// Per-CPU so that wakeups on different CPUs never share a cache line;
+// userspace sums the CPUs' slots when it reads the histogram.
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
     __uint(max_entries, BLOCKED_HIST_BUCKETS);
     __type(key, __u32);   // bucket index
     __type(value, __u64); // count
 } blocked_hist SEC(".maps");
 
-struct offcpu_sample {
+// Same layout, for off-CPU intervals. Only filled with --pin: the owner
+// builds its off-CPU histogram from 'rb', pinned clients cannot share that.
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, BLOCKED_HIST_BUCKETS);
+    __type(key, __u32);   // bucket index
+    __type(value, __u64); // count
+} offcpu_hist SEC(".maps");
+
+// --oncpu: same layout, for on-CPU slices
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, BLOCKED_HIST_BUCKETS);
+    __type(key, __u32);   // bucket index
+    __type(value, __u64); // count
+} oncpu_hist SEC(".maps");
+
+// --oncpu: when the task running on each CPU was switched in
+struct oncpu_slot {
+    __u64 ts_ns;
     __u32 tid;
-    __u32 tgid;
-    __u64 t0_ns;
-    __u64 t2_ns;
-    __u64 delta_ns;
+    __u32 pad;
 };
 
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct oncpu_slot);
+} oncpu_start SEC(".maps");
+
+// Exact per-process totals, read by userspace in one batch per interval
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);   // tgid
+    __type(value, struct tgid_stats);
+    __uint(max_entries, 16384);
+} tgid_stats SEC(".maps");
+
+// Per-thread totals and per-process histograms, for --top; per-thread
+// histograms for --threads
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);   // tid
+    __type(value, struct tid_stats);
+    __uint(max_entries, 16384);
+} tid_stats SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);   // tgid
+    __type(value, struct tgid_hist);
+    __uint(max_entries, 16384);
+} tgid_hists SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);   // tid
+    __type(value, struct tgid_hist);
+    __uint(max_entries, 16384);
+} tid_hists SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct thread_exit_key);
+    __type(value, struct group_stat);
+    __uint(max_entries, 16384);
+} thread_exits SEC(".maps");
+
+// --cgroup: the directory of the cgroup v2 subtree to trace
+struct {
+    __uint(type, BPF_MAP_TYPE_CGROUP_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} cgroup_filter SEC(".maps");
+
+// --cgroups: totals and histograms per cgroup id
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u64);
+    __type(value, struct group_stat);
+    __uint(max_entries, 16384);
+} cgroup_stats SEC(".maps");
+
+const struct group_stat empty_group_stat = {};
+
+// Target set (--pid, --tid, --comm): each maps to its index in 'target_stats'.
+// Thread groups forked by a matching process are added to 'target_pids'.
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, __u32);     // tgid
+    __type(value, __u32);
+    __uint(max_entries, 16384);
+} target_pids SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, __u32);     // tid
+    __type(value, __u32);
+    __uint(max_entries, MAX_TARGETS);
+} target_tids SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct comm_key);
+    __type(value, __u32);
+    __uint(max_entries, MAX_TARGETS);
+} target_comms SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, struct group_stat);
+    __uint(max_entries, MAX_TARGETS);
+} target_stats SEC(".maps");
+
+// --pidns: the thread group ID each host thread group has in the namespace,
+// so reports can show both
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);     // host tgid
+    __type(value, __u32);   // tgid in the namespace
+    __uint(max_entries, 16384);
+} ns_tgids SEC(".maps");
+
+const struct tgid_hist empty_tgid_hist = {};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct analyzer_config);
+} config SEC(".maps");
+
+// --outliers: the longest intervals of each kind on each CPU, in the half of
+// the keys config.topk_slot selects. Userspace flips the slot every interval
+// and merges and empties the other half.
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, TOPK_KINDS * 2);
+    __type(key, __u32);
+    __type(value, struct topk_list);
+} topk SEC(".maps");
+
+// --flight-recorder: every switch, overwritten in place in a ring of
+// config.flight_mask + 1 records per CPU that userspace sizes and maps.
+// Nothing is copied out unless it dumps them.
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __type(key, __u32);
+    __type(value, struct flight_rec);
+    __uint(max_entries, 1);
+} flight_recs SEC(".maps");
+
+// Records each CPU has written so far
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u64);
+} flight_head SEC(".maps");
+
+// --flame: user and kernel stacks, and the nanoseconds charged to each
+// {tgid, comm, stacks} on and off CPU. Userspace sizes both when enabled.
+struct {
+    __uint(type, BPF_MAP_TYPE_STACK_TRACE);
+    __uint(key_size, sizeof(__u32));
+    __uint(value_size, FLAME_MAX_DEPTH * sizeof(__u64));
+    __uint(max_entries, 1);
+} stacks SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct flame_key);
+    __type(value, __u64);
+    __uint(max_entries, 1);
+} flame_counts SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, FLAME_COUNTERS);
+    __type(key, __u32);
+    __type(value, __u64);
+} flame_counters SEC(".maps");
+
+// --preempt: run-queue time of traced thread groups after each preemptor
+// displaced them
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct preempt_key);
+    __type(value, struct time_stat);
+    __uint(max_entries, 16384);
+} preempt_stats SEC(".maps");
+
+// --sched: waits per scheduling policy and priority
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct sched_key);
+    __type(value, struct sched_stat);
+    __uint(max_entries, 512);
+} sched_stats SEC(".maps");
+
+const struct sched_stat empty_sched_stat = {};
+
+// Syscall each task is currently in, only maintained with --syscalls
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, __s32);
+} task_syscall SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct syscall_key);
+    __type(value, struct syscall_stat);
+    __uint(max_entries, 16384);
+} syscall_stats SEC(".maps");
+
+// Too big for the BPF stack; used to create syscall_stats entries.
+const struct syscall_stat empty_syscall_stat = {};
+
+// Inserts and deletes per enum lru_map_id, for eviction accounting
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, LRU_MAPS);
+    __type(key, __u32);
+    __type(value, struct lru_ops);
+} lru_ops SEC(".maps");
+
+// --blockio: block requests in flight and who issued them
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct io_req_key);
+    __type(value, struct io_req);
+    __uint(max_entries, 16384);
+} io_inflight SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, __u32);   // dev
+    __type(value, struct io_dev_stat);
+    __uint(max_entries, 256);
+} io_dev_stats SEC(".maps");
+
+// Blocked time of uninterruptible sleeps, by enum dstate_class
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, DSTATE_CLASSES);
+    __type(key, __u32);
+    __type(value, struct log2_hist);
+} dstate_hist SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, IO_COUNTERS);
+    __type(key, __u32);
+    __type(value, __u64);
+} io_counters SEC(".maps");
+
+// --futex: the futex word each thread is waiting on, between enter and exit
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, __u32);   // tid
+    __type(value, struct futex_wait);
+    __uint(max_entries, 16384);
+} futex_waits SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, struct futex_key);
+    __type(value, struct futex_stat);
+    __uint(max_entries, 16384);
+} futex_stats SEC(".maps");
+
+const struct futex_stat empty_futex_stat = {};
+
 struct sched_wakeup_args {
     __u64 pad;
     char comm[16];
@@ -50,6 +346,37 @@ struct sched_wakeup_args {
     __u32 target_cpu;
 };
 
+struct sys_enter_futex_args {
+    __u64 pad;
+    __s32 syscall_nr;
+    __u32 pad2;
+    __u64 uaddr;
+    __u64 op;
+    __u64 val;
+    __u64 utime;
+    __u64 uaddr2;
+    __u64 val3;
+};
+
+// Futex commands that put the caller to sleep on uaddr
+#define FUTEX_WAIT            0
+#define FUTEX_LOCK_PI         6
+#define FUTEX_WAIT_BITSET     9
+#define FUTEX_WAIT_REQUEUE_PI 11
+#define FUTEX_LOCK_PI2        13
+#define FUTEX_CMD_MASK        0x7f
+
+// prev_state bits of a task doing its final switch after exit
+#define EXIT_ZOMBIE 0x20
+#define EXIT_DEAD   0x10
+// prev_state reported for a task preempted while still runnable
+#define TASK_REPORT_MAX 0x100
+#define TASK_UNINTERRUPTIBLE 0x2
+
+#define SCHED_FIFO     1
+#define SCHED_RR       2
+#define SCHED_DEADLINE 6
+
 static __always_inline __u32 log2_u64(__u64 v)
 {
     __u32 r = 0;
@@ -62,84 +389,1016 @@ static __always_inline __u32 log2_u64(__u64 v)
     return r;
 }
 
+static __always_inline void read_config(struct analyzer_config *out)
+{
+    __u32 zero = 0;
+    struct analyzer_config *cfg = bpf_map_lookup_elem(&config, &zero);
+    if (cfg)
+        *out = *cfg;
+    else
+        __builtin_memset(out, 0, sizeof(*out));
+}
+
+// Submit flags that wake the consumer only once cfg->wakeup_bytes are
+// waiting (never more than half the ring), so it drains the ring in batches.
+// Userspace also drains both rings before every tick.
+static __always_inline __u64 ringbuf_wakeup(void *ring, const struct analyzer_config *cfg, __u64 ring_size)
+{
+    __u64 batch = cfg->wakeup_bytes;
+
+    if (batch == 0)
+        return 0;
+    if (batch > ring_size / 2)
+        batch = ring_size / 2;
+    return bpf_ringbuf_query(ring, BPF_RB_AVAIL_DATA) >= batch ? BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP;
+}
+
+// Whether an interval of the task an entry of the start maps belongs to is
+// streamed and histogrammed. With --pidns, filter_tgid is a namespace-local ID
+// and tasks outside the namespace are left out.
+static __always_inline bool config_wants(const struct analyzer_config *cfg, const struct task_start *s)
+{
+    __u32 tgid = s->tgid;
+
+    if (cfg->flags & CFG_PIDNS) {
+        if (s->ns_tgid == 0)
+            return false;
+        tgid = s->ns_tgid;
+    }
+    if (cfg->filter_tgid != 0 && cfg->filter_tgid != tgid)
+        return false;
+    if ((cfg->flags & CFG_TARGETS) && s->target == TARGET_NONE)
+        return false;
+    return !(cfg->flags & CFG_CGROUP_FILTER) || (s->flags & START_IN_CGROUP);
+}
+
+// --threads only keeps the threads it reports on; --top ranks every task.
+static __always_inline bool tid_stats_wanted(const struct analyzer_config *cfg, const struct task_start *s)
+{
+    return (cfg->flags & CFG_TID_STATS) && ((cfg->flags & CFG_TID_ALL) || config_wants(cfg, s));
+}
+
+static __always_inline __u32 hist_slot(__u64 delta_ns)
+{
+    __u32 slot = log2_u64(delta_ns / 1000);
+    return slot < HIST_SLOTS ? slot : HIST_SLOTS - 1;
+}
+
+static __always_inline void lru_count(__u32 id, bool insert)
+{
+    struct lru_ops *ops = bpf_map_lookup_elem(&lru_ops, &id);
+    if (!ops)
+        return;
+    if (insert)
+        ops->inserts++;
+    else
+        ops->deletes++;
+}
+
+// A single update either way: a key that is there already is overwritten in
+// place, a new one is counted once the map took it.
+static __always_inline void lru_insert(void *map, __u32 id, const void *key, const void *val, __u32 size)
+{
+    void *old = bpf_map_lookup_elem(map, key);
+    if (old)
+        __builtin_memcpy(old, val, size);
+    else if (bpf_map_update_elem(map, key, val, BPF_NOEXIST) == 0)
+        lru_count(id, true);
+}
+
+static __always_inline void lru_delete(void *map, __u32 id, const void *key)
+{
+    if (bpf_map_delete_elem(map, key) == 0)
+        lru_count(id, false);
+}
+
+static __always_inline struct tgid_stats *lookup_tgid_stats(__u32 tgid)
+{
+    struct tgid_stats *st = bpf_map_lookup_elem(&tgid_stats, &tgid);
+    if (st)
+        return st;
+
+    struct tgid_stats zero = {};
+    if (bpf_map_update_elem(&tgid_stats, &tgid, &zero, BPF_NOEXIST) == 0)
+        lru_count(LRU_TGID_STATS, true);
+    return bpf_map_lookup_elem(&tgid_stats, &tgid);
+}
+
+static __always_inline struct tid_stats *lookup_tid_stats(__u32 tid, __u32 tgid)
+{
+    struct tid_stats *st = bpf_map_lookup_elem(&tid_stats, &tid);
+    if (st)
+        return st;
+
+    struct tid_stats zero = { .tgid = tgid };
+    if (bpf_map_update_elem(&tid_stats, &tid, &zero, BPF_NOEXIST) == 0)
+        lru_count(LRU_TID_STATS, true);
+    return bpf_map_lookup_elem(&tid_stats, &tid);
+}
+
+// The entry of 'tgid_hists' or 'tid_hists' for id, created empty if needed
+static __always_inline struct tgid_hist *lookup_hist(void *map, __u32 lru_id, __u32 id)
+{
+    struct tgid_hist *h = bpf_map_lookup_elem(map, &id);
+    if (h)
+        return h;
+
+    if (bpf_map_update_elem(map, &id, &empty_tgid_hist, BPF_NOEXIST) == 0)
+        lru_count(lru_id, true);
+    return bpf_map_lookup_elem(map, &id);
+}
+
+// The max is not updated atomically; a lost race only means a concurrent,
+// nearly equal value wins.
+static __always_inline void account(struct time_stat *ts, __u64 delta_ns)
+{
+    __sync_fetch_and_add(&ts->total_ns, delta_ns);
+    __sync_fetch_and_add(&ts->count, 1);
+    if (delta_ns > ts->max_ns)
+        ts->max_ns = delta_ns;
+}
+
+enum group_kind { GROUP_OFFCPU, GROUP_BLOCKED, GROUP_RUNQ };
+
+static __always_inline void account_group(struct group_stat *gs, __u32 kind, __u64 delta_ns)
+{
+    if (kind == GROUP_OFFCPU) {
+        account(&gs->offcpu, delta_ns);
+        __sync_fetch_and_add(&gs->offcpu_hist.slots[hist_slot(delta_ns)], 1);
+    } else if (kind == GROUP_BLOCKED) {
+        account(&gs->blocked, delta_ns);
+        __sync_fetch_and_add(&gs->blocked_hist.slots[hist_slot(delta_ns)], 1);
+    } else {
+        account(&gs->runq, delta_ns);
+    }
+}
+
+// Charges an interval to the cgroup its task was in when it began
+static __always_inline void account_cgroup(__u64 cgid, __u32 kind, __u64 delta_ns)
+{
+    struct group_stat *cs = bpf_map_lookup_elem(&cgroup_stats, &cgid);
+    if (!cs) {
+        if (bpf_map_update_elem(&cgroup_stats, &cgid, &empty_group_stat, BPF_NOEXIST) == 0)
+            lru_count(LRU_CGROUP_STATS, true);
+        cs = bpf_map_lookup_elem(&cgroup_stats, &cgid);
+        if (!cs)
+            return;
+    }
+    account_group(cs, kind, delta_ns);
+}
+
+// Charges an interval to the target its task matched when it began
+static __always_inline void account_target(__u32 target, __u32 kind, __u64 delta_ns)
+{
+    if (target == TARGET_NONE)
+        return;
+    struct group_stat *ts = bpf_map_lookup_elem(&target_stats, &target);
+    if (ts)
+        account_group(ts, kind, delta_ns);
+}
+
+// The IDs the current task has in the --pidns namespace; left alone when it
+// is not a member.
+static __always_inline void current_ns_ids(const struct analyzer_config *cfg, __u32 *tid, __u32 *tgid)
+{
+    struct bpf_pidns_info ns = {};
+
+    if (bpf_get_ns_current_pid_tgid(cfg->pidns_dev, cfg->pidns_ino, &ns, sizeof(ns)) == 0) {
+        *tid = ns.pid;
+        *tgid = ns.tgid;
+    }
+}
+
+// The PID a task has in the namespace it belongs to, if that is the --pidns
+// one, else 0. The nsfs inode number alone identifies the namespace.
+static __always_inline __u32 task_ns_pid(struct task_struct *task, __u64 ino)
+{
+    struct pid *pid = NULL;
+    struct upid upid = {};
+    unsigned int level = 0, inum = 0;
+
+    if (bpf_core_read(&pid, sizeof(pid), &task->thread_pid) || !pid ||
+        bpf_core_read(&level, sizeof(level), &pid->level) ||
+        bpf_core_read(&upid, sizeof(upid), &pid->numbers[level]) ||
+        bpf_core_read(&inum, sizeof(inum), &upid.ns->ns.inum))
+        return 0;
+    return inum == ino ? (__u32)upid.nr : 0;
+}
+
+// The target set entry the current task matches: by TID, then by thread
+// group, then by comm prefix. The IDs are namespace-local with --pidns.
+static __always_inline __u32 current_target(__u32 tid, __u32 tgid)
+{
+    struct comm_key key = { .prefixlen = sizeof(key.comm) * 8 };
+    __u32 *t;
+
+    if ((t = bpf_map_lookup_elem(&target_tids, &tid)) ||
+        (t = bpf_map_lookup_elem(&target_pids, &tgid)))
+        return *t;
+    bpf_get_current_comm(key.comm, sizeof(key.comm));
+    t = bpf_map_lookup_elem(&target_comms, &key);
+    return t ? *t : TARGET_NONE;
+}
+
+// Fills in what config_wants() looks at for the current task, thread tid
+static __always_inline void current_filter_ids(const struct analyzer_config *cfg, struct task_start *s, __u32 tid)
+{
+    __u32 tgid = s->tgid;
+
+    if (cfg->flags & CFG_PIDNS) {
+        current_ns_ids(cfg, &s->ns_tid, &s->ns_tgid);
+        tid = s->ns_tid;
+        tgid = s->ns_tgid;
+    }
+    if ((cfg->flags & CFG_TARGETS) && tgid != 0)
+        s->target = current_target(tid, tgid);
+    if ((cfg->flags & CFG_CGROUP_FILTER) && bpf_current_task_under_cgroup(&cgroup_filter, 0) == 1)
+        s->flags |= START_IN_CGROUP;
+}
+
+// Charges the on-CPU slice that just ended to prev, which is still current
+static __always_inline void account_oncpu(const struct analyzer_config *cfg, __u32 tid,
+                                          const struct task_start *s, __u64 delta_ns)
+{
+    struct tgid_stats *st = lookup_tgid_stats(s->tgid);
+    if (st)
+        account(&st->oncpu, delta_ns);
+    if (tid_stats_wanted(cfg, s)) {
+        struct tid_stats *ts = lookup_tid_stats(tid, s->tgid);
+        if (ts)
+            account(&ts->oncpu, delta_ns);
+    }
+    if (!config_wants(cfg, s))
+        return;
+    if (cfg->flags & CFG_TGID_HIST) {
+        struct tgid_hist *h = lookup_hist(&tgid_hists, LRU_TGID_HISTS, s->tgid);
+        if (h)
+            __sync_fetch_and_add(&h->oncpu.slots[hist_slot(delta_ns)], 1);
+    }
+    __u32 bucket = log2_u64(delta_ns / 1000);
+    if (bucket >= BLOCKED_HIST_BUCKETS)
+        bucket = BLOCKED_HIST_BUCKETS - 1;
+    __u64 *cnt = bpf_map_lookup_elem(&oncpu_hist, &bucket);
+    if (cnt)
+        (*cnt)++;
+}
+
+// Keeps an interval if it is one of this CPU's longest of its kind: a free
+// slot is filled, else the shortest entry is replaced.
+static __always_inline void topk_add(const struct analyzer_config *cfg, __u32 kind, __u32 tid,
+                                     const struct task_start *s, const char *comm, __u64 delta_ns)
+{
+    __u32 key = kind * 2 + (cfg->topk_slot & 1);
+    struct topk_list *l = bpf_map_lookup_elem(&topk, &key);
+    if (!l)
+        return;
+
+    __u32 i = l->len;
+    if (i < TOPK_ENTRIES) {
+        l->len = i + 1;
+    } else {
+        i = l->min_idx;
+        if (i >= TOPK_ENTRIES || delta_ns <= l->e[i].delta_ns)
+            return;
+    }
+    struct topk_entry *e = &l->e[i];
+    e->delta_ns = delta_ns;
+    e->start_ns = s->ts_ns;
+    e->tid = tid;
+    e->tgid = s->tgid;
+    e->state = s->state;
+    __builtin_memcpy(e->comm, comm, sizeof(e->comm));
+
+    if (l->len < TOPK_ENTRIES)
+        return;
+    __u32 min_idx = 0;
+    __u64 min_ns = l->e[0].delta_ns;
+    for (__u32 j = 1; j < TOPK_ENTRIES; j++) {
+        if (l->e[j].delta_ns < min_ns) {
+            min_ns = l->e[j].delta_ns;
+            min_idx = j;
+        }
+    }
+    l->min_idx = min_idx;
+}
+
+// --sched: the scheduling class of the current task
+static __always_inline void current_sched_class(struct task_start *s)
+{
+    struct task_struct *task = (struct task_struct *)bpf_get_current_task();
+    unsigned int policy = 0, rt_priority = 0;
+    int static_prio = 120;
+
+    bpf_core_read(&policy, sizeof(policy), &task->policy);
+    bpf_core_read(&rt_priority, sizeof(rt_priority), &task->rt_priority);
+    bpf_core_read(&static_prio, sizeof(static_prio), &task->static_prio);
+    s->policy = policy;
+    s->flags |= START_SCHED;
+    if (policy == SCHED_FIFO || policy == SCHED_RR)
+        s->prio = rt_priority;
+    else if (policy == SCHED_DEADLINE)
+        s->prio = 0;
+    else
+        s->prio = static_prio - 120;
+}
+
+// Band of a task from the kernel prio: -1 for deadline, 0..99 for
+// realtime, 100..139 for nice -20..19
+static __always_inline __u32 sched_band(int prio)
+{
+    if (prio < 0)
+        return SCHED_BAND_DEADLINE;
+    if (prio < 100)
+        return SCHED_BAND_RT;
+    if (prio < 120)
+        return SCHED_BAND_NICE_NEG;
+    return prio == 120 ? SCHED_BAND_NICE_0 : SCHED_BAND_NICE_POS;
+}
+
+static __always_inline struct sched_stat *lookup_sched_stat(const struct task_start *s)
+{
+    struct sched_key key = { .policy = s->policy, .prio = s->prio };
+    struct sched_stat *ss = bpf_map_lookup_elem(&sched_stats, &key);
+    if (ss)
+        return ss;
+
+    bpf_map_update_elem(&sched_stats, &key, &empty_sched_stat, BPF_NOEXIST);
+    return bpf_map_lookup_elem(&sched_stats, &key);
+}
+
+static __always_inline void account_preempt(const struct task_start *s, __u64 delta_ns)
+{
+    struct preempt_key key = { .victim_tgid = s->tgid, .preemptor_tgid = s->preemptor_tgid };
+    __builtin_memcpy(key.preemptor_comm, s->preemptor_comm, sizeof(key.preemptor_comm));
+
+    struct time_stat *ts = bpf_map_lookup_elem(&preempt_stats, &key);
+    if (!ts) {
+        struct time_stat zero = {};
+        if (bpf_map_update_elem(&preempt_stats, &key, &zero, BPF_NOEXIST) == 0)
+            lru_count(LRU_PREEMPT_STATS, true);
+        ts = bpf_map_lookup_elem(&preempt_stats, &key);
+        if (!ts)
+            return;
+    }
+    account(ts, delta_ns);
+}
+
+static __always_inline void flame_count(__u32 counter)
+{
+    __u64 *n = bpf_map_lookup_elem(&flame_counters, &counter);
+    if (n)
+        (*n)++;
+}
+
+// -EFAULT only means there was no stack to walk, like the user stack of a
+// kernel thread
+static __always_inline __s32 flame_stackid(void *ctx, __u64 flags)
+{
+    __s32 id = bpf_get_stackid(ctx, &stacks, flags);
+    if (id < 0 && id != -14 /* EFAULT */)
+        flame_count(FLAME_STACK_LOST);
+    return id;
+}
+
+static __always_inline void flame_add(const struct flame_key *key, __u64 delta_ns)
+{
+    __u64 *ns = bpf_map_lookup_elem(&flame_counts, key);
+    if (!ns) {
+        __u64 zero = 0;
+        bpf_map_update_elem(&flame_counts, key, &zero, BPF_NOEXIST);
+        ns = bpf_map_lookup_elem(&flame_counts, key);
+        if (!ns) {
+            flame_count(FLAME_COUNT_LOST);
+            return;
+        }
+    }
+    __sync_fetch_and_add(ns, delta_ns);
+}
+
+static __always_inline __s32 current_syscall(void)
+{
+    __s32 *nr = bpf_task_storage_get(&task_syscall, bpf_get_current_task_btf(), 0, 0);
+    return nr ? *nr : SYSCALL_NONE;
+}
+
+static __always_inline void account_syscall(__u32 tgid, __s32 nr, bool blocked, __u64 delta_ns)
+{
+    struct syscall_key key = { .tgid = tgid, .nr = nr };
+    struct syscall_stat *st = bpf_map_lookup_elem(&syscall_stats, &key);
+    if (!st) {
+        if (bpf_map_update_elem(&syscall_stats, &key, &empty_syscall_stat, BPF_NOEXIST) == 0)
+            lru_count(LRU_SYSCALL_STATS, true);
+        st = bpf_map_lookup_elem(&syscall_stats, &key);
+        if (!st)
+            return;
+    }
+
+    __u32 slot = hist_slot(delta_ns);
+    if (blocked) {
+        account(&st->blocked, delta_ns);
+        __sync_fetch_and_add(&st->blocked_hist.slots[slot], 1);
+    } else {
+        account(&st->offcpu, delta_ns);
+        __sync_fetch_and_add(&st->offcpu_hist.slots[slot], 1);
+    }
+}
+
+static __always_inline struct futex_stat *lookup_futex_stat(struct futex_key *key)
+{
+    struct futex_stat *fs = bpf_map_lookup_elem(&futex_stats, key);
+    if (fs)
+        return fs;
+
+    if (bpf_map_update_elem(&futex_stats, key, &empty_futex_stat, BPF_NOEXIST) == 0)
+        lru_count(LRU_FUTEX_STATS, true);
+    return bpf_map_lookup_elem(&futex_stats, key);
+}
+
+// The thread left its futex wait (returned, or exits)
+static __always_inline void futex_wait_done(__u32 tid)
+{
+    struct futex_wait *w = bpf_map_lookup_elem(&futex_waits, &tid);
+    if (!w)
+        return;
+
+    struct futex_key key = { .tgid = w->tgid, .uaddr = w->uaddr };
+    struct futex_stat *fs = bpf_map_lookup_elem(&futex_stats, &key);
+    if (fs)
+        __sync_fetch_and_add(&fs->waiters, -1);
+    lru_delete(&futex_waits, LRU_FUTEX_WAITS, &tid);
+}
+
+static __always_inline void flight_record(const struct analyzer_config *cfg,
+                                          struct trace_event_raw_sched_switch *ctx, __u64 now)
+{
+    __u32 zero = 0;
+    __u64 *head = bpf_map_lookup_elem(&flight_head, &zero);
+    if (!head)
+        return;
+
+    __u32 idx = bpf_get_smp_processor_id() * (cfg->flight_mask + 1) + ((__u32)*head & cfg->flight_mask);
+    struct flight_rec *r = bpf_map_lookup_elem(&flight_recs, &idx);
+    if (!r)
+        return;
+    r->ts_ns = now;
+    r->prev_tid = ctx->prev_pid;
+    r->prev_tgid = bpf_get_current_pid_tgid() >> 32;
+    r->next_tid = ctx->next_pid;
+    r->prev_state = ctx->prev_state;
+    (*head)++;
+}
+
 SEC("tracepoint/sched/sched_switch")
 int handle_sched_switch(struct trace_event_raw_sched_switch *ctx)
 {
     
     __u64 now = bpf_ktime_get_ns();
+    struct analyzer_config cfg;
+    read_config(&cfg);
+    __u32 flags = cfg.flags;
+    if (flags & CFG_FLIGHT)
+        flight_record(&cfg, ctx, now);
+
+    // The slice prev ends here is charged below, once prev's record is
+    // built; the final slice of an exiting task is not.
+    __u64 oncpu_ns = 0;
+    if (flags & CFG_ONCPU) {
+        __u32 zero = 0;
+        struct oncpu_slot *slot = bpf_map_lookup_elem(&oncpu_start, &zero);
+        if (slot) {
+            if (slot->ts_ns && slot->tid == (__u32)ctx->prev_pid && ctx->prev_pid != 0)
+                oncpu_ns = now - slot->ts_ns;
+            slot->ts_ns = now;
+            slot->tid = ctx->next_pid;
+        }
+    }
 
     __u32 next_tid = ctx->next_pid;
-    __u64 *t0p = bpf_map_lookup_elem(&offcpu_start, &next_tid);
+    struct task_start *t0p = bpf_map_lookup_elem(&offcpu_start, &next_tid);
+    // The tracepoint only has next's TID. Its thread group is known from its
+    // last switch-out; for a task never seen switched out it is 0 (unknown),
+    // as taking the TID for it would be wrong for every thread but the leader.
+    __u32 next_tgid = t0p ? t0p->tgid : 0;
     if (t0p) {
-        __u64 t0 = *t0p;
-        struct offcpu_sample *ev = bpf_ringbuf_reserve(&rb, sizeof(*ev), 0);
-        if (ev) {
+        __u64 t0 = t0p->ts_ns;
+        __u32 tgid = t0p->tgid;
+        __s32 syscall = t0p->syscall;
+        bool wanted = config_wants(&cfg, t0p) && now - t0 >= cfg.min_offcpu_ns &&
+                      !(flags & CFG_NO_SAMPLES);
+        struct offcpu_sample *ev;
+        if (wanted && (ev = bpf_ringbuf_reserve(&rb, sizeof(*ev), 0))) {
             ev->tid = next_tid;
-            ev->tgid = 0;
+            ev->tgid = tgid;
             ev->t0_ns = t0;
             ev->t2_ns = now;
             ev->delta_ns = now - t0;
-            bpf_ringbuf_submit(ev, 0);
+            ev->ns_tid = t0p->ns_tid;
+            ev->ns_tgid = t0p->ns_tgid;
+            bpf_ringbuf_submit(ev, ringbuf_wakeup(&rb, &cfg, RB_SIZE));
+        }
+        struct tgid_stats *st = lookup_tgid_stats(tgid);
+        if (st)
+            account(&st->offcpu, now - t0);
+        if (flags & CFG_SYSCALLS)
+            account_syscall(tgid, syscall, false, now - t0);
+        if (tid_stats_wanted(&cfg, t0p)) {
+            struct tid_stats *ts = lookup_tid_stats(next_tid, tgid);
+            if (ts) {
+                account(&ts->offcpu, now - t0);
+                __builtin_memcpy(ts->comm, ctx->next_comm, sizeof(ts->comm));
+            }
+        }
+        if ((flags & CFG_TGID_HIST) && config_wants(&cfg, t0p)) {
+            struct tgid_hist *h = lookup_hist(&tgid_hists, LRU_TGID_HISTS, tgid);
+            if (h)
+                __sync_fetch_and_add(&h->offcpu.slots[hist_slot(now - t0)], 1);
+        }
+        if ((flags & CFG_TID_HIST) && config_wants(&cfg, t0p)) {
+            struct tgid_hist *h = lookup_hist(&tid_hists, LRU_TID_HISTS, next_tid);
+            if (h)
+                __sync_fetch_and_add(&h->offcpu.slots[hist_slot(now - t0)], 1);
+        }
+        if (wanted && (flags & CFG_OFFCPU_HIST)) {
+            __u32 bucket = log2_u64((now - t0) / 1000);
+            if (bucket >= BLOCKED_HIST_BUCKETS)
+                bucket = BLOCKED_HIST_BUCKETS - 1;
+            __u64 *cnt = bpf_map_lookup_elem(&offcpu_hist, &bucket);
+            if (cnt)
+                (*cnt)++;
+        }
+        if (flags & CFG_CGROUP_STATS)
+            account_cgroup(t0p->cgid, GROUP_OFFCPU, now - t0);
+        if (flags & CFG_TARGETS)
+            account_target(t0p->target, GROUP_OFFCPU, now - t0);
+        if ((flags & CFG_SCHED) && (t0p->flags & START_SCHED) && config_wants(&cfg, t0p)) {
+            struct sched_stat *ss = lookup_sched_stat(t0p);
+            if (ss)
+                account(&ss->offcpu, now - t0);
         }
-        bpf_map_delete_elem(&offcpu_start, &next_tid);
+        if ((flags & CFG_OUTLIERS) && config_wants(&cfg, t0p))
+            topk_add(&cfg, TOPK_OFFCPU, next_tid, t0p, ctx->next_comm, now - t0);
+        lru_delete(&offcpu_start, LRU_OFFCPU_START, &next_tid);
+    }
+
+    struct task_start *t1p = bpf_map_lookup_elem(&runq_start, &next_tid);
+    if (t1p) {
+        struct tgid_stats *st = lookup_tgid_stats(t1p->tgid);
+        if (st)
+            account(&st->runq, now - t1p->ts_ns);
+        if (tid_stats_wanted(&cfg, t1p)) {
+            struct tid_stats *ts = lookup_tid_stats(next_tid, t1p->tgid);
+            if (ts) {
+                account(&ts->runq, now - t1p->ts_ns);
+                __builtin_memcpy(ts->comm, ctx->next_comm, sizeof(ts->comm));
+            }
+        }
+        if (flags & CFG_CGROUP_STATS)
+            account_cgroup(t1p->cgid, GROUP_RUNQ, now - t1p->ts_ns);
+        if (flags & CFG_TARGETS)
+            account_target(t1p->target, GROUP_RUNQ, now - t1p->ts_ns);
+        if ((flags & CFG_SCHED) && (t1p->flags & START_SCHED) && config_wants(&cfg, t1p)) {
+            struct sched_stat *ss = lookup_sched_stat(t1p);
+            if (ss) {
+                account(&ss->runq, now - t1p->ts_ns);
+                __sync_fetch_and_add(&ss->runq_hist.slots[hist_slot(now - t1p->ts_ns)], 1);
+            }
+        }
+        if ((flags & CFG_PREEMPT) && (t1p->flags & START_PREEMPTED) && config_wants(&cfg, t1p))
+            account_preempt(t1p, now - t1p->ts_ns);
+        if ((flags & CFG_OUTLIERS) && config_wants(&cfg, t1p))
+            topk_add(&cfg, TOPK_RUNQ, next_tid, t1p, ctx->next_comm, now - t1p->ts_ns);
+        lru_delete(&runq_start, LRU_RUNQ_START, &next_tid);
     }
 
     __u32 prev_tid = ctx->prev_pid;
-    bpf_map_update_elem(&offcpu_start, &prev_tid, &now, BPF_ANY);
+    // An exiting thread never comes back; recording it would only leave an
+    // entry behind for the next thread that reuses the TID.
+    if (ctx->prev_state & (EXIT_ZOMBIE | EXIT_DEAD))
+        return 0;
+    // prev is still current here, so its thread group is at hand
+    struct task_start start = {
+        .ts_ns = now,
+        .tgid = bpf_get_current_pid_tgid() >> 32,
+        .syscall = (flags & CFG_SYSCALLS) ? current_syscall() : SYSCALL_NONE,
+        .flags = (ctx->prev_state & TASK_UNINTERRUPTIBLE) ? START_D_STATE : 0,
+        .state = ctx->prev_state,
+        .target = TARGET_NONE,
+        .cgid = (flags & CFG_CGROUP_STATS) ? bpf_get_current_cgroup_id() : 0,
+        .user_stack = -1,
+        .kern_stack = -1,
+    };
+    current_filter_ids(&cfg, &start, prev_tid);
+    if ((flags & CFG_PIDNS) && start.ns_tgid != 0)
+        lru_insert(&ns_tgids, LRU_NS_TGIDS, &start.tgid, &start.ns_tgid, sizeof(start.ns_tgid));
+    if (flags & CFG_SCHED)
+        current_sched_class(&start);
+    if (oncpu_ns)
+        account_oncpu(&cfg, prev_tid, &start, oncpu_ns);
+    lru_insert(&offcpu_start, LRU_OFFCPU_START, &prev_tid, &start, sizeof(start));
 
 
-    if (ctx->prev_state != 0) {
-        bpf_map_update_elem(&blocked_start, &prev_tid, &now, BPF_ANY);
+    if (ctx->prev_state != 0 && ctx->prev_state != TASK_REPORT_MAX) {
+        // Where it went to sleep, charged with the blocked time at wakeup
+        if ((flags & CFG_FLAME) && config_wants(&cfg, &start)) {
+            start.user_stack = flame_stackid(ctx, BPF_F_USER_STACK);
+            start.kern_stack = flame_stackid(ctx, 0);
+        }
+        lru_insert(&blocked_start, LRU_BLOCKED_START, &prev_tid, &start, sizeof(start));
+    } else {
+        // Preempted, or yielded, in favour of next
+        if ((flags & CFG_SCHED) && prev_tid != 0 && next_tid != 0 && config_wants(&cfg, &start)) {
+            struct sched_stat *ss = lookup_sched_stat(&start);
+            __u32 band = sched_band(ctx->next_prio);
+            if (ss && band < SCHED_BANDS)
+                __sync_fetch_and_add(&ss->preempted_by[band], 1);
+        }
+        if ((flags & CFG_PREEMPT) && prev_tid != 0 && next_tid != 0) {
+            start.flags |= START_PREEMPTED;
+            start.preemptor_tgid = next_tgid;
+            __builtin_memcpy(start.preemptor_comm, ctx->next_comm, sizeof(start.preemptor_comm));
+        }
+        lru_insert(&runq_start, LRU_RUNQ_START, &prev_tid, &start, sizeof(start));
     }
 
     return 0;
 }
 
-SEC("tracepoint/sched/sched_wakeup")
-int handle_sched_wakeup(struct sched_wakeup_args *ctx)
+static __always_inline int handle_wakeup(__u32 tid, const char *comm)
 {
     __u64 now = bpf_ktime_get_ns();
-    __u32 tid = ctx->pid;
 
-    __u64 *t0p = bpf_map_lookup_elem(&blocked_start, &tid);
+    struct task_start *t0p = bpf_map_lookup_elem(&blocked_start, &tid);
     if (!t0p)
         return 0;
 
-    __u64 delta_ns = now - *t0p;
+    struct task_start t1 = {
+        .ts_ns = now,
+        .tgid = t0p->tgid,
+        .syscall = t0p->syscall,
+        .flags = t0p->flags & (START_IN_CGROUP | START_SCHED),
+        .target = t0p->target,
+        .cgid = t0p->cgid,
+        .ns_tid = t0p->ns_tid,
+        .ns_tgid = t0p->ns_tgid,
+        .state = t0p->state,
+        .policy = t0p->policy,
+        .prio = t0p->prio,
+    };
+    __u64 delta_ns = now - t0p->ts_ns;
     __u64 delta_us = delta_ns / 1000;
     __u32 bucket = log2_u64(delta_us);
     if (bucket >= BLOCKED_HIST_BUCKETS)
         bucket = BLOCKED_HIST_BUCKETS - 1;
 
-    __u64 *cnt = bpf_map_lookup_elem(&blocked_hist, &bucket);
-    if (cnt)
-        __sync_fetch_and_add(cnt, 1);
+    struct analyzer_config cfg;
+    read_config(&cfg);
+    if (config_wants(&cfg, &t1)) {
+        __u64 *cnt = bpf_map_lookup_elem(&blocked_hist, &bucket);
+        if (cnt)
+            (*cnt)++;
+    }
 
-    bpf_map_delete_elem(&blocked_start, &tid);
+    struct tgid_stats *st = lookup_tgid_stats(t1.tgid);
+    if (st)
+        account(&st->blocked, delta_ns);
+    __u32 flags = cfg.flags;
+    if (tid_stats_wanted(&cfg, &t1)) {
+        struct tid_stats *ts = lookup_tid_stats(tid, t1.tgid);
+        if (ts)
+            account(&ts->blocked, delta_ns);
+    }
+    if ((flags & CFG_TGID_HIST) && config_wants(&cfg, &t1)) {
+        struct tgid_hist *h = lookup_hist(&tgid_hists, LRU_TGID_HISTS, t1.tgid);
+        if (h)
+            __sync_fetch_and_add(&h->blocked.slots[hist_slot(delta_ns)], 1);
+    }
+    if ((flags & CFG_TID_HIST) && config_wants(&cfg, &t1)) {
+        struct tgid_hist *h = lookup_hist(&tid_hists, LRU_TID_HISTS, tid);
+        if (h)
+            __sync_fetch_and_add(&h->blocked.slots[hist_slot(delta_ns)], 1);
+    }
+    if (flags & CFG_SYSCALLS)
+        account_syscall(t1.tgid, t1.syscall, true, delta_ns);
+    if (flags & CFG_CGROUP_STATS)
+        account_cgroup(t1.cgid, GROUP_BLOCKED, delta_ns);
+    if (flags & CFG_TARGETS)
+        account_target(t1.target, GROUP_BLOCKED, delta_ns);
+    if ((flags & CFG_OUTLIERS) && config_wants(&cfg, &t1))
+        topk_add(&cfg, TOPK_BLOCKED, tid, t0p, comm, delta_ns);
+    if ((flags & CFG_FLAME) && (t0p->user_stack >= 0 || t0p->kern_stack >= 0)) {
+        struct flame_key key = {
+            .tgid = t1.tgid,
+            .user_stack = t0p->user_stack,
+            .kern_stack = t0p->kern_stack,
+        };
+        __builtin_memcpy(key.comm, comm, sizeof(key.comm));
+        flame_add(&key, delta_ns);
+    }
+    if ((flags & CFG_BLOCKIO) && (t0p->flags & START_D_STATE)) {
+        __u32 cls = (t0p->flags & START_IO_DONE) ? DSTATE_BLOCK_IO : DSTATE_OTHER;
+        struct log2_hist *h = bpf_map_lookup_elem(&dstate_hist, &cls);
+        if (h)
+            __sync_fetch_and_add(&h->slots[hist_slot(delta_ns)], 1);
+        if (st)
+            account(cls == DSTATE_BLOCK_IO ? &st->io_wait : &st->dstate_other, delta_ns);
+    }
+    if (flags & CFG_FUTEX) {
+        struct futex_wait *w = bpf_map_lookup_elem(&futex_waits, &tid);
+        if (w) {
+            struct futex_key key = { .tgid = w->tgid, .uaddr = w->uaddr };
+            struct futex_stat *fs = bpf_map_lookup_elem(&futex_stats, &key);
+            if (fs) {
+                account(&fs->wait, delta_ns);
+                __sync_fetch_and_add(&fs->hist.slots[hist_slot(delta_ns)], 1);
+            }
+        }
+    }
+
+    lru_delete(&blocked_start, LRU_BLOCKED_START, &tid);
+    lru_insert(&runq_start, LRU_RUNQ_START, &tid, &t1, sizeof(t1));
     return 0;
 }
 
+SEC("tracepoint/sched/sched_wakeup")
+int handle_sched_wakeup(struct sched_wakeup_args *ctx)
+{
+    return handle_wakeup(ctx->pid, ctx->comm);
+}
+
+// A brand new task has no blocked_start entry, so its first run-queue wait
+// is not charged: the tracepoint does not say which thread group it is in.
 SEC("tracepoint/sched/sched_wakeup_new")
 int handle_sched_wakeup_new(struct sched_wakeup_args *ctx)
 {
-    __u64 now = bpf_ktime_get_ns();
-    __u32 tid = ctx->pid;
+    return handle_wakeup(ctx->pid, ctx->comm);
+}
 
-    __u64 *t0p = bpf_map_lookup_elem(&blocked_start, &tid);
-    if (!t0p)
+// Only attached with --flame, to a CPU clock sampler on each CPU. The clock
+// counts nanoseconds, so a sample stands for sample_period of them.
+SEC("perf_event")
+int handle_cpu_sample(struct bpf_perf_event_data *ctx)
+{
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    __u32 tid = (__u32)pid_tgid;
+    if (tid == 0)   // idle
         return 0;
 
-    __u64 delta_ns = now - *t0p;
-    __u64 delta_us = delta_ns / 1000;
-    __u32 bucket = log2_u64(delta_us);
-    if (bucket >= BLOCKED_HIST_BUCKETS)
-        bucket = BLOCKED_HIST_BUCKETS - 1;
+    struct analyzer_config cfg;
+    read_config(&cfg);
+    struct task_start s = { .tgid = pid_tgid >> 32, .target = TARGET_NONE };
+    current_filter_ids(&cfg, &s, tid);
+    if (!(cfg.flags & CFG_FLAME) || !config_wants(&cfg, &s))
+        return 0;
 
-    __u64 *cnt = bpf_map_lookup_elem(&blocked_hist, &bucket);
-    if (cnt)
-        __sync_fetch_and_add(cnt, 1);
+    struct flame_key key = {
+        .tgid = s.tgid,
+        .oncpu = 1,
+        .user_stack = flame_stackid(ctx, BPF_F_USER_STACK),
+        .kern_stack = flame_stackid(ctx, 0),
+    };
+    bpf_get_current_comm(key.comm, sizeof(key.comm));
+    flame_add(&key, ctx->sample_period);
+    return 0;
+}
 
-    bpf_map_delete_elem(&blocked_start, &tid);
+static __always_inline void io_count(__u32 counter)
+{
+    __u64 *n = bpf_map_lookup_elem(&io_counters, &counter);
+    if (n)
+        (*n)++;
+}
+
+// Only attached with --blockio
+SEC("tracepoint/block/block_rq_issue")
+int handle_block_rq_issue(struct trace_event_raw_block_rq *ctx)
+{
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    struct io_req_key key = { .dev = ctx->dev, .sector = ctx->sector };
+    struct io_req req = {
+        .issue_ns = bpf_ktime_get_ns(),
+        .tid = (__u32)pid_tgid,
+        .tgid = pid_tgid >> 32,
+    };
+
+    // The key is only {dev, sector}: a request still there was either
+    // never seen completing or is overlapped by this one. Either way it is
+    // replaced, and counted.
+    struct io_req *old = bpf_map_lookup_elem(&io_inflight, &key);
+    if (old) {
+        io_count(IO_REPLACED);
+        *old = req;
+    } else if (bpf_map_update_elem(&io_inflight, &key, &req, BPF_NOEXIST) == 0) {
+        lru_count(LRU_IO_INFLIGHT, true);
+    }
     return 0;
 }
 
+SEC("tracepoint/block/block_rq_complete")
+int handle_block_rq_complete(struct trace_event_raw_block_rq_completion *ctx)
+{
+    struct io_req_key key = { .dev = ctx->dev, .sector = ctx->sector };
+    struct io_req *req = bpf_map_lookup_elem(&io_inflight, &key);
+    if (!req)
+        return 0;
+
+    __u64 lat_ns = bpf_ktime_get_ns() - req->issue_ns;
+    // Most likely a request whose completion was missed, at a sector that
+    // has not been issued to again since
+    if (lat_ns >= IO_STALE_NS) {
+        io_count(IO_STALE);
+        lru_delete(&io_inflight, LRU_IO_INFLIGHT, &key);
+        return 0;
+    }
+    __u32 dev = key.dev;
+    struct io_dev_stat *ds = bpf_map_lookup_elem(&io_dev_stats, &dev);
+    if (!ds) {
+        struct io_dev_stat zero = {};
+        bpf_map_update_elem(&io_dev_stats, &dev, &zero, BPF_NOEXIST);
+        ds = bpf_map_lookup_elem(&io_dev_stats, &dev);
+    }
+    if (ds) {
+        account(&ds->lat, lat_ns);
+        __sync_fetch_and_add(&ds->hist.slots[hist_slot(lat_ns)], 1);
+    }
+
+    // Tie the completion back to the issuer: if it is still asleep, the
+    // wakeup that follows ends a block IO wait. The flag is only ever set,
+    // so a plain OR does; a 32-bit atomic OR would need -mcpu=v3.
+    __u32 tid = req->tid;
+    struct task_start *bs = bpf_map_lookup_elem(&blocked_start, &tid);
+    if (bs)
+        bs->flags |= START_IO_DONE;
+
+    lru_delete(&io_inflight, LRU_IO_INFLIGHT, &key);
+    return 0;
+}
+
+// Only attached with --syscalls
+SEC("tracepoint/raw_syscalls/sys_enter")
+int handle_sys_enter(struct trace_event_raw_sys_enter *ctx)
+{
+    __s32 *nr = bpf_task_storage_get(&task_syscall, bpf_get_current_task_btf(), 0,
+                                     BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (nr)
+        *nr = (__s32)ctx->id;
+    return 0;
+}
+
+SEC("tracepoint/raw_syscalls/sys_exit")
+int handle_sys_exit(struct trace_event_raw_sys_exit *ctx)
+{
+    __s32 *nr = bpf_task_storage_get(&task_syscall, bpf_get_current_task_btf(), 0, 0);
+    if (nr)
+        *nr = SYSCALL_NONE;
+    return 0;
+}
+
+// Only attached with --futex. futex_waitv() waits on several words at once
+// and is not tracked.
+SEC("tracepoint/syscalls/sys_enter_futex")
+int handle_futex_enter(struct sys_enter_futex_args *ctx)
+{
+    __u32 cmd = ctx->op & FUTEX_CMD_MASK;
+    if (cmd != FUTEX_WAIT && cmd != FUTEX_WAIT_BITSET && cmd != FUTEX_LOCK_PI &&
+        cmd != FUTEX_LOCK_PI2 && cmd != FUTEX_WAIT_REQUEUE_PI)
+        return 0;
+
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    __u32 tid = (__u32)pid_tgid;
+    struct futex_key key = { .tgid = pid_tgid >> 32, .uaddr = ctx->uaddr };
+    struct futex_stat *fs = lookup_futex_stat(&key);
+    if (!fs)
+        return 0;
+
+    __sync_fetch_and_add(&fs->waits, 1);
+    __sync_fetch_and_add(&fs->waiters, 1);
+    // Racy like account()'s max: good enough to spot a convoy
+    if (fs->waiters > 0 && (__u64)fs->waiters > fs->max_waiters)
+        fs->max_waiters = fs->waiters;
+
+    struct futex_wait w = { .uaddr = ctx->uaddr, .tgid = key.tgid };
+    lru_insert(&futex_waits, LRU_FUTEX_WAITS, &tid, &w, sizeof(w));
+    return 0;
+}
+
+SEC("tracepoint/syscalls/sys_exit_futex")
+int handle_futex_exit(void *ctx)
+{
+    futex_wait_done((__u32)bpf_get_current_pid_tgid());
+    return 0;
+}
+
+// Only attached with a target set: a new process forked by a matching one
+// joins its parent's target. New threads are already covered by their
+// thread group. The parent is current.
+SEC("tp_btf/sched_process_fork")
+int BPF_PROG(handle_process_fork, struct task_struct *parent, struct task_struct *child)
+{
+    __u32 child_tgid = child->tgid;
+    if (child_tgid == (__u32)parent->tgid)
+        return 0;
+
+    struct analyzer_config cfg;
+    read_config(&cfg);
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    __u32 tid = (__u32)pid_tgid, tgid = pid_tgid >> 32;
+    if (cfg.flags & CFG_PIDNS) {
+        tid = tgid = 0;
+        current_ns_ids(&cfg, &tid, &tgid);
+        child_tgid = task_ns_pid(child, cfg.pidns_ino);
+        if (tgid == 0 || child_tgid == 0)
+            return 0;
+    }
+
+    __u32 target = current_target(tid, tgid);
+    if (target != TARGET_NONE)
+        bpf_map_update_elem(&target_pids, &child_tgid, &target, BPF_ANY);
+    return 0;
+}
+
+static __always_inline void time_stat_fold(struct time_stat *dst, const struct time_stat *src)
+{
+    __sync_fetch_and_add(&dst->total_ns, src->total_ns);
+    __sync_fetch_and_add(&dst->count, src->count);
+    if (src->max_ns > dst->max_ns)
+        dst->max_ns = src->max_ns;
+}
+
+// --threads: what an exiting thread accumulated stays with the threads of
+// its comm instead of leaving its group's totals with it
+static __always_inline void fold_thread_exit(__u32 tid)
+{
+    struct tid_stats *ts = bpf_map_lookup_elem(&tid_stats, &tid);
+    if (!ts)
+        return;
+
+    struct thread_exit_key key = { .tgid = ts->tgid };
+    __builtin_memcpy(key.comm, ts->comm, sizeof(key.comm));
+    struct group_stat *gs = bpf_map_lookup_elem(&thread_exits, &key);
+    if (!gs) {
+        lru_insert(&thread_exits, LRU_THREAD_EXITS, &key, &empty_group_stat, sizeof(empty_group_stat));
+        gs = bpf_map_lookup_elem(&thread_exits, &key);
+        if (!gs)
+            return;
+    }
+    time_stat_fold(&gs->offcpu, &ts->offcpu);
+    time_stat_fold(&gs->blocked, &ts->blocked);
+    time_stat_fold(&gs->runq, &ts->runq);
+
+    struct tgid_hist *h = bpf_map_lookup_elem(&tid_hists, &tid);
+    if (!h)
+        return;
+    for (__u32 b = 0; b < HIST_SLOTS; b++) {
+        __sync_fetch_and_add(&gs->offcpu_hist.slots[b], h->offcpu.slots[b]);
+        __sync_fetch_and_add(&gs->blocked_hist.slots[b], h->blocked.slots[b]);
+    }
+}
+
+SEC("tracepoint/sched/sched_process_exit")
+int handle_sched_process_exit(struct trace_event_raw_sched_process_template *ctx)
+{
+    __u64 pid_tgid = bpf_get_current_pid_tgid();
+    __u32 tid = (__u32)pid_tgid;
+    struct analyzer_config cfg;
+    read_config(&cfg);
+
+    lru_delete(&offcpu_start, LRU_OFFCPU_START, &tid);
+    lru_delete(&blocked_start, LRU_BLOCKED_START, &tid);
+    lru_delete(&runq_start, LRU_RUNQ_START, &tid);
+    if (cfg.flags & CFG_TID_HIST)
+        fold_thread_exit(tid);
+    lru_delete(&tid_stats, LRU_TID_STATS, &tid);
+    lru_delete(&tid_hists, LRU_TID_HISTS, &tid);
+    futex_wait_done(tid);
+    // The process is gone once its leader exits, short of pthread_exit()
+    if (tid == pid_tgid >> 32) {
+        __u32 key = tid;
+        if (cfg.flags & CFG_PIDNS) {
+            __u32 ns_tid = 0;
+            key = 0;
+            current_ns_ids(&cfg, &ns_tid, &key);
+            lru_delete(&ns_tgids, LRU_NS_TGIDS, &tid);
+        }
+        bpf_map_delete_elem(&target_pids, &key);
+    }
+
+    struct exit_event *ev = bpf_ringbuf_reserve(&exit_rb, sizeof(*ev), 0);
+    if (ev) {
+        ev->tid = tid;
+        ev->tgid = pid_tgid >> 32;
+        bpf_ringbuf_submit(ev, ringbuf_wakeup(&exit_rb, &cfg, EXIT_RB_SIZE));
+    }
+    return 0;
+}
+
+// Catches whatever a task left behind between its exit and its final switch.
+SEC("tracepoint/sched/sched_process_free")
+int handle_sched_process_free(struct trace_event_raw_sched_process_template *ctx)
+{
+    __u32 tid = ctx->pid;
+
+    lru_delete(&offcpu_start, LRU_OFFCPU_START, &tid);
+    lru_delete(&blocked_start, LRU_BLOCKED_START, &tid);
+    lru_delete(&runq_start, LRU_RUNQ_START, &tid);
+    return 0;
+}
@@ -4,17 +4,36 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/perf_event.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <elf.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sched.h>
 #include "uthash.h"
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
+#include "cpu_analyzer.h"
 
-struct offcpu_sample {
-    __u32 tid;
-    __u32 tgid;
-    __u64 t0_ns;
-    __u64 t2_ns;
-    __u64 delta_ns;
-};
+// log2(usecs) buckets, as many as the kernel's blocked histogram
+#define HIST_BUCKETS BLOCKED_HIST_BUCKETS
 
 struct tid_to_tgid_entry {
     __u32 tid;              // key
@@ -31,15 +50,31 @@ struct tgid_agg_entry {
     UT_hash_handle hh;
 };
 
+// Histogram deltas for one reporting interval.
+struct interval_snapshot {
+    unsigned long long end_ns;
+    unsigned long long offcpu_total_ns;
+    unsigned long long offcpu[HIST_BUCKETS];
+    unsigned long long blocked[HIST_BUCKETS];
+    struct tgid_stats pid_total;        // --pid only: exact totals so far
+    struct tgid_stats pid_interval;     // --pid only: this interval's share
+};
+
+// Cumulative histograms since startup; also the on-disk snapshot format.
+struct hist_capture {
+    unsigned int interval_sec;
+    __u32 pid;
+    unsigned long long intervals;
+    unsigned long long offcpu[HIST_BUCKETS];
+    unsigned long long blocked[HIST_BUCKETS];
+};
+
 struct tid_to_tgid_entry *g_tid_to_tgid = NULL;
 struct tgid_agg_entry *g_tgid_agg = NULL;
  __u32 g_filter_tgid = 0;
 
-unsigned long long g_offcpu_pid_running_total_ns = 0;
-unsigned long long *g_offcpu_hist_counts = NULL;
-size_t g_offcpu_hist_num_buckets = 0;
-__u64 *g_blocked_hist_prev = NULL;
-__u32 g_blocked_hist_prev_buckets = 0;
+struct hist_capture g_capture;
+struct interval_snapshot g_interval;
 
 unsigned long long get_monotonic_time_ns(void) {
     struct timespec ts;
@@ -92,6 +127,84 @@ __u32 resolve_tgid(__u32 tid, __u32 ev_tgid) {
     return tgid;
 }
 
+// --pidns: PIDs given on the command line or over --control are the ones a
+// PID namespace uses, e.g. a container's as seen by a sidecar inside it. The
+// programs match them through bpf_get_ns_current_pid_tgid() and record the
+// namespace-local ID of every host thread group they see in 'ns_tgids', so
+// reports can print both as NS/HOST.
+int g_pidns = 0;
+const char *g_pidns_path = "/proc/self/ns/pid";
+int g_pidns_proc = 0;               // our /proc shows the namespace's PIDs
+int g_ns_tgids_fd = -1;
+
+// Reverse of 'ns_tgids', rebuilt by pidns_refresh() once per interval
+struct pidns_host {
+    __u32 ns;                       // key
+    __u32 host;
+    UT_hash_handle hh;
+};
+
+struct pidns_host *g_pidns_hosts = NULL;
+struct pidns_host *g_pidns_host_ents = NULL;    // storage, one per 'ns_tgids' entry
+
+// Identifies the namespace for the programs. The helper compares against the
+// kernel's dev_t encoding, not the one stat() returns.
+int pidns_open(struct analyzer_config *cfg) {
+    struct stat st, self;
+
+    if (stat(g_pidns_path, &st) != 0) {
+        fprintf(stderr, "ERROR: cannot stat PID namespace '%s': %s\n", g_pidns_path, strerror(errno));
+        return -1;
+    }
+    cfg->pidns_dev = ((__u64)major(st.st_dev) << 20) | minor(st.st_dev);
+    cfg->pidns_ino = st.st_ino;
+    g_pidns_proc = stat("/proc/self/ns/pid", &self) == 0 &&
+                   self.st_dev == st.st_dev && self.st_ino == st.st_ino;
+    return 0;
+}
+
+// Namespace-local thread group of a host one; 0 if it has not been seen in
+// the namespace
+__u32 pidns_tgid(__u32 host) {
+    __u32 ns = 0;
+    if (g_ns_tgids_fd < 0 || bpf_map_lookup_elem(g_ns_tgids_fd, &host, &ns) != 0)
+        return 0;
+    return ns;
+}
+
+// The host thread group with namespace-local ID ns as of the last
+// pidns_refresh(), or 0 if the programs have not seen it yet
+__u32 pidns_host_tgid(__u32 ns) {
+    struct pidns_host *h;
+
+    if (!g_pidns)
+        return ns;
+    HASH_FIND(hh, g_pidns_hosts, &ns, sizeof(__u32), h);
+    return h ? h->host : 0;
+}
+
+// What a host thread group is compared with g_filter_tgid by
+__u32 tgid_filter_key(__u32 host) {
+    return g_pidns ? pidns_tgid(host) : host;
+}
+
+// The PID of a host thread group in our /proc
+__u32 proc_tgid(__u32 host) {
+    return (g_pidns && g_pidns_proc) ? pidns_tgid(host) : host;
+}
+
+const char *tgid_str(__u32 host, char *buf, size_t len) {
+    __u32 ns = g_pidns ? pidns_tgid(host) : 0;
+
+    if (!g_pidns)
+        snprintf(buf, len, "%u", (unsigned)host);
+    else if (ns)
+        snprintf(buf, len, "%u/%u", (unsigned)ns, (unsigned)host);
+    else
+        snprintf(buf, len, "-/%u", (unsigned)host);
+    return buf;
+}
+
 int append_delta(struct tgid_agg_entry *ent, __u64 delta_ns) {
     if (ent->len == ent->cap) {
         size_t new_cap = ent->cap ? ent->cap * 2 : 16;
@@ -123,92 +236,72 @@ void aggregate_tgid(__u32 tgid, __u64 delta_ns) {
     (void)append_delta(ent, delta_ns);
 }
 
-void print_off_cpu_histogram() {
-    struct tgid_agg_entry *ent, *tmp;
+// A whole decimal number no larger than max, with nothing after it
+int parse_ull(const char *arg, unsigned long long max, unsigned long long *out) {
+    char *end = NULL;
 
-    if (g_filter_tgid != 0) {
-        unsigned long long total_ns = 0;
-        HASH_ITER(hh, g_tgid_agg, ent, tmp) {
-            total_ns += ent->total_delta_ns;
-            HASH_DEL(g_tgid_agg, ent);
-            free(ent->deltas);
-            free(ent);
-        }
-        g_offcpu_pid_running_total_ns += total_ns;
-        double interval_ms = (double)total_ns / 1e6;
-        double running_ms = (double)g_offcpu_pid_running_total_ns / 1e6;
-        printf("PID %u off-cpu this interval: %.3f ms (ns=%llu); running total: %.3f ms (ns=%llu)\n",
-               (unsigned)g_filter_tgid, interval_ms, (unsigned long long)total_ns,
-               running_ms, (unsigned long long)g_offcpu_pid_running_total_ns);
-        return;
-    }
+    errno = 0;
+    if (arg[0] == '-')
+        return -1;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
 
-    size_t max_bucket = 0;
-    HASH_ITER(hh, g_tgid_agg, ent, tmp) {
-        for (size_t i = 0; i < ent->len; i++) {
-            unsigned long long us = ent->deltas[i] / 1000ull;
-            size_t idx = 0;
-            if (us > 1) {
-                unsigned long long v = us;
-                while (v > 1) { v >>= 1; idx++; }
-            }
-            if (idx > max_bucket) max_bucket = idx;
-        }
-    }
+// A --max-* diff threshold: a finite, non-negative number.
+int parse_threshold(const char *arg, double *out) {
+    char *end = NULL;
 
-    size_t needed = max_bucket + 1;
-    if (needed > g_offcpu_hist_num_buckets) {
-        unsigned long long *new_counts = (unsigned long long *)realloc(
-            g_offcpu_hist_counts, needed * sizeof(*new_counts));
-        if (new_counts) {
-            for (size_t i = g_offcpu_hist_num_buckets; i < needed; i++) new_counts[i] = 0ull;
-            g_offcpu_hist_counts = new_counts;
-            g_offcpu_hist_num_buckets = needed;
-        }
-    }
+    errno = 0;
+    double v = strtod(arg, &end);
+    if (errno != 0 || end == arg || *end != '\0' || !isfinite(v) || v < 0.0)
+        return -1;
+    *out = v;
+    return 0;
+}
 
-    HASH_ITER(hh, g_tgid_agg, ent, tmp) {
-        for (size_t i = 0; i < ent->len; i++) {
-            unsigned long long us = ent->deltas[i] / 1000ull;
-            size_t idx = 0;
-            if (us > 1) {
-                unsigned long long v = us;
-                while (v > 1) { v >>= 1; idx++; }
-            }
-            if (idx < g_offcpu_hist_num_buckets)
-                g_offcpu_hist_counts[idx]++;
-        }
+size_t hist_bucket_ns(__u64 delta_ns) {
+    unsigned long long us = delta_ns / 1000ull;
+    size_t idx = 0;
+    if (us > 1) {
+        unsigned long long v = us;
+        while (v > 1) { v >>= 1; idx++; }
     }
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
 
+void print_log2_hist(const char *title, const unsigned long long *counts, size_t buckets) {
     size_t last_nonzero = 0;
-    for (size_t b = 0; b < g_offcpu_hist_num_buckets; b++) {
-        if (g_offcpu_hist_counts[b] != 0)
+    for (size_t b = 0; b < buckets; b++) {
+        if (counts[b] != 0)
             last_nonzero = b;
     }
     const size_t cap_bucket = 21;
     size_t end_bucket = last_nonzero < cap_bucket ? last_nonzero : cap_bucket;
     unsigned long long infinity_count = 0;
     if (last_nonzero > cap_bucket) {
-        for (size_t b = cap_bucket + 1; b < g_offcpu_hist_num_buckets; b++)
-            infinity_count += g_offcpu_hist_counts[b];
+        for (size_t b = cap_bucket + 1; b < buckets; b++)
+            infinity_count += counts[b];
     }
 
     unsigned long long max_count = 0;
     for (size_t b = 0; b <= end_bucket; b++) {
-        if (g_offcpu_hist_counts[b] > max_count) max_count = g_offcpu_hist_counts[b];
+        if (counts[b] > max_count) max_count = counts[b];
     }
     if (infinity_count > max_count) max_count = infinity_count;
 
     const int bar_width = 40;
-    printf("Off-cpu time histogram\n");
-    printf("     usecs               : count    distribution\n");
+    printf("%s\n", title);
+    printf("     usecs                : count    distribution\n");
     for (size_t b = 0; b <= end_bucket; b++) {
         unsigned long long lower = (b == 0) ? 0ull : (1ull << b);
         unsigned long long upper = (1ull << (b + 1)) - 1ull;
 
         int stars = 0;
         if (max_count > 0) {
-            double ratio = (double)g_offcpu_hist_counts[b] / (double)max_count;
+            double ratio = (double)counts[b] / (double)max_count;
             stars = (int)(ratio * bar_width + 0.5);
             if (stars < 0) stars = 0;
             if (stars > bar_width) stars = bar_width;
@@ -223,7 +316,7 @@ void print_off_cpu_histogram() {
         bar[pos] = '\0';
 
         printf(" %10llu -> %-10llu : %-8llu %s\n",
-               lower, upper, (unsigned long long)g_offcpu_hist_counts[b], bar);
+               lower, upper, (unsigned long long)counts[b], bar);
     }
     if (infinity_count > 0) {
         int stars = 0;
@@ -245,7 +338,69 @@ void print_off_cpu_histogram() {
                (unsigned long long)4194303, "infinity",
                (unsigned long long)infinity_count, bar);
     }
+}
+
+int g_csv = 0;                      // --format csv
+int g_csv_header = 0;               // header printed since switching to CSV
+
+// --format csv: one row per histogram and report, in the columns of the
+// heatmap export (log2 usec buckets 0..21, then everything longer).
+void print_hist_csv(const char *name, const unsigned long long *counts, size_t buckets) {
+    const size_t cap_bucket = 21;
+    unsigned long long infinity_count = 0;
+    struct timespec rt;
+
+    if (!g_csv_header) {
+        printf("time_s,hist");
+        for (size_t b = 0; b <= cap_bucket; b++)
+            printf(",%llu", (b == 0) ? 0ull : (1ull << b));
+        printf(",inf\n");
+        g_csv_header = 1;
+    }
+    clock_gettime(CLOCK_REALTIME, &rt);
+    printf("%lld.%03ld,%s", (long long)rt.tv_sec, rt.tv_nsec / 1000000l, name);
+    for (size_t b = 0; b <= cap_bucket; b++)
+        printf(",%llu", b < buckets ? counts[b] : 0ull);
+    for (size_t b = cap_bucket + 1; b < buckets; b++)
+        infinity_count += counts[b];
+    printf(",%llu\n", infinity_count);
+}
+
+void print_hist(const char *title, const char *name, const unsigned long long *counts, size_t buckets) {
+    if (g_csv)
+        print_hist_csv(name, counts, buckets);
+    else
+        print_log2_hist(title, counts, buckets);
+}
+
+// Bins the deltas collected since the last call into counts (if non-NULL)
+// and returns the total off-CPU time they add up to. Entries and their
+// arrays are kept for the next interval; only those of thread groups that
+// had nothing this time are freed.
+unsigned long long drain_off_cpu_interval(unsigned long long *counts) {
+    struct tgid_agg_entry *ent, *tmp;
+    unsigned long long total_ns = 0;
+
+    HASH_ITER(hh, g_tgid_agg, ent, tmp) {
+        if (ent->len == 0) {
+            HASH_DEL(g_tgid_agg, ent);
+            free(ent->deltas);
+            free(ent);
+            continue;
+        }
+        total_ns += ent->total_delta_ns;
+        if (counts) {
+            for (size_t i = 0; i < ent->len; i++)
+                counts[hist_bucket_ns(ent->deltas[i])]++;
+        }
+        ent->total_delta_ns = 0;
+        ent->len = 0;
+    }
+    return total_ns;
+}
 
+void free_tgid_agg(void) {
+    struct tgid_agg_entry *ent, *tmp;
     HASH_ITER(hh, g_tgid_agg, ent, tmp) {
         HASH_DEL(g_tgid_agg, ent);
         free(ent->deltas);
@@ -253,6 +408,33 @@ void print_off_cpu_histogram() {
     }
 }
 
+void print_pid_total(const char *what, const struct time_stat *interval, const struct time_stat *total) {
+    char host[24] = "";
+
+    if (g_pidns) {
+        __u32 h = pidns_host_tgid(g_filter_tgid);
+        if (h)
+            snprintf(host, sizeof(host), " (host %u)", (unsigned)h);
+        else
+            snprintf(host, sizeof(host), " (host -)");
+    }
+    printf("PID %u%s %s this interval: %.3f ms (ns=%llu, n=%llu); running total: %.3f ms (ns=%llu, n=%llu, max %.3f ms)\n",
+           (unsigned)g_filter_tgid, host, what,
+           (double)interval->total_ns / 1e6, (unsigned long long)interval->total_ns,
+           (unsigned long long)interval->count,
+           (double)total->total_ns / 1e6, (unsigned long long)total->total_ns,
+           (unsigned long long)total->count, (double)total->max_ns / 1e6);
+}
+
+void print_off_cpu_histogram(const struct interval_snapshot *iv) {
+    if (g_filter_tgid != 0) {
+        print_pid_total("off-cpu", &iv->pid_interval.offcpu, &iv->pid_total.offcpu);
+        return;
+    }
+
+    print_hist("Off-cpu time histogram", "offcpu", g_capture.offcpu, HIST_BUCKETS);
+}
+
 void free_tid_tgid_cache(void) {
 	struct tid_to_tgid_entry *e, *etmp;
 	HASH_ITER(hh, g_tid_to_tgid, e, etmp) {
@@ -261,277 +443,5587 @@ void free_tid_tgid_cache(void) {
 	}
 }
 
+// Heatmap mode keeps one column of log2 buckets per --heatmap-step of time in
+// a matrix allocated once at startup. Columns are addressed by their absolute
+// index since g_heat_origin_ns and reused round-robin.
+#define HEATMAP_ROWS 23         // buckets 0..21 plus "infinity", as printed
+
+struct heatmap {
+    __u32 *cells;               // cols x HEATMAP_ROWS, one column after another
+    size_t cols;
+    unsigned long long newest;  // absolute index of the newest column in use
+};
+
+int g_heatmap = 0;
+unsigned int g_heatmap_step_ms = 100;
+const char *g_heatmap_out_path = NULL;
+FILE *g_heatmap_out = NULL;
+struct heatmap g_heat_offcpu;
+struct heatmap g_heat_blocked;
+unsigned long long g_heat_origin_ns = 0;
+unsigned long long g_heat_step_ns = 0;
+unsigned long long g_heat_next_step_ns = 0;
+unsigned long long g_heat_emitted = 0;  // first column not yet rendered
+unsigned long long g_heat_blocked_prev[HIST_BUCKETS];
+
+int heatmap_init(struct heatmap *hm, size_t cols) {
+    hm->cells = (__u32 *)calloc(cols * HEATMAP_ROWS, sizeof(__u32));
+    if (!hm->cells)
+        return -1;
+    hm->cols = cols;
+    hm->newest = 0;
+    return 0;
+}
+
+// Returns the cells of absolute column col, or NULL if it has already been
+// recycled. Columns between the previous newest one and col are cleared.
+__u32 *heatmap_column(struct heatmap *hm, unsigned long long col) {
+    if (col + hm->cols <= hm->newest)
+        return NULL;
+    while (hm->newest < col) {
+        hm->newest++;
+        memset(&hm->cells[(hm->newest % hm->cols) * HEATMAP_ROWS], 0,
+               HEATMAP_ROWS * sizeof(__u32));
+    }
+    return &hm->cells[(col % hm->cols) * HEATMAP_ROWS];
+}
+
+void heatmap_add(struct heatmap *hm, unsigned long long ts_ns, size_t bucket, __u32 count) {
+    if (ts_ns < g_heat_origin_ns)
+        return;
+    __u32 *c = heatmap_column(hm, (ts_ns - g_heat_origin_ns) / g_heat_step_ns);
+    if (c)
+        c[bucket < HEATMAP_ROWS ? bucket : HEATMAP_ROWS - 1] += count;
+}
+
 static int handle_rb_event(void *ctx, void *data, size_t data_sz) {
     const struct offcpu_sample *ev = (const struct offcpu_sample *)data;
     (void)ctx;
     (void)data_sz;
     __u32 tgid = resolve_tgid(ev->tid, ev->tgid);
-    if (g_filter_tgid == 0 || tgid == g_filter_tgid) {
+    __u32 filter = __atomic_load_n(&g_filter_tgid, __ATOMIC_RELAXED);   // set by --control
+    if (filter == 0 || (g_pidns ? ev->ns_tgid : tgid) == filter) {
         aggregate_tgid(tgid, ev->delta_ns);
+        if (g_heatmap)
+            heatmap_add(&g_heat_offcpu, ev->t2_ns, hist_bucket_ns(ev->delta_ns), 1);
     }
     return 0;
 }
 
-static struct ring_buffer *g_rb;
-
-void err_check(int argc, char **argv) {
-    if (argc != 2 && argc != 3) {
-        fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "  sudo %s <interval_sec> [pid]\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-    if (geteuid() != 0) {
-        fprintf(stderr, "This program must be run as root.\n");
-        exit(EXIT_FAILURE);
-    }
-    int interval = atoi(argv[1]);
-    if (interval <= 0) {
-        fprintf(stderr, "Time interval must be greater than 0.\n");
-        exit(EXIT_FAILURE);
-    }
-    if (argc == 3) {
-        int pid = atoi(argv[2]);
-        if (pid <= 0) {
-            fprintf(stderr, "PID must be greater than 0 when provided.\n");
-            exit(EXIT_FAILURE);
-        }
+static int handle_exit_event(void *ctx, void *data, size_t data_sz) {
+    const struct exit_event *ev = (const struct exit_event *)data;
+    struct tid_to_tgid_entry *e = NULL;
+    (void)ctx;
+    (void)data_sz;
+    HASH_FIND(hh, g_tid_to_tgid, &ev->tid, sizeof(ev->tid), e);
+    if (e) {
+        HASH_DEL(g_tid_to_tgid, e);
+        free(e);
     }
+    return 0;
 }
 
+static struct ring_buffer *g_rb;
+
 struct bpf_object *g_obj;
-struct bpf_link *g_link_switch;
-struct bpf_link *g_link_wakeup;
-struct bpf_link *g_link_wakeup_new;
+#define MAX_LINKS 32
+struct bpf_link *g_links[MAX_LINKS];
+int g_num_links = 0;
+const char *g_link_names[MAX_LINKS];
 int g_blocked_hist_fd = -1;
+int g_offcpu_hist_fd = -1;
+int g_config_fd = -1;
+struct analyzer_config g_config;
 
-static void print_blocked_histogram(void) {
-    
-    if (g_blocked_hist_fd < 0)
-        return;
+// --pin publishes the maps below and the program links under g_pin_dir;
+// --client reads them there instead of loading anything itself.
+#define DEFAULT_PIN_DIR "/sys/fs/bpf/cpu_analyzer"
+
+static const char *const pinned_maps[] = {
+    "config", "offcpu_hist", "blocked_hist", "tgid_stats",
+    "syscall_stats", "io_dev_stats", "dstate_hist", "futex_stats", "cgroup_stats",
+    "sched_stats", "preempt_stats",
+};
+#define NUM_PINNED_MAPS (sizeof(pinned_maps) / sizeof(pinned_maps[0]))
 
+int g_pin = 0;
+int g_client = 0;
+int g_top = 0;                      // --top
+int g_cgroups = 0;                  // --cgroups
+int g_threads = 0;                  // --threads
+int g_tid_stats = 0;                // 'tid_stats' is loaded, for --top or --threads
+int g_oncpu = 0;                    // --oncpu
+int g_blockio = 0;                  // --blockio
+int g_preempt = 0;                  // --preempt
+int g_tgid_hists = 0;               // 'tgid_hists' is loaded, for --top or --oncpu
+int g_pinned = 0;                   // g_pin_dir was created by us
+const char *g_pin_dir = DEFAULT_PIN_DIR;
+int g_pinned_fds[NUM_PINNED_MAPS];  // --client: fds opened with bpf_obj_get()
+int g_num_pinned_fds = 0;
+
+static volatile sig_atomic_t g_exiting = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    g_exiting = 1;
+}
+
+// Snapshot of a BPF hash map's keys and values. The buffers are sized from
+// the map's max_entries once, so reading it every interval never allocates.
+struct map_reader {
+    int fd;
+    size_t key_sz;
+    size_t val_sz;
+    void *keys;
+    void *vals;
+    __u32 cap;
+    __u32 len;
+};
+
+struct map_reader g_tgid_stats_rd = { .fd = -1 };
+int g_tgid_stats_fresh = 0;             // read by collect_interval for this interval's reports
+struct tgid_stats g_pid_stats_prev;
+
+int map_reader_init(struct map_reader *r, int fd, size_t key_sz, size_t val_sz) {
     struct bpf_map_info info = {};
     __u32 info_len = sizeof(info);
-    if (bpf_obj_get_info_by_fd(g_blocked_hist_fd, &info, &info_len) != 0)
-        return;
-    __u32 buckets = info.max_entries;
-    if (buckets == 0)
-        return;
 
-    unsigned long long *counts = (unsigned long long *)calloc(buckets, sizeof(unsigned long long));
-    if (!counts)
-        return;
+    if (fd < 0 || bpf_obj_get_info_by_fd(fd, &info, &info_len) != 0)
+        return -1;
+    r->fd = fd;
+    r->key_sz = key_sz;
+    r->val_sz = val_sz;
+    r->cap = info.max_entries;
+    r->len = 0;
+    r->keys = calloc(r->cap, key_sz);
+    r->vals = calloc(r->cap, val_sz);
+    if (!r->keys || !r->vals)
+        return -1;
+    return 0;
+}
 
-    for (__u32 i = 0; i < buckets; i++) {
-        __u64 val = 0;
-        if (bpf_map_lookup_elem(g_blocked_hist_fd, &i, &val) == 0) {
-            counts[i] = (unsigned long long)val;
-        }
-    }
+void map_reader_free(struct map_reader *r) {
+    free(r->keys);
+    free(r->vals);
+    r->keys = NULL;
+    r->vals = NULL;
+    r->cap = r->len = 0;
+}
 
-    if (g_filter_tgid != 0) {
-        if (!g_blocked_hist_prev || g_blocked_hist_prev_buckets != buckets) {
-            free(g_blocked_hist_prev);
-            g_blocked_hist_prev = (__u64 *)calloc(buckets, sizeof(__u64));
-            g_blocked_hist_prev_buckets = buckets;
-        }
-
-        unsigned long long running_us = 0;
-        unsigned long long interval_us = 0;
-        for (__u32 b = 0; b < buckets; b++) {
-            unsigned long long lower = (b == 0) ? 0ull : (1ull << b);
-            unsigned long long upper = (1ull << (b + 1)) - 1ull;
-            unsigned long long mid = (lower + upper) / 2ull;
-            running_us += mid * counts[b];
-            __u64 prev = g_blocked_hist_prev ? g_blocked_hist_prev[b] : 0ull;
-            __u64 delta = (counts[b] > prev) ? (counts[b] - prev) : 0ull;
-            interval_us += mid * delta;
-        }
-        if (g_blocked_hist_prev) {
-            for (__u32 b = 0; b < buckets; b++) g_blocked_hist_prev[b] = counts[b];
-        }
-
-        double interval_ms = (double)interval_us / 1000.0;
-        double running_ms = (double)running_us / 1000.0;
-        printf("PID %u blocked this interval: %.3f ms (us=%llu); running total: %.3f ms (us=%llu)\n",
-               (unsigned)g_filter_tgid, interval_ms, (unsigned long long)interval_us,
-               running_ms, (unsigned long long)running_us);
-        free(counts);
-        return;
-    }
+// Reads every entry, normally with a single batched lookup. Kernels without
+// batch support fall back to walking the keys.
+int map_reader_read(struct map_reader *r) {
+    __u64 batch = 0;
+    void *in = NULL;
+    int err = 0;
 
-    __u32 last_nonzero = 0;
-    for (__u32 b = 0; b < buckets; b++) {
-        if (counts[b] != 0)
-            last_nonzero = b;
-    }
-    const __u32 cap_bucket = 21;
-    __u32 end_bucket = last_nonzero < cap_bucket ? last_nonzero : cap_bucket;
-    unsigned long long infinity_count = 0;
-    if (last_nonzero > cap_bucket) {
-        for (__u32 b = cap_bucket + 1; b < buckets; b++)
-            infinity_count += counts[b];
+    r->len = 0;
+    if (!r->keys)
+        return -1;
+    while (r->len < r->cap) {
+        __u32 count = r->cap - r->len;
+        err = bpf_map_lookup_batch(r->fd, in, &batch,
+                                   (char *)r->keys + (size_t)r->len * r->key_sz,
+                                   (char *)r->vals + (size_t)r->len * r->val_sz,
+                                   &count, NULL);
+        r->len += count;
+        if (err)
+            break;
+        in = &batch;
     }
+    if (!err || errno == ENOENT)
+        return 0;
+    if (r->len != 0 || (errno != EINVAL && errno != ENOTSUP && errno != EOPNOTSUPP))
+        return -1;
 
-    unsigned long long max_count = 0;
-    for (__u32 b = 0; b <= end_bucket; b++) {
-        if (counts[b] > max_count) max_count = counts[b];
+    char key[64], next[64];
+    int have_key = 0;
+    if (r->key_sz > sizeof(key))
+        return -1;
+    while (r->len < r->cap &&
+           bpf_map_get_next_key(r->fd, have_key ? key : NULL, next) == 0) {
+        memcpy(key, next, r->key_sz);
+        have_key = 1;
+        if (bpf_map_lookup_elem(r->fd, key, (char *)r->vals + (size_t)r->len * r->val_sz) != 0)
+            continue;
+        memcpy((char *)r->keys + (size_t)r->len * r->key_sz, key, r->key_sz);
+        r->len++;
     }
-    if (infinity_count > max_count) max_count = infinity_count;
+    return 0;
+}
 
-    const int bar_width = 40;
-    printf("Blocked time histogram\n");
-    printf("     usecs                : count    distribution\n");
-    for (__u32 b = 0; b <= end_bucket; b++) {
-        unsigned long long lower = (b == 0) ? 0ull : (1ull << b);
-        unsigned long long upper = (1ull << (b + 1)) - 1ull;
+struct map_reader g_ns_tgids_rd = { .fd = -1 };
 
-        int stars = 0;
-        if (max_count > 0) {
-            double ratio = (double)counts[b] / (double)max_count;
-            stars = (int)(ratio * bar_width + 0.5);
-            if (stars < 0) stars = 0;
-            if (stars > bar_width) stars = bar_width;
-        }
+int pidns_init(int fd) {
+    g_ns_tgids_fd = fd;
+    if (map_reader_init(&g_ns_tgids_rd, fd, sizeof(__u32), sizeof(__u32)) != 0)
+        return -1;
+    g_pidns_host_ents = (struct pidns_host *)calloc(g_ns_tgids_rd.cap, sizeof(struct pidns_host));
+    return g_pidns_host_ents ? 0 : -1;
+}
 
-        char bar[44 + 3];
-        bar[0] = '|';
-        int pos = 1;
-        for (int i = 0; i < stars && pos < (bar_width + 1); i++) bar[pos++] = '*';
-        while (pos < (bar_width + 1)) bar[pos++] = ' ';
-        bar[pos++] = '|';
-        bar[pos] = '\0';
+void pidns_free(void) {
+    HASH_CLEAR(hh, g_pidns_hosts);
+    free(g_pidns_host_ents);
+    g_pidns_host_ents = NULL;
+    map_reader_free(&g_ns_tgids_rd);
+}
 
-        printf(" %10llu -> %-10llu : %-8llu %s\n",
-               lower, upper, (unsigned long long)counts[b], bar);
+// Rebuilds the namespace-to-host table from one batched read of 'ns_tgids'
+void pidns_refresh(void) {
+    const __u32 *hosts = (const __u32 *)g_ns_tgids_rd.keys;
+    const __u32 *nss = (const __u32 *)g_ns_tgids_rd.vals;
+    struct pidns_host *h;
+
+    if (!g_pidns_host_ents || map_reader_read(&g_ns_tgids_rd) != 0)
+        return;
+    HASH_CLEAR(hh, g_pidns_hosts);
+    for (__u32 i = 0; i < g_ns_tgids_rd.len; i++) {
+        HASH_FIND(hh, g_pidns_hosts, &nss[i], sizeof(__u32), h);
+        if (h)
+            continue;
+        h = &g_pidns_host_ents[i];
+        h->ns = nss[i];
+        h->host = hosts[i];
+        HASH_ADD(hh, g_pidns_hosts, ns, sizeof(__u32), h);
     }
-    if (infinity_count > 0) {
-        int stars = 0;
-        if (max_count > 0) {
-            double ratio = (double)infinity_count / (double)max_count;
-            stars = (int)(ratio * bar_width + 0.5);
-            if (stars < 0) stars = 0;
-            if (stars > bar_width) stars = bar_width;
-        }
-        char bar[44 + 3];
-        bar[0] = '|';
-        int pos = 1;
-        for (int i = 0; i < stars && pos < (bar_width + 1); i++) bar[pos++] = '*';
-        while (pos < (bar_width + 1)) bar[pos++] = ' ';
-        bar[pos++] = '|';
-        bar[pos] = '\0';
+}
 
-        printf(" %10llu -> %-10s : %-8llu %s\n",
-               (unsigned long long)4194303, "infinity",
-               (unsigned long long)infinity_count, bar);
+const struct tgid_stats *find_tgid_stats(__u32 tgid) {
+    const __u32 *keys = (const __u32 *)g_tgid_stats_rd.keys;
+    const struct tgid_stats *vals = (const struct tgid_stats *)g_tgid_stats_rd.vals;
+    for (__u32 i = 0; i < g_tgid_stats_rd.len; i++) {
+        if (keys[i] == tgid)
+            return &vals[i];
     }
+    return NULL;
+}
 
-    free(counts);
+void time_stat_sub(struct time_stat *out, const struct time_stat *a, const struct time_stat *b) {
+    out->total_ns = a->total_ns - b->total_ns;
+    out->count = a->count - b->count;
+    out->max_ns = a->max_ns;
 }
 
-int load_bpf_program(__u32 pid)
-{
-    struct bpf_program *prog;
-    int err;
+int g_ncpus = 0;
+__u64 *g_hist_percpu = NULL;        // HIST_BUCKETS runs of g_ncpus counters
+unsigned long long g_blocked_prev[HIST_BUCKETS];    // kernel counts at the last read
+unsigned long long g_offcpu_prev[HIST_BUCKETS];
 
-    fprintf(stderr, "Loading BPF code in memory\n");
-    g_obj = bpf_object__open_file("cpu_analyzer.bpf.o", NULL);
-    if (libbpf_get_error(g_obj)) {
-        fprintf(stderr, "ERROR: opening BPF object file failed\n");
+int hist_percpu_init(void) {
+    g_ncpus = libbpf_num_possible_cpus();
+    if (g_ncpus <= 0)
         return -1;
-    }
+    g_hist_percpu = (__u64 *)calloc((size_t)HIST_BUCKETS * g_ncpus, sizeof(__u64));
+    return g_hist_percpu ? 0 : -1;
+}
 
-    fprintf(stderr, "Loading and verifying the code in the kernel\n");
-    err = bpf_object__load(g_obj);
-    if (err) {
-        fprintf(stderr, "ERROR: loading BPF object file failed: %d\n", err);
+// A plain reduction over one contiguous run, which the compiler vectorizes.
+unsigned long long sum_percpu(const __u64 *v, int n) {
+    unsigned long long sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += v[i];
+    return sum;
+}
+
+// Reads a cumulative per-CPU histogram ('blocked_hist', 'offcpu_hist') from
+// the kernel: one batched lookup returns every bucket's per-CPU counters,
+// which are then summed.
+int read_percpu_hist(int fd, unsigned long long *counts) {
+    __u32 keys[HIST_BUCKETS];
+    __u32 count = HIST_BUCKETS;
+    __u32 out_batch = 0;
+
+    if (fd < 0 || !g_hist_percpu)
         return -1;
-    }
 
-    bpf_object__for_each_program(prog, g_obj) {
-        struct bpf_link *link = bpf_program__attach(prog);
-        if (libbpf_get_error(link)) {
-            fprintf(stderr, "ERROR: attaching program failed\n");
-            return -1;
+    int err = bpf_map_lookup_batch(fd, NULL, &out_batch, keys,
+                                   g_hist_percpu, &count, NULL);
+    if (err && errno != ENOENT) {
+        // Kernels before 5.6 have no batch ops on arrays.
+        for (__u32 i = 0; i < HIST_BUCKETS; i++) {
+            keys[i] = i;
+            if (bpf_map_lookup_elem(fd, &i, &g_hist_percpu[(size_t)i * g_ncpus]) != 0)
+                memset(&g_hist_percpu[(size_t)i * g_ncpus], 0, g_ncpus * sizeof(__u64));
         }
-        const char *name = bpf_program__name(prog);
-        if (strstr(name, "handle_sched_switch"))
-            g_link_switch = link;
-        else if (strstr(name, "handle_sched_wakeup"))
-            g_link_wakeup = link;
-        else if (strstr(name, "handle_sched_wakeup_new"))
-            g_link_wakeup_new = link;
+        count = HIST_BUCKETS;
     }
 
-    fprintf(stderr, "BPF programs loaded and attached. Set PID=%u\n", pid);
-
-    struct bpf_map *blocked_map = bpf_object__find_map_by_name(g_obj, "blocked_hist");
-    if (!blocked_map) {
-        fprintf(stderr, "WARNING: could not find map 'blocked_hist' (blocked histogram disabled)\n");
-    } else {
-        g_blocked_hist_fd = bpf_map__fd(blocked_map);
-        if (g_blocked_hist_fd < 0) {
-            fprintf(stderr, "WARNING: failed to get fd for 'blocked_hist'\n");
-        }
+    memset(counts, 0, HIST_BUCKETS * sizeof(*counts));
+    for (__u32 i = 0; i < count; i++) {
+        if (keys[i] < HIST_BUCKETS)
+            counts[keys[i]] = sum_percpu(&g_hist_percpu[(size_t)i * g_ncpus], g_ncpus);
     }
     return 0;
 }
 
-int main(int argc, char **argv) {
-    err_check(argc, argv);
+int read_blocked_hist(unsigned long long *counts) {
+    return read_percpu_hist(g_blocked_hist_fd, counts);
+}
 
-    __u32 pid = 0;
-    int interval = atoi(argv[1]);
-    if (argc == 3) {
-        pid = (__u32)atoi(argv[2]);
-    }
-    g_filter_tgid = pid;
+// What a cumulative kernel histogram gained since *prev, which is advanced.
+void read_hist_delta(int fd, unsigned long long *prev, unsigned long long *delta) {
+    unsigned long long counts[HIST_BUCKETS];
 
-    if (load_bpf_program(pid) != 0) {
-        fprintf(stderr, "Failed to load/attach BPF program.\n");
-        return EXIT_FAILURE;
+    if (read_percpu_hist(fd, counts) != 0)
+        return;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        delta[b] = counts[b] > prev[b] ? counts[b] - prev[b] : 0ull;
+        prev[b] = counts[b];
     }
+}
 
-    struct bpf_map *rb_map = bpf_object__find_map_by_name(g_obj, "rb");
-    if (!rb_map) {
-        fprintf(stderr, "ERROR: could not find ring buffer map 'rb'\n");
-        goto cleanup;
-    }
-    int rb_fd = bpf_map__fd(rb_map);
-    if (rb_fd < 0) {
-        fprintf(stderr, "ERROR: failed to get ring buffer fd\n");
-        goto cleanup;
-    }
-    g_rb = ring_buffer__new(rb_fd, handle_rb_event, NULL, NULL);
-    if (!g_rb) {
-        fprintf(stderr, "ERROR: failed to create ring buffer consumer\n");
-        goto cleanup;
+// Ring buffer consumer thread. Outside heatmap mode the ring buffers are
+// drained on a thread of their own, so a slow terminal or pipe never stalls
+// consumption. It owns the sample aggregation (g_tgid_agg, g_tid_to_tgid);
+// at every tick the main thread asks it to close the interval and takes the
+// finished off-CPU histogram from a single-producer/single-consumer queue.
+#define CUT_SLOTS 2
+
+struct offcpu_cut {
+    unsigned long long total_ns;
+    unsigned long long counts[HIST_BUCKETS];
+};
+
+struct offcpu_cut g_cuts[CUT_SLOTS];
+unsigned int g_cut_head = 0;        // next slot the consumer fills
+unsigned int g_cut_tail = 0;        // next slot the main thread takes
+int g_cut_req_fd = -1;              // eventfd: main -> consumer
+int g_cut_done_fd = -1;             // eventfd: consumer -> main
+int g_consumer_stop = 0;
+int g_consumer_running = 0;
+pthread_t g_consumer_thread;
+
+static void efd_signal(int fd) {
+    __u64 one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+// Drains what is queued and publishes it as one finished interval.
+static void consumer_cut(void) {
+    unsigned int head = g_cut_head;
+
+    ring_buffer__consume(g_rb);
+    if (head - __atomic_load_n(&g_cut_tail, __ATOMIC_ACQUIRE) < CUT_SLOTS) {
+        struct offcpu_cut *cut = &g_cuts[head % CUT_SLOTS];
+        memset(cut->counts, 0, sizeof(cut->counts));
+        cut->total_ns = drain_off_cpu_interval(cut->counts);
+        __atomic_store_n(&g_cut_head, head + 1, __ATOMIC_RELEASE);
+    }
+    efd_signal(g_cut_done_fd);
+}
+
+static void *consumer_main(void *arg) {
+    struct epoll_event ev, events[2];
+    (void)arg;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = 0;
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, ring_buffer__epoll_fd(g_rb), &ev) != 0)
+        goto out;
+    ev.data.u32 = 1;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, g_cut_req_fd, &ev) != 0)
+        goto out;
+
+    while (!__atomic_load_n(&g_consumer_stop, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(epfd, events, 2, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u32 == 0) {
+                int ret = ring_buffer__consume(g_rb);
+                if (ret < 0)
+                    fprintf(stderr, "ERROR: ring_buffer__consume failed: %d\n", ret);
+            } else {
+                __u64 reqs;
+                if (read(g_cut_req_fd, &reqs, sizeof(reqs)) == (ssize_t)sizeof(reqs))
+                    consumer_cut();
+            }
+        }
+    }
+out:
+    // Never leave the main thread waiting for a cut
+    __atomic_store_n(&g_consumer_running, 0, __ATOMIC_RELEASE);
+    efd_signal(g_cut_done_fd);
+    if (epfd >= 0)
+        close(epfd);
+    return NULL;
+}
+
+int consumer_start(void) {
+    g_cut_req_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_cut_done_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_cut_req_fd < 0 || g_cut_done_fd < 0)
+        return -1;
+    g_consumer_running = 1;
+    if (pthread_create(&g_consumer_thread, NULL, consumer_main, NULL) != 0) {
+        g_consumer_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void consumer_stop(void) {
+    if (g_cut_req_fd >= 0 && g_cut_done_fd >= 0) {
+        __atomic_store_n(&g_consumer_stop, 1, __ATOMIC_RELEASE);
+        efd_signal(g_cut_req_fd);
+        pthread_join(g_consumer_thread, NULL);
+    }
+    if (g_cut_req_fd >= 0)
+        close(g_cut_req_fd);
+    if (g_cut_done_fd >= 0)
+        close(g_cut_done_fd);
+    g_cut_req_fd = g_cut_done_fd = -1;
+}
+
+// Asks the consumer to close the interval and waits for it, which takes one
+// pass over whatever is queued in the ring.
+unsigned long long take_offcpu_cut(unsigned long long *counts) {
+    unsigned long long total_ns = 0;
+    __u64 done;
+
+    if (__atomic_load_n(&g_consumer_running, __ATOMIC_ACQUIRE)) {
+        efd_signal(g_cut_req_fd);
+        if (read(g_cut_done_fd, &done, sizeof(done)) < 0)
+            perror("eventfd read");
+    }
+    while (g_cut_tail != __atomic_load_n(&g_cut_head, __ATOMIC_ACQUIRE)) {
+        const struct offcpu_cut *cut = &g_cuts[g_cut_tail % CUT_SLOTS];
+        total_ns += cut->total_ns;
+        for (size_t b = 0; b < HIST_BUCKETS; b++)
+            counts[b] += cut->counts[b];
+        __atomic_store_n(&g_cut_tail, g_cut_tail + 1, __ATOMIC_RELEASE);
+    }
+    return total_ns;
+}
+
+// Closes the interval ending at now_ns: drains the off-CPU samples (or, as a
+// --client, diffs the kernel's off-CPU histogram), diffs the kernel's blocked
+// histogram against the last read and folds both into g_capture. The caller
+// counts it in g_capture.intervals if it was a scheduled one.
+void collect_interval(struct interval_snapshot *iv, unsigned long long now_ns) {
+    memset(iv, 0, sizeof(*iv));
+    iv->end_ns = now_ns;
+    if (g_client)
+        read_hist_delta(g_offcpu_hist_fd, g_offcpu_prev, iv->offcpu);
+    else if (g_cut_done_fd >= 0)
+        iv->offcpu_total_ns = take_offcpu_cut(iv->offcpu);
+    else
+        iv->offcpu_total_ns = drain_off_cpu_interval(iv->offcpu);
+    read_hist_delta(g_blocked_hist_fd, g_blocked_prev, iv->blocked);
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        g_capture.offcpu[b] += iv->offcpu[b];
+        g_capture.blocked[b] += iv->blocked[b];
+    }
+
+    if (g_pidns)
+        pidns_refresh();
+    // Under --pidns the process may not have been seen yet; its totals
+    // start once it has. 'tgid_stats' is read once per interval and shared
+    // by the reports.
+    __u32 host = g_filter_tgid != 0 ? pidns_host_tgid(g_filter_tgid) : 0;
+    g_tgid_stats_fresh = (host != 0 || g_oncpu || g_blockio) && map_reader_read(&g_tgid_stats_rd) == 0;
+    if (host != 0 && g_tgid_stats_fresh) {
+        const struct tgid_stats *st = find_tgid_stats(host);
+        if (st)
+            iv->pid_total = *st;
+        // An evicted or reset entry starts over
+        if (iv->pid_total.offcpu.count < g_pid_stats_prev.offcpu.count ||
+            iv->pid_total.blocked.count < g_pid_stats_prev.blocked.count ||
+            iv->pid_total.runq.count < g_pid_stats_prev.runq.count ||
+            iv->pid_total.oncpu.count < g_pid_stats_prev.oncpu.count)
+            memset(&g_pid_stats_prev, 0, sizeof(g_pid_stats_prev));
+        time_stat_sub(&iv->pid_interval.offcpu, &iv->pid_total.offcpu, &g_pid_stats_prev.offcpu);
+        time_stat_sub(&iv->pid_interval.blocked, &iv->pid_total.blocked, &g_pid_stats_prev.blocked);
+        time_stat_sub(&iv->pid_interval.runq, &iv->pid_total.runq, &g_pid_stats_prev.runq);
+        time_stat_sub(&iv->pid_interval.oncpu, &iv->pid_total.oncpu, &g_pid_stats_prev.oncpu);
+        g_pid_stats_prev = iv->pid_total;
+    }
+}
+
+static void print_blocked_histogram(const struct interval_snapshot *iv) {
+    if (g_blocked_hist_fd < 0)
+        return;
+
+    if (g_filter_tgid != 0) {
+        print_pid_total("blocked", &iv->pid_interval.blocked, &iv->pid_total.blocked);
+        print_pid_total("run-queue", &iv->pid_interval.runq, &iv->pid_total.runq);
+        return;
+    }
+
+    print_hist("Blocked time histogram", "blocked", g_capture.blocked, HIST_BUCKETS);
+}
+
+// Daemon mode keeps one histogram snapshot per interval in a ring that is
+// allocated once at startup. Trailing windows are answered by merging the
+// newest slots, so no per-interval allocation happens once running.
+#define MAX_WINDOWS 8
+#define MAX_WINDOW_RING_MB 64
+
+struct window_spec {
+    unsigned int secs;                  // trailing window length
+    unsigned int every_secs;            // how often it is reported
+    unsigned long long next_report_ns;
+};
+
+struct interval_snapshot *g_ring = NULL;
+size_t g_ring_cap = 0;
+size_t g_ring_head = 0;                 // next slot to overwrite
+size_t g_ring_len = 0;
+struct interval_snapshot g_window_scratch;
+
+struct window_spec g_windows[MAX_WINDOWS];
+int g_num_windows = 0;
+int g_daemon = 0;
+int g_interval_sec = 0;
+int g_max_intervals = 0;
+
+size_t window_intervals(unsigned int secs) {
+    return ((size_t)secs + (size_t)g_interval_sec - 1) / (size_t)g_interval_sec;
+}
+
+int window_ring_init(void) {
+    size_t cap = 1;
+    for (int i = 0; i < g_num_windows; i++) {
+        size_t n = window_intervals(g_windows[i].secs);
+        if (n > cap) cap = n;
+    }
+    g_ring = (struct interval_snapshot *)calloc(cap, sizeof(*g_ring));
+    if (!g_ring)
+        return -1;
+    g_ring_cap = cap;
+    g_ring_head = 0;
+    g_ring_len = 0;
+    return 0;
+}
+
+void window_ring_free(void) {
+    free(g_ring);
+    g_ring = NULL;
+    g_ring_cap = g_ring_head = g_ring_len = 0;
+}
+
+// Returns the slot for the interval that just ended, evicting the oldest one
+// once the ring is full.
+struct interval_snapshot *window_ring_push(void) {
+    struct interval_snapshot *s = &g_ring[g_ring_head];
+    g_ring_head = (g_ring_head + 1) % g_ring_cap;
+    if (g_ring_len < g_ring_cap)
+        g_ring_len++;
+    return s;
+}
+
+// Merges the newest intervals covering the trailing secs seconds into out.
+// Returns how many intervals were merged (fewer than asked while warming up).
+size_t window_merge(unsigned int secs, struct interval_snapshot *out) {
+    size_t want = window_intervals(secs);
+    if (want > g_ring_len)
+        want = g_ring_len;
+
+    memset(out, 0, sizeof(*out));
+    for (size_t k = 0; k < want; k++) {
+        size_t idx = (g_ring_head + g_ring_cap - 1 - k) % g_ring_cap;
+        const struct interval_snapshot *s = &g_ring[idx];
+        if (k == 0)
+            out->end_ns = s->end_ns;
+        out->offcpu_total_ns += s->offcpu_total_ns;
+        for (size_t b = 0; b < HIST_BUCKETS; b++) {
+            out->offcpu[b] += s->offcpu[b];
+            out->blocked[b] += s->blocked[b];
+        }
+    }
+    return want;
+}
+
+const char *format_duration(unsigned int secs, char *buf, size_t len) {
+    if (secs % 3600 == 0)
+        snprintf(buf, len, "%uh", secs / 3600);
+    else if (secs % 60 == 0)
+        snprintf(buf, len, "%um", secs / 60);
+    else
+        snprintf(buf, len, "%us", secs);
+    return buf;
+}
+
+void print_window(const struct window_spec *w) {
+    char label[32], name[48];
+    size_t n = window_merge(w->secs, &g_window_scratch);
+
+    format_duration(w->secs, label, sizeof(label));
+    if (!g_csv)
+        printf("=== last %s (%zu x %ds intervals) ===\n", label, n, g_interval_sec);
+    snprintf(name, sizeof(name), "offcpu_%s", label);
+    print_hist("Off-cpu time histogram", name, g_window_scratch.offcpu, HIST_BUCKETS);
+    snprintf(name, sizeof(name), "blocked_%s", label);
+    print_hist("Blocked time histogram", name, g_window_scratch.blocked, HIST_BUCKETS);
+}
+
+void report_windows(unsigned long long now_ns) {
+    for (int i = 0; i < g_num_windows; i++) {
+        struct window_spec *w = &g_windows[i];
+        if (now_ns < w->next_report_ns)
+            continue;
+        print_window(w);
+        unsigned long long every_ns = (unsigned long long)w->every_secs * 1000000000ull;
+        do {
+            w->next_report_ns += every_ns;
+        } while (w->next_report_ns <= now_ns);
+    }
+    fflush(stdout);
+}
+
+// Called on --heatmap-step ticks: the kernel only keeps a cumulative blocked
+// histogram, so the columns between the ticks at from_ns and to_ns get the
+// difference since the previous call. When the loop woke up late and ticks
+// were skipped, it is spread evenly over their columns.
+void heatmap_sample_blocked(unsigned long long from_ns, unsigned long long to_ns) {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long steps = (to_ns - from_ns) / g_heat_step_ns;
+
+    if (steps == 0 || read_blocked_hist(counts) != 0)
+        return;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        if (counts[b] > g_heat_blocked_prev[b]) {
+            unsigned long long delta = counts[b] - g_heat_blocked_prev[b];
+            for (unsigned long long i = 0; i < steps; i++) {
+                // The newest column takes the remainder
+                unsigned long long n = delta / steps + (i == steps - 1 ? delta % steps : 0);
+                if (n)
+                    heatmap_add(&g_heat_blocked, from_ns + i * g_heat_step_ns, b, (__u32)n);
+            }
+        }
+        g_heat_blocked_prev[b] = counts[b];
+    }
+}
+
+// Black -> red -> yellow -> white in the xterm 256 colour cube.
+static const unsigned char heat_palette[] = { 16, 52, 88, 124, 160, 196, 202, 208, 214, 220, 226, 229, 231 };
+static const char heat_ascii[] = " .:-=+*#%@";
+
+void print_heatmap(const char *title, struct heatmap *hm,
+                   unsigned long long first, unsigned long long end) {
+    int color = isatty(STDOUT_FILENO);
+    __u32 max_count = 0;
+    size_t top_row = 0;
+
+    if (end <= first)
+        return;
+    if (end - first > hm->cols)
+        first = end - hm->cols;
+    for (unsigned long long col = first; col < end; col++) {
+        const __u32 *c = heatmap_column(hm, col);
+        for (size_t r = 0; c && r < HEATMAP_ROWS; r++) {
+            if (c[r] > max_count) max_count = c[r];
+            if (c[r] && r > top_row) top_row = r;
+        }
+    }
+
+    printf("%s (%u ms/column, %llu columns, max %u per cell)\n", title,
+           g_heatmap_step_ms, end - first, max_count);
+    for (size_t r = top_row + 1; r-- > 0;) {
+        if (r == HEATMAP_ROWS - 1)
+            printf(" %10llu -> %-10s |", (unsigned long long)4194303, "infinity");
+        else
+            printf(" %10llu -> %-10llu |", (r == 0) ? 0ull : (1ull << r), (1ull << (r + 1)) - 1ull);
+        for (unsigned long long col = first; col < end; col++) {
+            const __u32 *c = heatmap_column(hm, col);
+            __u32 v = c ? c[r] : 0;
+            // log scale so that a handful of outliers next to a hot bucket stay visible
+            double level = (v && max_count > 1) ? log((double)v) / log((double)max_count) : (v ? 1.0 : 0.0);
+            if (color) {
+                size_t n = sizeof(heat_palette);
+                size_t idx = v ? 1 + (size_t)(level * (double)(n - 2) + 0.5) : 0;
+                printf("\033[48;5;%um \033[0m", heat_palette[idx]);
+            } else {
+                size_t n = sizeof(heat_ascii) - 1;
+                size_t idx = v ? 1 + (size_t)(level * (double)(n - 2) + 0.5) : 0;
+                putchar(heat_ascii[idx]);
+            }
+        }
+        printf("|\n");
+    }
+}
+
+// One CSV line per column and histogram: wall-clock time, then the counts of
+// every bucket, so the matrix can be plotted without further parsing.
+void export_heatmap(const char *name, struct heatmap *hm,
+                    unsigned long long first, unsigned long long end) {
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    long long mono_to_real_ns = (long long)rt.tv_sec * 1000000000ll + rt.tv_nsec -
+                                (long long)get_monotonic_time_ns();
+
+    for (unsigned long long col = first; col < end; col++) {
+        const __u32 *c = heatmap_column(hm, col);
+        if (!c)
+            continue;
+        long long ts = (long long)(g_heat_origin_ns + col * g_heat_step_ns) + mono_to_real_ns;
+        fprintf(g_heatmap_out, "%lld.%03lld,%s", ts / 1000000000ll, (ts % 1000000000ll) / 1000000ll, name);
+        for (size_t r = 0; r < HEATMAP_ROWS; r++)
+            fprintf(g_heatmap_out, ",%u", c[r]);
+        fputc('\n', g_heatmap_out);
+    }
+}
+
+int heatmap_open(unsigned long long now_ns) {
+    g_heat_step_ns = (unsigned long long)g_heatmap_step_ms * 1000000ull;
+    g_heat_origin_ns = now_ns;
+    g_heat_next_step_ns = now_ns + g_heat_step_ns;
+    g_heat_emitted = 0;
+
+    // Room for two intervals so that samples that are still in the ring
+    // buffer when an interval is rendered are not lost.
+    size_t cols = 2 * (((size_t)g_interval_sec * 1000u + g_heatmap_step_ms - 1) / g_heatmap_step_ms);
+    if (heatmap_init(&g_heat_offcpu, cols) != 0 || heatmap_init(&g_heat_blocked, cols) != 0)
+        return -1;
+    read_blocked_hist(g_heat_blocked_prev);
+
+    if (g_heatmap_out_path) {
+        g_heatmap_out = fopen(g_heatmap_out_path, "w");
+        if (!g_heatmap_out)
+            return -1;
+        fprintf(g_heatmap_out, "time_s,hist");
+        for (size_t r = 0; r < HEATMAP_ROWS - 1; r++)
+            fprintf(g_heatmap_out, ",%llu", (r == 0) ? 0ull : (1ull << r));
+        fprintf(g_heatmap_out, ",inf\n");
+    }
+    return 0;
+}
+
+void heatmap_close(void) {
+    if (g_heatmap_out) {
+        fclose(g_heatmap_out);
+        g_heatmap_out = NULL;
+    }
+    free(g_heat_offcpu.cells);
+    free(g_heat_blocked.cells);
+    g_heat_offcpu.cells = g_heat_blocked.cells = NULL;
+}
+
+// Renders (and exports) the columns not shown yet, up to the one
+// before the newest complete column: off-CPU samples of that one can still
+// be waiting in the ring buffer, so it goes out with the next interval.
+void report_heatmap(unsigned long long now_ns) {
+    unsigned long long end = (now_ns - g_heat_origin_ns) / g_heat_step_ns;
+
+    if (end == 0)
+        return;
+    end--;
+
+    print_heatmap("Off-cpu time heatmap", &g_heat_offcpu, g_heat_emitted, end);
+    print_heatmap("Blocked time heatmap", &g_heat_blocked, g_heat_emitted, end);
+    if (g_heatmap_out) {
+        export_heatmap("offcpu", &g_heat_offcpu, g_heat_emitted, end);
+        export_heatmap("blocked", &g_heat_blocked, g_heat_emitted, end);
+        fflush(g_heatmap_out);
+    }
+    fflush(stdout);
+    g_heat_emitted = end;
+}
+
+// By-syscall report (--syscalls). Names come from the build host's
+// <sys/syscall.h>; numbers not listed here are printed as they are.
+struct syscall_name {
+    long nr;
+    const char *name;
+};
+
+#define SYSCALL_NAME(n) { SYS_##n, #n }
+static const struct syscall_name syscall_names[] = {
+    SYSCALL_NAME(read), SYSCALL_NAME(write), SYSCALL_NAME(readv), SYSCALL_NAME(writev),
+    SYSCALL_NAME(pread64), SYSCALL_NAME(pwrite64), SYSCALL_NAME(openat), SYSCALL_NAME(close),
+    SYSCALL_NAME(fsync), SYSCALL_NAME(fdatasync), SYSCALL_NAME(futex), SYSCALL_NAME(nanosleep),
+    SYSCALL_NAME(clock_nanosleep), SYSCALL_NAME(epoll_pwait), SYSCALL_NAME(ppoll),
+    SYSCALL_NAME(pselect6), SYSCALL_NAME(io_uring_enter), SYSCALL_NAME(io_getevents),
+    SYSCALL_NAME(accept4), SYSCALL_NAME(connect), SYSCALL_NAME(recvfrom), SYSCALL_NAME(sendto),
+    SYSCALL_NAME(recvmsg), SYSCALL_NAME(sendmsg), SYSCALL_NAME(wait4), SYSCALL_NAME(waitid),
+    SYSCALL_NAME(sched_yield), SYSCALL_NAME(mmap), SYSCALL_NAME(munmap), SYSCALL_NAME(mprotect),
+    SYSCALL_NAME(madvise), SYSCALL_NAME(ioctl), SYSCALL_NAME(rt_sigtimedwait),
+    SYSCALL_NAME(exit_group), SYSCALL_NAME(clone), SYSCALL_NAME(execve), SYSCALL_NAME(flock),
+    SYSCALL_NAME(fcntl), SYSCALL_NAME(getdents64),
+#ifdef SYS_epoll_wait
+    SYSCALL_NAME(epoll_wait), SYSCALL_NAME(poll), SYSCALL_NAME(select), SYSCALL_NAME(pause),
+    SYSCALL_NAME(accept), SYSCALL_NAME(open),
+#endif
+};
+
+const char *syscall_name(__s32 nr, char *buf, size_t len) {
+    if (nr == SYSCALL_NONE)
+        return "-";
+    for (size_t i = 0; i < sizeof(syscall_names) / sizeof(syscall_names[0]); i++) {
+        if (syscall_names[i].nr == nr)
+            return syscall_names[i].name;
+    }
+    snprintf(buf, len, "syscall_%d", nr);
+    return buf;
+}
+
+#define SYSCALL_REPORT_ROWS 20
+#define SYSCALL_REPORT_HISTS 3
+
+int g_syscalls = 0;
+struct map_reader g_syscall_stats_rd = { .fd = -1 };
+__u32 *g_syscall_rows = NULL;       // indices into g_syscall_stats_rd, sorted
+
+static int cmp_syscall_rows(const void *a, const void *b) {
+    const struct syscall_stat *vals = (const struct syscall_stat *)g_syscall_stats_rd.vals;
+    __u64 ta = vals[*(const __u32 *)a].offcpu.total_ns;
+    __u64 tb = vals[*(const __u32 *)b].offcpu.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+int syscall_report_init(int fd) {
+    if (map_reader_init(&g_syscall_stats_rd, fd, sizeof(struct syscall_key),
+                        sizeof(struct syscall_stat)) != 0)
+        return -1;
+    g_syscall_rows = (__u32 *)calloc(g_syscall_stats_rd.cap, sizeof(__u32));
+    return g_syscall_rows ? 0 : -1;
+}
+
+void syscall_report_free(void) {
+    map_reader_free(&g_syscall_stats_rd);
+    free(g_syscall_rows);
+    g_syscall_rows = NULL;
+}
+
+// Off-CPU and blocked totals per {TGID, syscall} since startup, largest
+// off-CPU time first, followed by the histograms of the top few rows.
+void print_syscall_report(void) {
+    const struct syscall_key *keys = (const struct syscall_key *)g_syscall_stats_rd.keys;
+    const struct syscall_stat *vals = (const struct syscall_stat *)g_syscall_stats_rd.vals;
+    __u32 rows = 0;
+    char buf[32], id[24];
+
+    if (!g_syscall_rows || map_reader_read(&g_syscall_stats_rd) != 0)
+        return;
+    for (__u32 i = 0; i < g_syscall_stats_rd.len; i++) {
+        if (g_filter_tgid == 0 || tgid_filter_key(keys[i].tgid) == g_filter_tgid)
+            g_syscall_rows[rows++] = i;
+    }
+    qsort(g_syscall_rows, rows, sizeof(*g_syscall_rows), cmp_syscall_rows);
+    if (rows > SYSCALL_REPORT_ROWS)
+        rows = SYSCALL_REPORT_ROWS;
+
+    printf("Off-cpu time by syscall\n");
+    printf("  %-8s %-18s %12s %10s %12s %10s %10s\n",
+           "TGID", "SYSCALL", "OFFCPU_MS", "COUNT", "BLOCKED_MS", "COUNT", "MAX_MS");
+    for (__u32 r = 0; r < rows; r++) {
+        const struct syscall_key *k = &keys[g_syscall_rows[r]];
+        const struct syscall_stat *s = &vals[g_syscall_rows[r]];
+        printf("  %-8s %-18s %12.3f %10llu %12.3f %10llu %10.3f\n",
+               tgid_str(k->tgid, id, sizeof(id)), syscall_name(k->nr, buf, sizeof(buf)),
+               (double)s->offcpu.total_ns / 1e6, (unsigned long long)s->offcpu.count,
+               (double)s->blocked.total_ns / 1e6, (unsigned long long)s->blocked.count,
+               (double)s->offcpu.max_ns / 1e6);
+    }
+    for (__u32 r = 0; r < rows && r < SYSCALL_REPORT_HISTS; r++) {
+        const struct syscall_key *k = &keys[g_syscall_rows[r]];
+        const struct syscall_stat *s = &vals[g_syscall_rows[r]];
+        char title[96];
+        const char *name = syscall_name(k->nr, buf, sizeof(buf));
+        tgid_str(k->tgid, id, sizeof(id));
+        snprintf(title, sizeof(title), "Off-cpu time histogram, TGID %s in %s", id, name);
+        print_log2_hist(title, (const unsigned long long *)s->offcpu_hist.slots, HIST_SLOTS);
+        snprintf(title, sizeof(title), "Blocked time histogram, TGID %s in %s", id, name);
+        print_log2_hist(title, (const unsigned long long *)s->blocked_hist.slots, HIST_SLOTS);
+    }
+}
+
+// Block IO report (--blockio)
+#define BLOCKIO_REPORT_ROWS 10
+
+int g_dstate_hist_fd = -1;
+int g_io_counters_fd = -1;                  // not pinned: -1 for --client
+__u64 *g_io_counters_percpu = NULL;         // g_ncpus values of one key
+struct map_reader g_io_dev_rd = { .fd = -1 };
+struct log2_hist *g_dstate_percpu = NULL;   // g_ncpus values of one key
+__u32 *g_tgid_rows = NULL;                  // indices into g_tgid_stats_rd, sorted
+
+int blockio_report_init(int dev_fd, int dstate_fd, int counters_fd) {
+    if (map_reader_init(&g_io_dev_rd, dev_fd, sizeof(__u32), sizeof(struct io_dev_stat)) != 0)
+        return -1;
+    g_dstate_hist_fd = dstate_fd;
+    g_io_counters_fd = counters_fd;
+    g_dstate_percpu = (struct log2_hist *)calloc(g_ncpus, sizeof(struct log2_hist));
+    g_io_counters_percpu = (__u64 *)calloc(g_ncpus, sizeof(__u64));
+    g_tgid_rows = (__u32 *)calloc(g_tgid_stats_rd.cap, sizeof(__u32));
+    return (g_dstate_percpu && g_io_counters_percpu && g_tgid_rows) ? 0 : -1;
+}
+
+void blockio_report_free(void) {
+    map_reader_free(&g_io_dev_rd);
+    free(g_dstate_percpu);
+    free(g_io_counters_percpu);
+    free(g_tgid_rows);
+    g_dstate_percpu = NULL;
+    g_io_counters_percpu = NULL;
+    g_tgid_rows = NULL;
+}
+
+unsigned long long read_io_counter(__u32 counter) {
+    unsigned long long total = 0;
+
+    if (g_io_counters_fd < 0 || bpf_map_lookup_elem(g_io_counters_fd, &counter, g_io_counters_percpu) != 0)
+        return 0;
+    for (int cpu = 0; cpu < g_ncpus; cpu++)
+        total += g_io_counters_percpu[cpu];
+    return total;
+}
+
+int read_dstate_hist(__u32 cls, unsigned long long *counts) {
+    memset(counts, 0, HIST_SLOTS * sizeof(*counts));
+    if (bpf_map_lookup_elem(g_dstate_hist_fd, &cls, g_dstate_percpu) != 0)
+        return -1;
+    for (int cpu = 0; cpu < g_ncpus; cpu++) {
+        for (size_t s = 0; s < HIST_SLOTS; s++)
+            counts[s] += g_dstate_percpu[cpu].slots[s];
+    }
+    return 0;
+}
+
+// "nvme0n1" for the kernel dev_t of a block device, or "major:minor".
+const char *block_dev_name(__u32 dev, char *buf, size_t len) {
+    unsigned int major = dev >> 20, minor = dev & 0xfffff;
+    char path[64], line[128];
+
+    snprintf(buf, len, "%u:%u", major, minor);
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/uevent", major, minor);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return buf;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "DEVNAME=", 8) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(buf, len, "%s", line + 8);
+            break;
+        }
+    }
+    fclose(f);
+    return buf;
+}
+
+static int cmp_tgid_io_wait(const void *a, const void *b) {
+    const struct tgid_stats *vals = (const struct tgid_stats *)g_tgid_stats_rd.vals;
+    __u64 ta = vals[*(const __u32 *)a].io_wait.total_ns;
+    __u64 tb = vals[*(const __u32 *)b].io_wait.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+void print_blockio_report(void) {
+    unsigned long long counts[HIST_SLOTS];
+    char name[64], title[128];
+
+    if (read_dstate_hist(DSTATE_BLOCK_IO, counts) == 0)
+        print_log2_hist("D-state time waiting on block IO histogram", counts, HIST_SLOTS);
+    if (read_dstate_hist(DSTATE_OTHER, counts) == 0)
+        print_log2_hist("D-state time, other waits histogram", counts, HIST_SLOTS);
+
+    if (map_reader_read(&g_io_dev_rd) == 0) {
+        const __u32 *devs = (const __u32 *)g_io_dev_rd.keys;
+        const struct io_dev_stat *ds = (const struct io_dev_stat *)g_io_dev_rd.vals;
+        for (__u32 i = 0; i < g_io_dev_rd.len; i++) {
+            block_dev_name(devs[i], name, sizeof(name));
+            snprintf(title, sizeof(title),
+                     "Block IO latency histogram, %s (n=%llu, avg %.1f us, max %.1f us)", name,
+                     (unsigned long long)ds[i].lat.count,
+                     ds[i].lat.count ? (double)ds[i].lat.total_ns / (double)ds[i].lat.count / 1e3 : 0.0,
+                     (double)ds[i].lat.max_ns / 1e3);
+            print_log2_hist(title, (const unsigned long long *)ds[i].hist.slots, HIST_SLOTS);
+        }
+    }
+    unsigned long long replaced = read_io_counter(IO_REPLACED), stale = read_io_counter(IO_STALE);
+    if (replaced || stale)
+        printf("Block requests not timed: %llu reissued at the same sector while in flight, "
+               "%llu completed after more than %llu s\n", replaced, stale, IO_STALE_NS / 1000000000ull);
+
+    if (!g_tgid_stats_fresh)
+        return;
+    const __u32 *tgids = (const __u32 *)g_tgid_stats_rd.keys;
+    const struct tgid_stats *st = (const struct tgid_stats *)g_tgid_stats_rd.vals;
+    __u32 rows = 0;
+    for (__u32 i = 0; i < g_tgid_stats_rd.len; i++) {
+        if ((g_filter_tgid == 0 || tgid_filter_key(tgids[i]) == g_filter_tgid) &&
+            (st[i].io_wait.count || st[i].dstate_other.count))
+            g_tgid_rows[rows++] = i;
+    }
+    qsort(g_tgid_rows, rows, sizeof(*g_tgid_rows), cmp_tgid_io_wait);
+    if (rows > BLOCKIO_REPORT_ROWS)
+        rows = BLOCKIO_REPORT_ROWS;
+
+    printf("D-state time by process\n");
+    printf("  %-8s %12s %10s %12s %10s\n", "TGID", "IO_WAIT_MS", "COUNT", "OTHER_D_MS", "COUNT");
+    for (__u32 r = 0; r < rows; r++) {
+        __u32 i = g_tgid_rows[r];
+        char id[24];
+        printf("  %-8s %12.3f %10llu %12.3f %10llu\n", tgid_str(tgids[i], id, sizeof(id)),
+               (double)st[i].io_wait.total_ns / 1e6, (unsigned long long)st[i].io_wait.count,
+               (double)st[i].dstate_other.total_ns / 1e6, (unsigned long long)st[i].dstate_other.count);
+    }
+}
+
+// Address symbolization: the ELF symbol (or mapping) covering an address in
+// a process. Symbol tables are cached per file for the lifetime of the tool;
+// process mappings are cached per TGID until symbolize_flush().
+struct elf_sym {
+    __u64 addr;
+    __u64 size;
+    char *name;
+};
+
+struct elf_file_key {
+    __u64 dev;
+    __u64 ino;
+};
+
+#define ELF_MAX_LOADS 16
+
+struct elf_symtab {
+    struct elf_file_key key;
+    struct elf_sym *syms;       // FUNC and OBJECT symbols, sorted by addr
+    size_t len;
+    struct { __u64 offset, vaddr, filesz; } loads[ELF_MAX_LOADS];
+    int nloads;
+    UT_hash_handle hh;
+};
+
+struct proc_map {
+    __u64 start;
+    __u64 end;
+    __u64 bias;                 // runtime address - ELF vaddr
+    struct elf_symtab *symtab;  // NULL if there is nothing to look up
+    char name[64];              // file basename, or [heap], [stack], ...
+};
+
+struct proc_maps {
+    __u32 tgid;                 // key
+    struct proc_map *maps;
+    size_t len;
+    UT_hash_handle hh;
+};
+
+struct elf_symtab *g_symtabs = NULL;
+struct proc_maps *g_proc_maps = NULL;
+
+static int cmp_elf_sym(const void *a, const void *b) {
+    const struct elf_sym *x = (const struct elf_sym *)a, *y = (const struct elf_sym *)b;
+    return x->addr < y->addr ? -1 : (x->addr > y->addr ? 1 : 0);
+}
+
+// Reads .symtab, or .dynsym if the file is stripped. Only 64-bit ELF.
+int elf_symtab_parse(struct elf_symtab *st, const unsigned char *img, size_t sz) {
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)img;
+    if (sz < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh->e_phoff + (__u64)eh->e_phnum * sizeof(Elf64_Phdr) > sz ||
+        eh->e_shoff + (__u64)eh->e_shnum * sizeof(Elf64_Shdr) > sz)
+        return -1;
+
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)(img + eh->e_phoff);
+    for (int i = 0; i < eh->e_phnum && st->nloads < ELF_MAX_LOADS; i++) {
+        if (ph[i].p_type != PT_LOAD)
+            continue;
+        st->loads[st->nloads].offset = ph[i].p_offset;
+        st->loads[st->nloads].vaddr = ph[i].p_vaddr;
+        st->loads[st->nloads].filesz = ph[i].p_filesz;
+        st->nloads++;
+    }
+
+    const Elf64_Shdr *sh = (const Elf64_Shdr *)(img + eh->e_shoff);
+    const Elf64_Shdr *symsec = NULL;
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == SHT_SYMTAB || (sh[i].sh_type == SHT_DYNSYM && !symsec))
+            symsec = &sh[i];
+    }
+    if (!symsec || symsec->sh_link >= eh->e_shnum || symsec->sh_entsize != sizeof(Elf64_Sym))
+        return 0;
+    const Elf64_Shdr *strsec = &sh[symsec->sh_link];
+    if (symsec->sh_offset + symsec->sh_size > sz || strsec->sh_offset + strsec->sh_size > sz)
+        return 0;
+
+    const Elf64_Sym *syms = (const Elf64_Sym *)(img + symsec->sh_offset);
+    size_t n = symsec->sh_size / sizeof(Elf64_Sym);
+    st->syms = (struct elf_sym *)calloc(n ? n : 1, sizeof(struct elf_sym));
+    if (!st->syms)
+        return -1;
+    for (size_t i = 0; i < n; i++) {
+        int type = ELF64_ST_TYPE(syms[i].st_info);
+        if ((type != STT_FUNC && type != STT_OBJECT) || syms[i].st_shndx == SHN_UNDEF ||
+            syms[i].st_size == 0 || syms[i].st_name >= strsec->sh_size)
+            continue;
+        const char *name = (const char *)img + strsec->sh_offset + syms[i].st_name;
+        st->syms[st->len].addr = syms[i].st_value;
+        st->syms[st->len].size = syms[i].st_size;
+        st->syms[st->len].name = strndup(name, strsec->sh_size - syms[i].st_name);
+        if (!st->syms[st->len].name)
+            return -1;
+        st->len++;
+    }
+    qsort(st->syms, st->len, sizeof(*st->syms), cmp_elf_sym);
+    return 0;
+}
+
+// Drops what a parse left behind, keeping the key
+void elf_symtab_clear(struct elf_symtab *st) {
+    for (size_t i = 0; i < st->len; i++)
+        free(st->syms[i].name);
+    free(st->syms);
+    st->syms = NULL;
+    st->len = 0;
+    st->nloads = 0;
+}
+
+void elf_symtab_free(struct elf_symtab *st) {
+    elf_symtab_clear(st);
+    free(st);
+}
+
+// 'path' as seen from the process; opened through its root so that
+// processes in other mount namespaces resolve too.
+struct elf_symtab *elf_symtab_get(__u32 tgid, const char *path) {
+    char full[PATH_MAX];
+    struct stat sb;
+    struct elf_symtab *st;
+
+    snprintf(full, sizeof(full), "/proc/%u/root%s", (unsigned)tgid, path);
+    int fd = open(full, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct elf_file_key key;
+    memset(&key, 0, sizeof(key));
+    key.dev = sb.st_dev;
+    key.ino = sb.st_ino;
+    HASH_FIND(hh, g_symtabs, &key, sizeof(key), st);
+    if (st) {
+        close(fd);
+        return st;
+    }
+
+    st = (struct elf_symtab *)calloc(1, sizeof(*st));
+    if (!st) {
+        close(fd);
+        return NULL;
+    }
+    st->key = key;
+    void *img = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    // Files that are not ELF or fail to parse are cached too, with no
+    // symbols, so that they are not read again.
+    if (img != MAP_FAILED) {
+        if (elf_symtab_parse(st, (const unsigned char *)img, sb.st_size) != 0)
+            elf_symtab_clear(st);
+        munmap(img, sb.st_size);
+    }
+    HASH_ADD(hh, g_symtabs, key, sizeof(st->key), st);
+    return st;
+}
+
+const struct elf_sym *elf_symtab_find(const struct elf_symtab *st, __u64 vaddr) {
+    size_t lo = 0, hi = st->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (st->syms[mid].addr <= vaddr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // Walk back over smaller symbols that start later but do not cover vaddr
+    for (size_t i = lo; i > 0; i--) {
+        const struct elf_sym *s = &st->syms[i - 1];
+        if (vaddr < s->addr + s->size)
+            return s;
+        if (lo - i >= 8)
+            break;
+    }
+    return NULL;
+}
+
+// Load bias of a file mapping at 'start' that maps file offset 'pgoff'.
+int elf_symtab_bias(const struct elf_symtab *st, __u64 start, __u64 pgoff, __u64 *bias) {
+    for (int i = 0; i < st->nloads; i++) {
+        __u64 off = st->loads[i].offset & ~0xfffULL;
+        if (pgoff >= off && pgoff < st->loads[i].offset + st->loads[i].filesz) {
+            *bias = start - ((st->loads[i].vaddr & ~0xfffULL) + (pgoff - off));
+            return 0;
+        }
+    }
+    return -1;
+}
+
+struct proc_maps *proc_maps_load(__u32 tgid) {
+    char path[64], line[PATH_MAX + 128];
+    struct proc_maps *pm = (struct proc_maps *)calloc(1, sizeof(*pm));
+    size_t cap = 0;
+
+    if (!pm)
+        return NULL;
+    pm->tgid = tgid;
+    snprintf(path, sizeof(path), "/proc/%u/maps", (unsigned)tgid);
+    FILE *f = fopen(path, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        unsigned long long start, end, pgoff;
+        char perms[8];
+        int name_at = 0;
+        if (sscanf(line, "%llx-%llx %7s %llx %*x:%*x %*u %n", &start, &end, perms, &pgoff, &name_at) < 4)
+            continue;
+        char *name = line + name_at;
+        name[strcspn(name, "\n")] = '\0';
+
+        if (pm->len == cap) {
+            size_t ncap = cap ? cap * 2 : 64;
+            struct proc_map *nm = (struct proc_map *)realloc(pm->maps, ncap * sizeof(*nm));
+            if (!nm)
+                break;
+            pm->maps = nm;
+            cap = ncap;
+        }
+        struct proc_map *m = &pm->maps[pm->len];
+        memset(m, 0, sizeof(*m));
+        m->start = start;
+        m->end = end;
+        if (name[0] == '/') {
+            const char *base = strrchr(name, '/') + 1;
+            snprintf(m->name, sizeof(m->name), "%s", base);
+            m->symtab = elf_symtab_get(tgid, name);
+            if (m->symtab && elf_symtab_bias(m->symtab, start, pgoff, &m->bias) != 0)
+                m->symtab = NULL;
+        } else if (name[0] == '\0' && pm->len > 0 && pm->maps[pm->len - 1].end == start &&
+                   pm->maps[pm->len - 1].symtab) {
+            // Anonymous mapping right after a file's last segment: its .bss
+            *m = pm->maps[pm->len - 1];
+            m->start = start;
+            m->end = end;
+        } else {
+            snprintf(m->name, sizeof(m->name), "%s", name[0] ? name : "[anon]");
+        }
+        pm->len++;
+    }
+    if (f)
+        fclose(f);
+    HASH_ADD(hh, g_proc_maps, tgid, sizeof(__u32), pm);
+    return pm;
+}
+
+// The mapping of tgid covering addr, and the symbol there if there is one
+const struct proc_map *symbolize_lookup(__u32 tgid, __u64 addr, const struct elf_sym **sym) {
+    struct proc_maps *pm;
+
+    *sym = NULL;
+    HASH_FIND(hh, g_proc_maps, &tgid, sizeof(__u32), pm);
+    if (!pm)
+        pm = proc_maps_load(tgid);
+    if (!pm)
+        return NULL;
+    for (size_t i = 0; i < pm->len; i++) {
+        const struct proc_map *m = &pm->maps[i];
+        if (addr < m->start || addr >= m->end)
+            continue;
+        if (m->symtab)
+            *sym = elf_symtab_find(m->symtab, addr - m->bias);
+        return m;
+    }
+    return NULL;
+}
+
+// "symbol+0xoff (file)", "[heap]+0xoff", or the bare address.
+const char *symbolize(__u32 tgid, __u64 addr, char *buf, size_t len) {
+    const struct elf_sym *s;
+    const struct proc_map *m = symbolize_lookup(tgid, addr, &s);
+
+    if (s)
+        snprintf(buf, len, "%s+0x%llx (%s)", s->name,
+                 (unsigned long long)(addr - m->bias - s->addr), m->name);
+    else if (m)
+        snprintf(buf, len, "%s+0x%llx", m->name, (unsigned long long)(addr - m->start));
+    else
+        snprintf(buf, len, "0x%llx", (unsigned long long)addr);
+    return buf;
+}
+
+// Kernel symbols from /proc/kallsyms, sorted by address; read on first use
+// and kept with the ELF symbol tables.
+struct ksym {
+    __u64 addr;
+    char *name;
+};
+
+struct ksym *g_ksyms = NULL;
+size_t g_num_ksyms = 0;
+int g_ksyms_loaded = 0;
+
+static int cmp_ksym(const void *a, const void *b) {
+    const struct ksym *x = (const struct ksym *)a, *y = (const struct ksym *)b;
+    return x->addr < y->addr ? -1 : (x->addr > y->addr ? 1 : 0);
+}
+
+void ksyms_load(void) {
+    char line[256], name[128], type;
+    unsigned long long addr;
+    size_t cap = 0;
+
+    g_ksyms_loaded = 1;
+    FILE *f = fopen("/proc/kallsyms", "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%llx %c %127s", &addr, &type, name) != 3 || addr == 0 ||
+            (type != 't' && type != 'T' && type != 'w' && type != 'W'))
+            continue;
+        if (g_num_ksyms == cap) {
+            size_t ncap = cap ? cap * 2 : 65536;
+            struct ksym *nk = (struct ksym *)realloc(g_ksyms, ncap * sizeof(*nk));
+            if (!nk)
+                break;
+            g_ksyms = nk;
+            cap = ncap;
+        }
+        g_ksyms[g_num_ksyms].addr = addr;
+        g_ksyms[g_num_ksyms].name = strdup(name);
+        if (!g_ksyms[g_num_ksyms].name)
+            break;
+        g_num_ksyms++;
+    }
+    fclose(f);
+    qsort(g_ksyms, g_num_ksyms, sizeof(*g_ksyms), cmp_ksym);
+}
+
+// The kernel function containing addr, or NULL
+const char *ksym_name(__u64 addr) {
+    size_t lo = 0, hi;
+
+    if (!g_ksyms_loaded)
+        ksyms_load();
+    hi = g_num_ksyms;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g_ksyms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 ? g_ksyms[lo - 1].name : NULL;
+}
+
+// Mappings change; call before each report.
+void symbolize_flush(void) {
+    struct proc_maps *pm, *tmp;
+    HASH_ITER(hh, g_proc_maps, pm, tmp) {
+        HASH_DEL(g_proc_maps, pm);
+        free(pm->maps);
+        free(pm);
+    }
+}
+
+void symbolize_free(void) {
+    struct elf_symtab *st, *tmp;
+    symbolize_flush();
+    HASH_ITER(hh, g_symtabs, st, tmp) {
+        HASH_DEL(g_symtabs, st);
+        elf_symtab_free(st);
+    }
+    for (size_t i = 0; i < g_num_ksyms; i++)
+        free(g_ksyms[i].name);
+    free(g_ksyms);
+    g_ksyms = NULL;
+    g_num_ksyms = 0;
+    g_ksyms_loaded = 0;
+}
+
+// Flame graph (--flame FILE): on-CPU stacks sampled by a CPU clock on every
+// CPU, each worth the sampling period, and the stacks tasks blocked in, each
+// worth the time until their wakeup, all in nanoseconds. Written at exit in
+// folded form ("comm;frame;...;frame ns"), outermost frame first, under a
+// [on-cpu] or [off-cpu] frame. Kernel frames of on-CPU stacks end in _[k];
+// every frame of an off-CPU stack ends in _[o].
+#define DEFAULT_FLAME_HZ 99
+#define DEFAULT_FLAME_STACKS 16384
+#define MAX_FLAME_STACKS (1u << 20)
+
+const char *g_flame_path = NULL;
+unsigned int g_flame_hz = 0;        // 0: DEFAULT_FLAME_HZ
+unsigned int g_flame_stacks = 0;    // 0: DEFAULT_FLAME_STACKS
+struct map_reader g_flame_rd = { .fd = -1 };
+int g_flame_stacks_fd = -1;
+int g_flame_counters_fd = -1;
+__u64 *g_flame_counters_percpu = NULL;  // g_ncpus values of one key
+struct bpf_link **g_flame_links = NULL;
+int g_num_flame_links = 0;
+
+// Sizes 'stacks' and 'flame_counts' before the object is loaded
+int flame_prepare(struct bpf_object *obj) {
+    struct bpf_map *stacks = bpf_object__find_map_by_name(obj, "stacks");
+    struct bpf_map *counts = bpf_object__find_map_by_name(obj, "flame_counts");
+
+    __u32 n = g_flame_stacks ? g_flame_stacks : DEFAULT_FLAME_STACKS;
+
+    if (!stacks || !counts || bpf_map__set_max_entries(stacks, n) != 0)
+        return -1;
+    return bpf_map__set_max_entries(counts, n);
+}
+
+// A fixed period rather than a frequency, so every sample is worth the same
+// nanoseconds. CPUs that are offline are skipped.
+int flame_attach(struct bpf_object *obj) {
+    struct bpf_program *prog = bpf_object__find_program_by_name(obj, "handle_cpu_sample");
+    struct perf_event_attr attr;
+    int ncpus = libbpf_num_possible_cpus();
+
+    if (!prog || ncpus <= 0)
+        return -1;
+    g_flame_links = (struct bpf_link **)calloc(ncpus, sizeof(*g_flame_links));
+    if (!g_flame_links)
+        return -1;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.sample_period = 1000000000ull / (g_flame_hz ? g_flame_hz : DEFAULT_FLAME_HZ);
+    for (int cpu = 0; cpu < ncpus; cpu++) {
+        int pfd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+        if (pfd < 0 && errno == ENODEV)
+            continue;
+        if (pfd < 0) {
+            fprintf(stderr, "ERROR: opening the CPU clock on CPU %d failed: %s\n", cpu, strerror(errno));
+            return -1;
+        }
+        struct bpf_link *link = bpf_program__attach_perf_event(prog, pfd);
+        if (libbpf_get_error(link)) {
+            fprintf(stderr, "ERROR: attaching the sampler on CPU %d failed\n", cpu);
+            close(pfd);
+            return -1;
+        }
+        g_flame_links[g_num_flame_links++] = link;
+    }
+    return 0;
+}
+
+int flame_init(int counts_fd, int stacks_fd, int counters_fd) {
+    if (stacks_fd < 0 || counters_fd < 0)
+        return -1;
+    g_flame_stacks_fd = stacks_fd;
+    g_flame_counters_fd = counters_fd;
+    g_flame_counters_percpu = (__u64 *)calloc(g_ncpus, sizeof(__u64));
+    if (!g_flame_counters_percpu)
+        return -1;
+    return map_reader_init(&g_flame_rd, counts_fd, sizeof(struct flame_key), sizeof(__u64));
+}
+
+void flame_free(void) {
+    for (int i = 0; i < g_num_flame_links; i++)
+        bpf_link__destroy(g_flame_links[i]);
+    free(g_flame_links);
+    g_flame_links = NULL;
+    g_num_flame_links = 0;
+    free(g_flame_counters_percpu);
+    g_flame_counters_percpu = NULL;
+    map_reader_free(&g_flame_rd);
+}
+
+static unsigned long long read_flame_counter(__u32 counter) {
+    unsigned long long total = 0;
+
+    if (bpf_map_lookup_elem(g_flame_counters_fd, &counter, g_flame_counters_percpu) != 0)
+        return 0;
+    for (int cpu = 0; cpu < g_ncpus; cpu++)
+        total += g_flame_counters_percpu[cpu];
+    return total;
+}
+
+// Frames of the folded format cannot hold ';' or spaces
+static void flame_frame(FILE *f, const char *name, const char *suffix) {
+    fputc(';', f);
+    for (const char *c = name; *c; c++)
+        fputc(*c == ';' || *c == ' ' ? '_' : *c, f);
+    fputs(suffix, f);
+}
+
+// Prints the frames of one stack, outermost first
+static void flame_stack(FILE *f, __u32 tgid, __s32 id, int kernel, const char *suffix) {
+    __u64 ips[FLAME_MAX_DEPTH];
+    char buf[160];
+    int depth = 0;
+
+    if (id < 0 || bpf_map_lookup_elem(g_flame_stacks_fd, &id, ips) != 0)
+        return;
+    while (depth < FLAME_MAX_DEPTH && ips[depth])
+        depth++;
+    for (int i = depth - 1; i >= 0; i--) {
+        const char *name = NULL;
+        if (kernel) {
+            name = ksym_name(ips[i]);
+        } else {
+            const struct elf_sym *s;
+            const struct proc_map *m = symbolize_lookup(tgid, ips[i], &s);
+            if (s) {
+                name = s->name;
+            } else if (m && m->name[0] == '[') {
+                name = m->name;
+            } else if (m) {
+                snprintf(buf, sizeof(buf), "[%s]", m->name);
+                name = buf;
+            }
+        }
+        if (!name) {
+            snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)ips[i]);
+            name = buf;
+        }
+        flame_frame(f, name, suffix);
+    }
+}
+
+// Processes that exited before this are left with bare user addresses.
+int flame_write(const char *path) {
+    const struct flame_key *keys = (const struct flame_key *)g_flame_rd.keys;
+    const __u64 *ns = (const __u64 *)g_flame_rd.vals;
+
+    if (map_reader_read(&g_flame_rd) != 0)
+        return -1;
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    symbolize_flush();
+    for (__u32 i = 0; i < g_flame_rd.len; i++) {
+        const struct flame_key *k = &keys[i];
+        char comm[sizeof(k->comm) + 1];
+        __u32 tgid = proc_tgid(k->tgid);
+
+        snprintf(comm, sizeof(comm), "%.*s", (int)sizeof(k->comm), k->comm);
+        for (char *c = comm; *c; c++) {
+            if (*c == ';' || *c == ' ')
+                *c = '_';
+        }
+        fprintf(f, "%s;%s", comm[0] ? comm : "?", k->oncpu ? "[on-cpu]" : "[off-cpu]");
+        flame_stack(f, tgid, k->user_stack, 0, k->oncpu ? "" : "_[o]");
+        flame_stack(f, tgid, k->kern_stack, 1, k->oncpu ? "_[k]" : "_[o]");
+        fprintf(f, " %llu\n", (unsigned long long)ns[i]);
+    }
+    if (fclose(f) != 0)
+        return -1;
+    fprintf(stderr, "Flame graph: wrote %u stacks to %s\n", (unsigned)g_flame_rd.len, path);
+    unsigned long long stack_lost = read_flame_counter(FLAME_STACK_LOST);
+    unsigned long long count_lost = read_flame_counter(FLAME_COUNT_LOST);
+    if (stack_lost || count_lost)
+        fprintf(stderr, "WARNING: flame graph incomplete: %llu stacks not captured, %llu samples or "
+                "blocked intervals dropped; raise --flame-stacks (now %u)\n",
+                stack_lost, count_lost, g_flame_stacks ? g_flame_stacks : DEFAULT_FLAME_STACKS);
+    return 0;
+}
+
+// Lock contention report (--futex)
+#define FUTEX_REPORT_ROWS 20
+#define FUTEX_REPORT_HISTS 3
+
+int g_futex = 0;
+struct map_reader g_futex_stats_rd = { .fd = -1 };
+__u32 *g_futex_rows = NULL;         // indices into g_futex_stats_rd, sorted
+
+static int cmp_futex_rows(const void *a, const void *b) {
+    const struct futex_stat *vals = (const struct futex_stat *)g_futex_stats_rd.vals;
+    __u64 ta = vals[*(const __u32 *)a].wait.total_ns;
+    __u64 tb = vals[*(const __u32 *)b].wait.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+int futex_report_init(int fd) {
+    if (map_reader_init(&g_futex_stats_rd, fd, sizeof(struct futex_key), sizeof(struct futex_stat)) != 0)
+        return -1;
+    g_futex_rows = (__u32 *)calloc(g_futex_stats_rd.cap, sizeof(__u32));
+    return g_futex_rows ? 0 : -1;
+}
+
+void futex_report_free(void) {
+    map_reader_free(&g_futex_stats_rd);
+    free(g_futex_rows);
+    g_futex_rows = NULL;
+}
+
+// Most waited-on futex words since startup. MAX_WAITERS is the deepest
+// queue seen on the word, which is what gives a convoy away.
+void print_futex_report(void) {
+    const struct futex_key *keys = (const struct futex_key *)g_futex_stats_rd.keys;
+    const struct futex_stat *vals = (const struct futex_stat *)g_futex_stats_rd.vals;
+    __u32 rows = 0;
+    char sym[160], id[24];
+
+    if (!g_futex_rows || map_reader_read(&g_futex_stats_rd) != 0)
+        return;
+    for (__u32 i = 0; i < g_futex_stats_rd.len; i++) {
+        if ((g_filter_tgid == 0 || tgid_filter_key(keys[i].tgid) == g_filter_tgid) && vals[i].wait.count)
+            g_futex_rows[rows++] = i;
+    }
+    qsort(g_futex_rows, rows, sizeof(*g_futex_rows), cmp_futex_rows);
+    if (rows > FUTEX_REPORT_ROWS)
+        rows = FUTEX_REPORT_ROWS;
+
+    symbolize_flush();
+    printf("Most contended futexes\n");
+    printf("  %-8s %-18s %12s %10s %10s %11s %10s  %s\n",
+           "TGID", "UADDR", "WAIT_MS", "SLEEPS", "WAITS", "MAX_WAITERS", "MAX_MS", "LOCK");
+    for (__u32 r = 0; r < rows; r++) {
+        const struct futex_key *k = &keys[g_futex_rows[r]];
+        const struct futex_stat *s = &vals[g_futex_rows[r]];
+        printf("  %-8s 0x%-16llx %12.3f %10llu %10llu %11llu %10.3f  %s\n",
+               tgid_str(k->tgid, id, sizeof(id)), (unsigned long long)k->uaddr,
+               (double)s->wait.total_ns / 1e6, (unsigned long long)s->wait.count,
+               (unsigned long long)s->waits, (unsigned long long)s->max_waiters,
+               (double)s->wait.max_ns / 1e6, symbolize(proc_tgid(k->tgid), k->uaddr, sym, sizeof(sym)));
+    }
+    for (__u32 r = 0; r < rows && r < FUTEX_REPORT_HISTS; r++) {
+        const struct futex_key *k = &keys[g_futex_rows[r]];
+        const struct futex_stat *s = &vals[g_futex_rows[r]];
+        char title[256];
+        snprintf(title, sizeof(title), "Futex wait histogram, TGID %s on %s", tgid_str(k->tgid, id, sizeof(id)),
+                 symbolize(proc_tgid(k->tgid), k->uaddr, sym, sizeof(sym)));
+        print_log2_hist(title, (const unsigned long long *)s->hist.slots, HIST_SLOTS);
+    }
+}
+
+// Per-entity LRU maps share --map-budget: each loaded map gets a part of it
+// by weight, no more entries than pid_max when keyed by TID or TGID, and no
+// fewer than the LRU's per-CPU free lists need not to evict early. Maps of
+// features that are off get a single entry.
+#define DEFAULT_MAP_BUDGET_MB 64
+#define LRU_ELEM_OVERHEAD 64        // kernel bookkeeping per element, roughly
+#define LRU_LOCAL_FREE 128          // free elements each CPU may hold back
+#define LRU_COUNT_CHUNK 1024
+
+struct lru_map {
+    const char *name;
+    size_t key_sz;
+    size_t val_sz;
+    unsigned int weight;
+    int per_pid;                    // keyed by TID or TGID
+    int *enabled;                   // NULL: always loaded
+    int fd;
+    __u32 max_entries;
+    __u64 deleted;                  // deleted by userspace (reset)
+    __u64 evicted;                  // last reported
+};
+
+unsigned int g_map_budget_mb = DEFAULT_MAP_BUDGET_MB;
+int g_lru_ops_fd = -1;
+struct lru_ops *g_lru_percpu = NULL;    // g_ncpus values of one key
+void *g_count_keys = NULL;              // LRU_COUNT_CHUNK entries of the largest map
+void *g_count_vals = NULL;
+char g_lru_warning[128] = "";           // the latest eviction warning, shown by --top
+
+struct lru_map g_lru_maps[LRU_MAPS] = {
+    [LRU_OFFCPU_START]  = { "offcpu_start",  sizeof(__u32), sizeof(struct task_start), 2, 1, NULL, -1 },
+    [LRU_BLOCKED_START] = { "blocked_start", sizeof(__u32), sizeof(struct task_start), 2, 1, NULL, -1 },
+    [LRU_RUNQ_START]    = { "runq_start",    sizeof(__u32), sizeof(struct task_start), 2, 1, NULL, -1 },
+    [LRU_FUTEX_WAITS]   = { "futex_waits",   sizeof(__u32), sizeof(struct futex_wait), 1, 1, &g_futex, -1 },
+    [LRU_TGID_STATS]    = { "tgid_stats",    sizeof(__u32), sizeof(struct tgid_stats), 2, 1, NULL, -1 },
+    [LRU_SYSCALL_STATS] = { "syscall_stats", sizeof(struct syscall_key), sizeof(struct syscall_stat), 2, 0, &g_syscalls, -1 },
+    [LRU_FUTEX_STATS]   = { "futex_stats",   sizeof(struct futex_key), sizeof(struct futex_stat), 2, 0, &g_futex, -1 },
+    [LRU_TID_STATS]     = { "tid_stats",     sizeof(__u32), sizeof(struct tid_stats), 2, 1, &g_tid_stats, -1 },
+    [LRU_TGID_HISTS]    = { "tgid_hists",    sizeof(__u32), sizeof(struct tgid_hist), 2, 1, &g_tgid_hists, -1 },
+    [LRU_CGROUP_STATS]  = { "cgroup_stats",  sizeof(__u64), sizeof(struct group_stat), 1, 0, &g_cgroups, -1 },
+    [LRU_NS_TGIDS]      = { "ns_tgids",      sizeof(__u32), sizeof(__u32), 1, 1, &g_pidns, -1 },
+    [LRU_TID_HISTS]     = { "tid_hists",     sizeof(__u32), sizeof(struct tgid_hist), 2, 1, &g_threads, -1 },
+    [LRU_PREEMPT_STATS] = { "preempt_stats", sizeof(struct preempt_key), sizeof(struct time_stat), 1, 0, &g_preempt, -1 },
+    [LRU_IO_INFLIGHT]   = { "io_inflight",   sizeof(struct io_req_key), sizeof(struct io_req), 1, 0, &g_blockio, -1 },
+    [LRU_THREAD_EXITS]  = { "thread_exits",  sizeof(struct thread_exit_key), sizeof(struct group_stat), 1, 0, &g_threads, -1 },
+};
+
+static int lru_map_loaded(const struct lru_map *m) {
+    return !m->enabled || *m->enabled;
+}
+
+__u32 read_pid_max(void) {
+    unsigned int pid_max = 0;
+    FILE *f = fopen("/proc/sys/kernel/pid_max", "r");
+    if (f) {
+        if (fscanf(f, "%u", &pid_max) != 1)
+            pid_max = 0;
+        fclose(f);
+    }
+    return pid_max ? pid_max : 32768;
+}
+
+// Before bpf_object__load(): LRU maps preallocate every element.
+int size_lru_maps(struct bpf_object *obj) {
+    int ncpus = libbpf_num_possible_cpus();
+    __u32 pid_max = read_pid_max();
+    unsigned long long budget = (unsigned long long)g_map_budget_mb << 20;
+    unsigned long long used = 0;
+    unsigned int total_weight = 0;
+
+    if (ncpus <= 0)
+        return -1;
+    for (int i = 0; i < LRU_MAPS; i++) {
+        if (lru_map_loaded(&g_lru_maps[i]))
+            total_weight += g_lru_maps[i].weight;
+    }
+    fprintf(stderr, "Map budget %u MiB (pid_max %u, %d CPUs):", g_map_budget_mb, (unsigned)pid_max, ncpus);
+    for (int i = 0; i < LRU_MAPS; i++) {
+        struct lru_map *m = &g_lru_maps[i];
+        struct bpf_map *map = bpf_object__find_map_by_name(obj, m->name);
+        unsigned long long n = 1;
+        if (lru_map_loaded(m)) {
+            n = budget * m->weight / total_weight / (m->key_sz + m->val_sz + LRU_ELEM_OVERHEAD);
+            if (m->per_pid && n > pid_max)
+                n = pid_max;
+            if (n < (unsigned long long)ncpus * 2 * LRU_LOCAL_FREE)
+                n = (unsigned long long)ncpus * 2 * LRU_LOCAL_FREE;
+            used += n * (m->key_sz + m->val_sz + LRU_ELEM_OVERHEAD);
+            fprintf(stderr, " %s=%llu", m->name, n);
+        }
+        if (!map || bpf_map__set_max_entries(map, (__u32)n) != 0) {
+            fprintf(stderr, "\nERROR: failed to size map '%s'\n", m->name);
+            return -1;
+        }
+        m->max_entries = (__u32)n;
+    }
+    fputc('\n', stderr);
+    if (used > budget)
+        fprintf(stderr, "WARNING: the per-CPU minimum of %d CPUs takes the maps to %llu MiB, over --map-budget\n",
+                ncpus, (used + (1ull << 20) - 1) >> 20);
+    return 0;
+}
+
+int lru_stats_init(struct bpf_object *obj) {
+    struct bpf_map *ops_map = bpf_object__find_map_by_name(obj, "lru_ops");
+    size_t key_sz = 0, val_sz = 0;
+
+    g_lru_ops_fd = ops_map ? bpf_map__fd(ops_map) : -1;
+    for (int i = 0; i < LRU_MAPS; i++) {
+        struct lru_map *m = &g_lru_maps[i];
+        struct bpf_map *map = bpf_object__find_map_by_name(obj, m->name);
+        if (!lru_map_loaded(m) || !map)
+            continue;
+        m->fd = bpf_map__fd(map);
+        if (m->key_sz > key_sz)
+            key_sz = m->key_sz;
+        if (m->val_sz > val_sz)
+            val_sz = m->val_sz;
+    }
+    g_lru_percpu = (struct lru_ops *)calloc(g_ncpus, sizeof(struct lru_ops));
+    g_count_keys = calloc(LRU_COUNT_CHUNK, key_sz);
+    g_count_vals = calloc(LRU_COUNT_CHUNK, val_sz);
+    return (g_lru_ops_fd >= 0 && g_lru_percpu && g_count_keys && g_count_vals) ? 0 : -1;
+}
+
+void lru_stats_free(void) {
+    free(g_lru_percpu);
+    free(g_count_keys);
+    free(g_count_vals);
+    g_lru_percpu = NULL;
+    g_count_keys = g_count_vals = NULL;
+}
+
+// Entries in a hash map, fetched LRU_COUNT_CHUNK at a time. Returns -1 if
+// the kernel cannot batch.
+long long map_count_entries(const struct lru_map *m) {
+    __u64 batch = 0;
+    void *in = NULL;
+    long long total = 0;
+
+    for (;;) {
+        __u32 count = LRU_COUNT_CHUNK;
+        int err = bpf_map_lookup_batch(m->fd, in, &batch, g_count_keys, g_count_vals, &count, NULL);
+        total += count;
+        if (err)
+            return errno == ENOENT ? total : -1;
+        in = &batch;
+    }
+}
+
+// Nothing reports an LRU eviction, so it is inferred: whatever the programs
+// inserted and nobody deleted but is no longer there was evicted. The
+// counters alone bound what a map can hold, so its entries are only counted
+// once that bound, less what was already found evicted, comes close enough
+// to full for the LRU to evict. Counting races with the programs, so a
+// deficit is only reported if the map turns out to be that full.
+void lru_check_evictions(void) {
+    if (g_lru_ops_fd < 0)
+        return;
+    for (__u32 i = 0; i < LRU_MAPS; i++) {
+        struct lru_map *m = &g_lru_maps[i];
+        if (m->fd < 0 || bpf_map_lookup_elem(g_lru_ops_fd, &i, g_lru_percpu) != 0)
+            continue;
+        unsigned long long inserts = 0, deletes = m->deleted;
+        for (int cpu = 0; cpu < g_ncpus; cpu++) {
+            inserts += g_lru_percpu[cpu].inserts;
+            deletes += g_lru_percpu[cpu].deletes;
+        }
+        unsigned long long slack = (unsigned long long)g_ncpus * LRU_LOCAL_FREE;
+        if (inserts < deletes + m->evicted || inserts - deletes - m->evicted + slack < m->max_entries)
+            continue;
+        long long live = map_count_entries(m);
+        if (live < 0)
+            continue;
+        if (inserts < deletes + (unsigned long long)live)
+            continue;
+        unsigned long long evicted = inserts - deletes - (unsigned long long)live;
+        if (evicted <= m->evicted)
+            continue;
+        if ((unsigned long long)live + slack >= m->max_entries) {
+            snprintf(g_lru_warning, sizeof(g_lru_warning),
+                     "WARNING: map '%s' is full (%u entries) and has evicted %llu entries; raise --map-budget",
+                     m->name, (unsigned)m->max_entries, evicted);
+            // --top owns the screen and puts it in its header instead
+            if (!g_top)
+                fprintf(stderr, "%s\n", g_lru_warning);
+        }
+        m->evicted = evicted;
+    }
+}
+
+// Captures are saved as text so they can be checked in next to a rollout
+// and read by other tools: one "<hist> <bucket> <count>" line per non-empty
+// bucket after a short header.
+#define CAPTURE_MAGIC "# cpu_analyzer capture v1"
+
+// Exit status of the diff mode when a --max-* threshold is exceeded.
+#define DIFF_EXIT_REGRESSION 3
+// Intervals in a row a live diff must exceed a threshold before it fails:
+// the first few compare a handful of samples against a whole capture.
+#define DEFAULT_DIFF_STREAK 3
+
+char *g_save_path = NULL;
+int g_diff_mode = 0;
+const char *g_diff_base_path = NULL;
+const char *g_diff_new_path = NULL;
+struct hist_capture g_baseline;
+double g_max_ks = -1.0;
+double g_max_emd = -1.0;
+double g_max_p99_pct = -1.0;
+unsigned int g_diff_streak = DEFAULT_DIFF_STREAK;
+unsigned int g_diff_violations = 0;     // live intervals in a row over a threshold
+
+int save_capture(const char *path, const struct hist_capture *cap) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "%s\n", CAPTURE_MAGIC);
+    fprintf(f, "interval_sec %u\n", cap->interval_sec);
+    fprintf(f, "pid %u\n", (unsigned)cap->pid);
+    fprintf(f, "intervals %llu\n", cap->intervals);
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        if (cap->offcpu[b])
+            fprintf(f, "offcpu %zu %llu\n", b, cap->offcpu[b]);
+    }
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        if (cap->blocked[b])
+            fprintf(f, "blocked %zu %llu\n", b, cap->blocked[b]);
+    }
+    if (fclose(f) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return rename(tmp, path);
+}
+
+int load_capture(const char *path, struct hist_capture *cap) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    memset(cap, 0, sizeof(*cap));
+
+    char line[256];
+    int rc = -1;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0)
+        goto out;
+    while (fgets(line, sizeof(line), f)) {
+        char key[32];
+        unsigned long long a = 0, b = 0;
+        int n = sscanf(line, "%31s %llu %llu", key, &a, &b);
+        if (n == 3 && a < HIST_BUCKETS && strcmp(key, "offcpu") == 0)
+            cap->offcpu[a] = b;
+        else if (n == 3 && a < HIST_BUCKETS && strcmp(key, "blocked") == 0)
+            cap->blocked[a] = b;
+        else if (n == 2 && strcmp(key, "interval_sec") == 0)
+            cap->interval_sec = (unsigned int)a;
+        else if (n == 2 && strcmp(key, "pid") == 0)
+            cap->pid = (__u32)a;
+        else if (n == 2 && strcmp(key, "intervals") == 0)
+            cap->intervals = a;
+        else if (line[0] != '#' && line[0] != '\n')
+            goto out;
+    }
+    rc = 0;
+out:
+    fclose(f);
+    return rc;
+}
+
+unsigned long long hist_total(const unsigned long long *counts, size_t buckets) {
+    unsigned long long total = 0;
+    for (size_t b = 0; b < buckets; b++)
+        total += counts[b];
+    return total;
+}
+
+// Percentile q (0..1) in usecs, interpolated linearly inside the log2 bucket.
+double hist_percentile_us(const unsigned long long *counts, size_t buckets, double q) {
+    unsigned long long total = hist_total(counts, buckets);
+    if (total == 0)
+        return 0.0;
+
+    double target = q * (double)total;
+    unsigned long long seen = 0;
+    for (size_t b = 0; b < buckets; b++) {
+        if (counts[b] == 0)
+            continue;
+        if ((double)(seen + counts[b]) >= target) {
+            double lower = (b == 0) ? 0.0 : ldexp(1.0, (int)b);
+            // The last bucket has no upper bound
+            if (b == buckets - 1)
+                return lower;
+            double upper = ldexp(1.0, (int)b + 1);
+            double frac = (target - (double)seen) / (double)counts[b];
+            return lower + frac * (upper - lower);
+        }
+        seen += counts[b];
+    }
+    return ldexp(1.0, (int)buckets - 1);
+}
+
+// Kolmogorov-Smirnov distance (largest CDF gap) and Earth Mover's distance
+// between two log2 histograms. EMD is in buckets, i.e. how many doublings of
+// latency the mass moved on average.
+void hist_distance(const unsigned long long *a, const unsigned long long *b, size_t buckets,
+                   double *ks_out, double *emd_out) {
+    unsigned long long ta = hist_total(a, buckets);
+    unsigned long long tb = hist_total(b, buckets);
+    double ks = 0.0, emd = 0.0;
+
+    if (ta != 0 && tb != 0) {
+        double ca = 0.0, cb = 0.0;
+        for (size_t i = 0; i < buckets; i++) {
+            ca += (double)a[i] / (double)ta;
+            cb += (double)b[i] / (double)tb;
+            double gap = ca > cb ? ca - cb : cb - ca;
+            if (gap > ks) ks = gap;
+            emd += gap;
+        }
+    }
+    *ks_out = ks;
+    *emd_out = emd;
+}
+
+// Prints the per-bucket delta and summary statistics for one histogram and
+// returns 1 if any configured threshold is exceeded.
+int print_hist_diff(const char *title, const unsigned long long *base, const unsigned long long *cur) {
+    unsigned long long tb = hist_total(base, HIST_BUCKETS);
+    unsigned long long tc = hist_total(cur, HIST_BUCKETS);
+
+    size_t last_nonzero = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++) {
+        if (base[b] != 0 || cur[b] != 0)
+            last_nonzero = b;
+    }
+    const size_t cap_bucket = 21;
+    size_t end_bucket = last_nonzero < cap_bucket ? last_nonzero : cap_bucket;
+
+    printf("%s diff (baseline %llu, current %llu)\n", title, tb, tc);
+    printf("     usecs                :   baseline    current   share delta\n");
+    for (size_t b = 0; b <= end_bucket; b++) {
+        unsigned long long lower = (b == 0) ? 0ull : (1ull << b);
+        unsigned long long upper = (1ull << (b + 1)) - 1ull;
+        double pb = tb ? 100.0 * (double)base[b] / (double)tb : 0.0;
+        double pc = tc ? 100.0 * (double)cur[b] / (double)tc : 0.0;
+        printf(" %10llu -> %-10llu : %10llu %10llu %+9.2f%%\n",
+               lower, upper, base[b], cur[b], pc - pb);
+    }
+    if (last_nonzero > cap_bucket) {
+        unsigned long long ib = hist_total(base + cap_bucket + 1, HIST_BUCKETS - cap_bucket - 1);
+        unsigned long long ic = hist_total(cur + cap_bucket + 1, HIST_BUCKETS - cap_bucket - 1);
+        double pb = tb ? 100.0 * (double)ib / (double)tb : 0.0;
+        double pc = tc ? 100.0 * (double)ic / (double)tc : 0.0;
+        printf(" %10llu -> %-10s : %10llu %10llu %+9.2f%%\n",
+               (unsigned long long)4194303, "infinity", ib, ic, pc - pb);
+    }
+
+    static const double qs[] = { 0.50, 0.90, 0.99, 0.999 };
+    static const char *qnames[] = { "p50", "p90", "p99", "p99.9" };
+    double p99_pct = 0.0;
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        double vb = hist_percentile_us(base, HIST_BUCKETS, qs[i]);
+        double vc = hist_percentile_us(cur, HIST_BUCKETS, qs[i]);
+        double pct = vb > 0.0 ? 100.0 * (vc - vb) / vb : 0.0;
+        if (qs[i] == 0.99)
+            p99_pct = pct;
+        printf("  %-6s %12.1f -> %12.1f us (%+.1f%%)\n", qnames[i], vb, vc, pct);
+    }
+
+    double ks, emd;
+    hist_distance(base, cur, HIST_BUCKETS, &ks, &emd);
+    printf("  KS distance %.4f, EMD %.4f buckets\n", ks, emd);
+
+    int exceeded = 0;
+    if (tb == 0 || tc == 0)
+        return 0;
+    if (g_max_ks >= 0.0 && ks > g_max_ks) {
+        printf("  REGRESSION: KS distance %.4f > %.4f\n", ks, g_max_ks);
+        exceeded = 1;
+    }
+    if (g_max_emd >= 0.0 && emd > g_max_emd) {
+        printf("  REGRESSION: EMD %.4f > %.4f buckets\n", emd, g_max_emd);
+        exceeded = 1;
+    }
+    if (g_max_p99_pct >= 0.0 && p99_pct > g_max_p99_pct) {
+        printf("  REGRESSION: p99 shift %+.1f%% > %.1f%%\n", p99_pct, g_max_p99_pct);
+        exceeded = 1;
+    }
+    return exceeded;
+}
+
+int print_capture_diff(const struct hist_capture *base, const struct hist_capture *cur) {
+    int exceeded = 0;
+    exceeded |= print_hist_diff("Off-cpu time histogram", base->offcpu, cur->offcpu);
+    exceeded |= print_hist_diff("Blocked time histogram", base->blocked, cur->blocked);
+    fflush(stdout);
+    return exceeded;
+}
+
+int run_file_diff(void) {
+    struct hist_capture cur;
+
+    if (load_capture(g_diff_base_path, &g_baseline) != 0) {
+        fprintf(stderr, "ERROR: could not read capture '%s'\n", g_diff_base_path);
+        return EXIT_FAILURE;
+    }
+    if (load_capture(g_diff_new_path, &cur) != 0) {
+        fprintf(stderr, "ERROR: could not read capture '%s'\n", g_diff_new_path);
+        return EXIT_FAILURE;
+    }
+    return print_capture_diff(&g_baseline, &cur) ? DIFF_EXIT_REGRESSION : EXIT_SUCCESS;
+}
+
+// Per-cgroup report (--cgroups) and filter (--cgroup PATH). 'cgroup_stats'
+// is keyed by cgroup v2 id, which is the inode number of the cgroup's
+// directory, so ids are mapped to paths by walking the hierarchy. Each
+// cgroup's time is rolled up into all of its ancestors, so a slice shows
+// everything running under it.
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_REPORT_ROWS 20
+
+struct cgroup_path {
+    __u64 id;                   // key
+    char *path;                 // below CGROUP_ROOT, "/" for the root
+    UT_hash_handle hh;
+};
+
+struct cgroup_node {
+    char *path;                 // key
+    struct group_stat own;
+    struct group_stat total;   // own plus all descendants
+    UT_hash_handle hh;
+};
+
+// Cgroups removed since they were charged are folded into one row
+#define CGROUP_GONE "/[gone]"
+
+char g_cgroup_path_buf[PATH_MAX];
+const char *g_cgroup_path = NULL;   // --cgroup, below CGROUP_ROOT
+struct map_reader g_cgroup_stats_rd = { .fd = -1 };
+struct cgroup_path *g_cgroup_paths = NULL;
+struct cgroup_node *g_cgroup_nodes = NULL;
+struct group_stat g_cgroup_gone;    // removed cgroups whose entries were deleted
+
+// Accepts a path below CGROUP_ROOT, with or without that prefix, and
+// stores it in out as "/a/b" ("/" for the root). -1 if it does not fit.
+int cgroup_normalize(const char *arg, char *out, size_t len) {
+    if (strncmp(arg, CGROUP_ROOT, strlen(CGROUP_ROOT)) == 0)
+        arg += strlen(CGROUP_ROOT);
+    int n = snprintf(out, len, "%s%s", arg[0] == '/' ? "" : "/", arg);
+    if (n < 0 || (size_t)n >= len)
+        return -1;
+    while (n > 1 && out[n - 1] == '/')
+        out[--n] = '\0';
+    return 0;
+}
+
+int cgroup_v2_mounted(void) {
+    return access(CGROUP_ROOT "/cgroup.controllers", F_OK) == 0;
+}
+
+// Puts the --cgroup directory into 'cgroup_filter'; the kernel keeps its
+// own reference, so the fd is closed again.
+int cgroup_filter_set(int map_fd) {
+    char path[PATH_MAX];
+    __u32 zero = 0;
+
+    snprintf(path, sizeof(path), "%s%s", CGROUP_ROOT, g_cgroup_path);
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: cannot open cgroup '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    int err = bpf_map_update_elem(map_fd, &zero, &fd, BPF_ANY);
+    close(fd);
+    return err;
+}
+
+static void cgroup_paths_add(__u64 id, const char *path) {
+    struct cgroup_path *p;
+
+    HASH_FIND(hh, g_cgroup_paths, &id, sizeof(id), p);
+    if (p)
+        return;
+    p = (struct cgroup_path *)calloc(1, sizeof(*p));
+    if (!p)
+        return;
+    p->id = id;
+    p->path = strdup(*path ? path : "/");
+    if (!p->path) {
+        free(p);
+        return;
+    }
+    HASH_ADD(hh, g_cgroup_paths, id, sizeof(p->id), p);
+}
+
+// Returns -1 if part of the hierarchy could not be read.
+static int cgroup_walk(char *path, size_t len, size_t cap) {
+    struct stat st;
+    struct dirent *de;
+    int err = 0;
+
+    if (stat(path, &st) != 0)
+        return -1;
+    cgroup_paths_add((__u64)st.st_ino, path + strlen(CGROUP_ROOT));
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        int n = snprintf(path + len, cap - len, "/%s", de->d_name);
+        if (n > 0 && (size_t)n < cap - len) {
+            if (cgroup_walk(path, len + (size_t)n, cap) != 0)
+                err = -1;
+        } else {
+            err = -1;
+        }
+        path[len] = '\0';
+    }
+    closedir(d);
+    return err;
+}
+
+void cgroup_paths_free(void) {
+    struct cgroup_path *p, *tmp;
+    HASH_ITER(hh, g_cgroup_paths, p, tmp) {
+        HASH_DEL(g_cgroup_paths, p);
+        free(p->path);
+        free(p);
+    }
+}
+
+// Path of a cgroup id; the hierarchy is walked again (once per report) when
+// an id is not known yet. *walked is 1 after a complete walk and -1 after
+// one that missed part of the hierarchy. NULL for cgroups that are gone.
+const char *cgroup_path_of(__u64 id, int *walked) {
+    struct cgroup_path *p;
+
+    HASH_FIND(hh, g_cgroup_paths, &id, sizeof(id), p);
+    if (!p && !*walked) {
+        char path[PATH_MAX] = CGROUP_ROOT;
+        cgroup_paths_free();
+        *walked = cgroup_walk(path, strlen(path), sizeof(path)) == 0 ? 1 : -1;
+        HASH_FIND(hh, g_cgroup_paths, &id, sizeof(id), p);
+    }
+    return p ? p->path : NULL;
+}
+
+static void time_stat_add(struct time_stat *dst, const struct time_stat *src) {
+    dst->total_ns += src->total_ns;
+    dst->count += src->count;
+    if (src->max_ns > dst->max_ns)
+        dst->max_ns = src->max_ns;
+}
+
+static void group_stat_add(struct group_stat *dst, const struct group_stat *src) {
+    time_stat_add(&dst->offcpu, &src->offcpu);
+    time_stat_add(&dst->blocked, &src->blocked);
+    time_stat_add(&dst->runq, &src->runq);
+    for (size_t b = 0; b < HIST_SLOTS; b++) {
+        dst->offcpu_hist.slots[b] += src->offcpu_hist.slots[b];
+        dst->blocked_hist.slots[b] += src->blocked_hist.slots[b];
+    }
+}
+
+static struct cgroup_node *cgroup_node_get(const char *path) {
+    struct cgroup_node *n;
+
+    HASH_FIND_STR(g_cgroup_nodes, path, n);
+    if (n)
+        return n;
+    n = (struct cgroup_node *)calloc(1, sizeof(*n));
+    if (!n)
+        return NULL;
+    n->path = strdup(path);
+    if (!n->path) {
+        free(n);
+        return NULL;
+    }
+    HASH_ADD_KEYPTR(hh, g_cgroup_nodes, n->path, strlen(n->path), n);
+    return n;
+}
+
+// Adds one cgroup's own time to it and to every ancestor up to the root.
+static void cgroup_rollup(const char *path, const struct group_stat *st) {
+    char anc[PATH_MAX];
+    struct cgroup_node *n = cgroup_node_get(path);
+
+    if (n)
+        group_stat_add(&n->own, st);
+    snprintf(anc, sizeof(anc), "%s", path);
+    for (;;) {
+        n = cgroup_node_get(anc);
+        if (n)
+            group_stat_add(&n->total, st);
+        if (strcmp(anc, "/") == 0)
+            break;
+        char *slash = strrchr(anc, '/');
+        if (slash == anc)
+            slash[1] = '\0';
+        else
+            *slash = '\0';
+    }
+}
+
+static int cgroup_in_scope(const char *path) {
+    if (!g_cgroup_path || strcmp(g_cgroup_path, "/") == 0)
+        return 1;
+    size_t len = strlen(g_cgroup_path);
+    return strncmp(path, g_cgroup_path, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static int cmp_cgroup_nodes(const void *a, const void *b) {
+    __u64 ta = (*(struct cgroup_node *const *)a)->total.offcpu.total_ns;
+    __u64 tb = (*(struct cgroup_node *const *)b)->total.offcpu.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+int cgroup_report_init(int fd) {
+    return map_reader_init(&g_cgroup_stats_rd, fd, sizeof(__u64), sizeof(struct group_stat));
+}
+
+void cgroup_report_free(void) {
+    map_reader_free(&g_cgroup_stats_rd);
+    cgroup_paths_free();
+}
+
+// Off-CPU, blocked and run-queue time since startup per cgroup, each
+// including its descendants, largest off-CPU time first.
+void print_cgroup_report(void) {
+    const __u64 *keys = (const __u64 *)g_cgroup_stats_rd.keys;
+    const struct group_stat *vals = (const struct group_stat *)g_cgroup_stats_rd.vals;
+    struct cgroup_node *n, *tmp, **rows;
+    size_t nrows = 0;
+    int walked = 0;
+    char p99[2][16];
+
+    if (map_reader_read(&g_cgroup_stats_rd) != 0)
+        return;
+    for (__u32 i = 0; i < g_cgroup_stats_rd.len; i++) {
+        const char *path = cgroup_path_of(keys[i], &walked);
+        if (path) {
+            cgroup_rollup(path, &vals[i]);
+            continue;
+        }
+        // Removed since: the map was read before the walk, so a complete
+        // walk that did not see it settles that. Its time is kept and its
+        // entry dropped, so that it does not cause a walk every report.
+        if (walked > 0 && bpf_map_delete_elem(g_cgroup_stats_rd.fd, &keys[i]) == 0) {
+            g_lru_maps[LRU_CGROUP_STATS].deleted++;
+            group_stat_add(&g_cgroup_gone, &vals[i]);
+        } else {
+            cgroup_rollup(CGROUP_GONE, &vals[i]);
+        }
+    }
+    if (g_cgroup_gone.offcpu.count + g_cgroup_gone.blocked.count + g_cgroup_gone.runq.count > 0)
+        cgroup_rollup(CGROUP_GONE, &g_cgroup_gone);
+
+    rows = (struct cgroup_node **)calloc(HASH_COUNT(g_cgroup_nodes) + 1, sizeof(*rows));
+    HASH_ITER(hh, g_cgroup_nodes, n, tmp) {
+        if (rows && n->total.offcpu.count + n->total.blocked.count + n->total.runq.count > 0 &&
+            cgroup_in_scope(n->path))
+            rows[nrows++] = n;
+    }
+    if (rows)
+        qsort(rows, nrows, sizeof(*rows), cmp_cgroup_nodes);
+    if (nrows > CGROUP_REPORT_ROWS)
+        nrows = CGROUP_REPORT_ROWS;
+
+    printf("Off-cpu time by cgroup (including child cgroups)\n");
+    printf("  %12s %12s %12s %12s %10s %10s  %s\n",
+           "OFFCPU_MS", "OWN_MS", "BLOCKED_MS", "RUNQ_MS", "OFF_P99_US", "BLK_P99_US", "CGROUP");
+    for (size_t r = 0; r < nrows; r++) {
+        const struct group_stat *t = &rows[r]->total;
+        const unsigned long long *hists[2] = {
+            (const unsigned long long *)t->offcpu_hist.slots,
+            (const unsigned long long *)t->blocked_hist.slots,
+        };
+        for (int h = 0; h < 2; h++) {
+            if (hist_total(hists[h], HIST_SLOTS) == 0)
+                snprintf(p99[h], sizeof(p99[h]), "-");
+            else
+                snprintf(p99[h], sizeof(p99[h]), "%.0f", hist_percentile_us(hists[h], HIST_SLOTS, 0.99));
+        }
+        printf("  %12.3f %12.3f %12.3f %12.3f %10s %10s  %s\n",
+               (double)t->offcpu.total_ns / 1e6, (double)rows[r]->own.offcpu.total_ns / 1e6,
+               (double)t->blocked.total_ns / 1e6, (double)t->runq.total_ns / 1e6,
+               p99[0], p99[1], rows[r]->path);
+    }
+    free(rows);
+    HASH_ITER(hh, g_cgroup_nodes, n, tmp) {
+        HASH_DEL(g_cgroup_nodes, n);
+        free(n->path);
+        free(n);
+    }
+}
+
+// Target set (--pid given more than once, --tid, --comm): the programs only
+// follow matching tasks and keep totals and histograms per target in
+// 'target_stats', which are printed side by side. Processes already
+// descended from a target when we start are added like forked ones.
+enum target_kind { TARGET_PID, TARGET_TID, TARGET_COMM };
+
+struct target {
+    enum target_kind kind;
+    __u32 id;                   // PID or TID
+    char comm[16];              // comm prefix
+    char label[16];
+};
+
+struct proc_ent {
+    __u32 pid;                  // key
+    __u32 ppid;
+    __u32 id;                   // PID the target set knows it by; 0 outside --pidns
+    __u32 target;
+    UT_hash_handle hh;
+};
+
+struct target g_targets[MAX_TARGETS];
+int g_num_targets = 0;
+int g_target_stats_fd = -1;
+
+int target_add(enum target_kind kind, __u32 id, const char *comm) {
+    struct target *t;
+
+    if (g_num_targets == MAX_TARGETS) {
+        fprintf(stderr, "At most %d PIDs, TIDs and comms can be given.\n", MAX_TARGETS);
+        return -1;
+    }
+    t = &g_targets[g_num_targets++];
+    memset(t, 0, sizeof(*t));
+    t->kind = kind;
+    t->id = id;
+    if (kind == TARGET_COMM) {
+        snprintf(t->comm, sizeof(t->comm), "%s", comm);
+        snprintf(t->label, sizeof(t->label), "%.10s*", comm);
+    } else {
+        snprintf(t->label, sizeof(t->label), "%s %u", kind == TARGET_PID ? "pid" : "tid", (unsigned)id);
+    }
+    return 0;
+}
+
+static __u32 target_of_comm(const char *comm) {
+    for (int i = 0; i < g_num_targets; i++) {
+        if (g_targets[i].kind == TARGET_COMM &&
+            strncmp(comm, g_targets[i].comm, strlen(g_targets[i].comm)) == 0)
+            return (__u32)i;
+    }
+    return TARGET_NONE;
+}
+
+// A process's PID in the --pidns namespace, from the last NSpid entry of its
+// status, or 0 if it is not a member
+static __u32 proc_ns_pid(unsigned long pid) {
+    char path[64], line[256];
+    struct stat st;
+    __u32 ns_pid = 0;
+
+    snprintf(path, sizeof(path), "/proc/%lu/ns/pid", pid);
+    if (stat(path, &st) != 0 || st.st_ino != g_config.pidns_ino)
+        return 0;
+    snprintf(path, sizeof(path), "/proc/%lu/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "NSpid:", 6) == 0) {
+            char *p = line + 6, *end;
+            for (unsigned long v; (v = strtoul(p, &end, 10)), end != p; p = end)
+                ns_pid = (__u32)v;
+            break;
+        }
+    }
+    fclose(f);
+    return ns_pid;
+}
+
+// Reads every process's parent and comm from /proc/<pid>/stat and adds the
+// descendants of matching processes to 'target_pids'. With --pidns, only
+// members of the namespace are added, by their namespace-local PID.
+static void targets_add_existing(int pids_fd) {
+    struct proc_ent *procs = NULL, *p, *tmp;
+    struct dirent *de;
+    char path[64], buf[512];
+
+    DIR *d = opendir("/proc");
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        char *end;
+        unsigned long pid = strtoul(de->d_name, &end, 10);
+        if (*end != '\0' || pid == 0)
+            continue;
+        snprintf(path, sizeof(path), "/proc/%lu/stat", pid);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[n] = '\0';
+        // pid (comm) state ppid ...; comm may itself contain ')'
+        char *open = strchr(buf, '('), *close = strrchr(buf, ')');
+        unsigned int ppid;
+        if (!open || !close || close < open || sscanf(close + 1, " %*c %u", &ppid) != 1)
+            continue;
+        *close = '\0';
+        p = (struct proc_ent *)calloc(1, sizeof(*p));
+        if (!p)
+            break;
+        p->pid = (__u32)pid;
+        p->ppid = ppid;
+        p->id = (g_pidns && !g_pidns_proc) ? proc_ns_pid(pid) : (__u32)pid;
+        p->target = p->id ? target_of_comm(open + 1) : TARGET_NONE;
+        for (int i = 0; i < g_num_targets; i++) {
+            if (g_targets[i].kind == TARGET_PID && p->id && g_targets[i].id == p->id)
+                p->target = (__u32)i;
+        }
+        HASH_ADD(hh, procs, pid, sizeof(p->pid), p);
+    }
+    closedir(d);
+
+    HASH_ITER(hh, procs, p, tmp) {
+        struct proc_ent *a = p;
+        // Bounded in case of a parent loop from PIDs reused while reading
+        for (int depth = 0; a && a->target == TARGET_NONE && depth < 64; depth++) {
+            __u32 ppid = a->ppid;
+            HASH_FIND(hh, procs, &ppid, sizeof(ppid), a);
+        }
+        if (a && a->target != TARGET_NONE && p->id)
+            bpf_map_update_elem(pids_fd, &p->id, &a->target, BPF_ANY);
+    }
+    HASH_ITER(hh, procs, p, tmp) {
+        HASH_DEL(procs, p);
+        free(p);
+    }
+}
+
+int targets_setup(struct bpf_object *obj) {
+    struct bpf_map *pids = bpf_object__find_map_by_name(obj, "target_pids");
+    struct bpf_map *tids = bpf_object__find_map_by_name(obj, "target_tids");
+    struct bpf_map *comms = bpf_object__find_map_by_name(obj, "target_comms");
+    struct bpf_map *stats = bpf_object__find_map_by_name(obj, "target_stats");
+
+    if (!pids || !tids || !comms || !stats)
+        return -1;
+    g_target_stats_fd = bpf_map__fd(stats);
+    for (__u32 i = 0; i < (__u32)g_num_targets; i++) {
+        const struct target *t = &g_targets[i];
+        int err;
+        if (t->kind == TARGET_COMM) {
+            struct comm_key key;
+            memset(&key, 0, sizeof(key));
+            key.prefixlen = (__u32)strlen(t->comm) * 8;
+            memcpy(key.comm, t->comm, strlen(t->comm));
+            err = bpf_map_update_elem(bpf_map__fd(comms), &key, &i, BPF_ANY);
+        } else {
+            err = bpf_map_update_elem(bpf_map__fd(t->kind == TARGET_PID ? pids : tids), &t->id, &i, BPF_ANY);
+        }
+        if (err)
+            return err;
+    }
+    targets_add_existing(bpf_map__fd(pids));
+    return 0;
+}
+
+// One log2 histogram per column, rows as in print_log2_hist()
+void print_hist_columns(const char *title, const struct log2_hist *hists, int n) {
+    const size_t cap_bucket = 21;
+    size_t last_nonzero = 0;
+
+    for (int i = 0; i < n; i++) {
+        for (size_t b = 0; b < HIST_SLOTS; b++) {
+            if (hists[i].slots[b] != 0 && b > last_nonzero)
+                last_nonzero = b;
+        }
+    }
+    printf("%s\n", title);
+    printf("     usecs                :");
+    for (int i = 0; i < n; i++)
+        printf(" %15s", g_targets[i].label);
+    printf("\n");
+    for (size_t b = 0; b <= last_nonzero && b <= cap_bucket; b++) {
+        printf(" %10llu -> %-10llu :", (b == 0) ? 0ull : (1ull << b), (1ull << (b + 1)) - 1ull);
+        for (int i = 0; i < n; i++)
+            printf(" %15llu", (unsigned long long)hists[i].slots[b]);
+        printf("\n");
+    }
+    if (last_nonzero > cap_bucket) {
+        printf(" %10llu -> %-10s :", (unsigned long long)4194303, "infinity");
+        for (int i = 0; i < n; i++) {
+            unsigned long long inf = 0;
+            for (size_t b = cap_bucket + 1; b < HIST_SLOTS; b++)
+                inf += hists[i].slots[b];
+            printf(" %15llu", inf);
+        }
+        printf("\n");
+    }
+}
+
+// Totals and histograms per target since startup
+void print_target_report(void) {
+    struct group_stat st[MAX_TARGETS];
+    struct log2_hist offcpu[MAX_TARGETS], blocked[MAX_TARGETS];
+    const char *rows[] = { "off-cpu ms", "blocked ms", "run queue ms", "off-cpu p99 us" };
+
+    for (__u32 i = 0; i < (__u32)g_num_targets; i++) {
+        if (bpf_map_lookup_elem(g_target_stats_fd, &i, &st[i]) != 0)
+            memset(&st[i], 0, sizeof(st[i]));
+        offcpu[i] = st[i].offcpu_hist;
+        blocked[i] = st[i].blocked_hist;
+    }
+    printf("Time by target\n");
+    printf("  %-24s", "");
+    for (int i = 0; i < g_num_targets; i++)
+        printf(" %15s", g_targets[i].label);
+    printf("\n");
+    for (size_t r = 0; r < sizeof(rows) / sizeof(rows[0]); r++) {
+        printf("  %-24s", rows[r]);
+        for (int i = 0; i < g_num_targets; i++) {
+            const unsigned long long *h = (const unsigned long long *)st[i].offcpu_hist.slots;
+            double v = r == 0 ? (double)st[i].offcpu.total_ns / 1e6 :
+                       r == 1 ? (double)st[i].blocked.total_ns / 1e6 :
+                       r == 2 ? (double)st[i].runq.total_ns / 1e6 :
+                       hist_total(h, HIST_SLOTS) ? hist_percentile_us(h, HIST_SLOTS, 0.99) : 0.0;
+            printf(" %15.3f", v);
+        }
+        printf("\n");
+    }
+    print_hist_columns("Off-cpu time histogram by target", offcpu, g_num_targets);
+    print_hist_columns("Blocked time histogram by target", blocked, g_num_targets);
+}
+
+// Per-thread report (--threads, with a single --pid): the programs keep every
+// thread's totals and comm in 'tid_stats' and its histograms in 'tid_hists',
+// and fold those of an exiting thread into 'thread_exits' by its comm. Every
+// interval the traced process's threads are grouped by comm with the
+// trailing number masked, so a pool of worker-0 .. worker-255 is one
+// "worker-*" row, and the threads that waited longest for a CPU follow. Like
+// the other interval reports it prints what changed since the last one.
+#define THREAD_REPORT_GROUPS 10
+#define THREAD_REPORT_HISTS 3
+#define THREAD_REPORT_STARVED 10
+
+struct thread_group {
+    char name[20];                  // key: comm pattern
+    __u32 threads;
+    struct group_stat st;
+    UT_hash_handle hh;
+};
+
+// A live thread, or the exited threads of one comm
+struct thread_prev_key {
+    __u32 tid;                      // 0 for exited threads
+    struct thread_exit_key exited;  // zero for a live thread
+};
+
+// Totals at the last report
+struct thread_prev {
+    struct thread_prev_key key;
+    __u32 tgid;                     // live threads: what they were last seen as
+    char comm[16];
+    unsigned long long gen;         // report it was last seen in
+    struct group_stat st;
+    struct time_stat oncpu;
+    UT_hash_handle hh;
+};
+
+struct thread_row {
+    __u32 tid;
+    char comm[16];
+    struct time_stat offcpu;
+    struct time_stat blocked;
+    struct time_stat runq;
+    struct time_stat oncpu;
+};
+
+int g_tid_hists_fd = -1;
+struct map_reader g_thread_stats_rd = { .fd = -1 };
+struct map_reader g_thread_exits_rd = { .fd = -1 };
+struct thread_prev *g_thread_prev = NULL;
+unsigned long long g_thread_gen = 0;
+struct thread_row *g_thread_rows = NULL;
+
+int thread_report_init(int stats_fd, int hists_fd, int exits_fd) {
+    if (map_reader_init(&g_thread_stats_rd, stats_fd, sizeof(__u32), sizeof(struct tid_stats)) != 0 ||
+        map_reader_init(&g_thread_exits_rd, exits_fd, sizeof(struct thread_exit_key), sizeof(struct group_stat)) != 0)
+        return -1;
+    g_tid_hists_fd = hists_fd;
+    g_thread_rows = (struct thread_row *)calloc(g_thread_stats_rd.cap, sizeof(struct thread_row));
+    return g_thread_rows ? 0 : -1;
+}
+
+void thread_prev_free(void) {
+    struct thread_prev *p, *tmp;
+
+    HASH_ITER(hh, g_thread_prev, p, tmp) {
+        HASH_DEL(g_thread_prev, p);
+        free(p);
+    }
+}
+
+void thread_report_free(void) {
+    thread_prev_free();
+    map_reader_free(&g_thread_stats_rd);
+    map_reader_free(&g_thread_exits_rd);
+    free(g_thread_rows);
+    g_thread_rows = NULL;
+}
+
+// "worker-*" for worker-12; a comm without a trailing number stays as it is
+static void comm_pattern(const char *comm, char *out, size_t len) {
+    size_t n = strnlen(comm, 16), end = n;
+
+    while (end > 0 && comm[end - 1] >= '0' && comm[end - 1] <= '9')
+        end--;
+    snprintf(out, len, "%.*s%s", (int)end, comm, end < n ? "*" : "");
+}
+
+static int cmp_thread_groups(const void *a, const void *b) {
+    __u64 ta = ((const struct thread_group *)a)->st.offcpu.total_ns;
+    __u64 tb = ((const struct thread_group *)b)->st.offcpu.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+static int cmp_thread_runq(const void *a, const void *b) {
+    __u64 ta = ((const struct thread_row *)a)->runq.total_ns;
+    __u64 tb = ((const struct thread_row *)b)->runq.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+// Turns cur into what changed since the totals kept under key, which it
+// replaces. A recycled TID or a reset starts over.
+static struct thread_prev *thread_delta(const struct thread_prev_key *key, struct group_stat *cur,
+                                        struct time_stat *oncpu) {
+    struct thread_prev *p;
+    struct group_stat total = *cur;
+
+    HASH_FIND(hh, g_thread_prev, key, sizeof(*key), p);
+    if (!p) {
+        p = (struct thread_prev *)calloc(1, sizeof(*p));
+        if (!p)
+            return NULL;
+        p->key = *key;
+        HASH_ADD(hh, g_thread_prev, key, sizeof(p->key), p);
+    }
+    if (cur->offcpu.count < p->st.offcpu.count || cur->blocked.count < p->st.blocked.count ||
+        cur->runq.count < p->st.runq.count || (oncpu && oncpu->count < p->oncpu.count)) {
+        memset(&p->st, 0, sizeof(p->st));
+        memset(&p->oncpu, 0, sizeof(p->oncpu));
+    }
+    time_stat_sub(&cur->offcpu, &total.offcpu, &p->st.offcpu);
+    time_stat_sub(&cur->blocked, &total.blocked, &p->st.blocked);
+    time_stat_sub(&cur->runq, &total.runq, &p->st.runq);
+    for (size_t b = 0; b < HIST_SLOTS; b++) {
+        __u64 o = p->st.offcpu_hist.slots[b], k = p->st.blocked_hist.slots[b];
+        cur->offcpu_hist.slots[b] = total.offcpu_hist.slots[b] > o ? total.offcpu_hist.slots[b] - o : 0;
+        cur->blocked_hist.slots[b] = total.blocked_hist.slots[b] > k ? total.blocked_hist.slots[b] - k : 0;
+    }
+    p->st = total;
+    if (oncpu) {
+        struct time_stat on = *oncpu;
+        time_stat_sub(oncpu, &on, &p->oncpu);
+        p->oncpu = on;
+    }
+    p->gen = g_thread_gen;
+    return p;
+}
+
+// Takes what was already reported for a thread out of its group's delta
+static void group_stat_take(struct group_stat *dst, const struct group_stat *src) {
+    const struct time_stat *s[] = { &src->offcpu, &src->blocked, &src->runq };
+    struct time_stat *d[] = { &dst->offcpu, &dst->blocked, &dst->runq };
+
+    for (int i = 0; i < 3; i++) {
+        d[i]->total_ns = d[i]->total_ns > s[i]->total_ns ? d[i]->total_ns - s[i]->total_ns : 0;
+        d[i]->count = d[i]->count > s[i]->count ? d[i]->count - s[i]->count : 0;
+    }
+    for (size_t b = 0; b < HIST_SLOTS; b++) {
+        __u64 *o = &dst->offcpu_hist.slots[b], *k = &dst->blocked_hist.slots[b];
+        *o = *o > src->offcpu_hist.slots[b] ? *o - src->offcpu_hist.slots[b] : 0;
+        *k = *k > src->blocked_hist.slots[b] ? *k - src->blocked_hist.slots[b] : 0;
+    }
+}
+
+static struct thread_group *thread_group_get(struct thread_group **groups, const char *comm) {
+    struct thread_group *g;
+    char name[20];
+
+    comm_pattern(comm, name, sizeof(name));
+    HASH_FIND_STR(*groups, name, g);
+    if (g)
+        return g;
+    g = (struct thread_group *)calloc(1, sizeof(*g));
+    if (!g)
+        return NULL;
+    snprintf(g->name, sizeof(g->name), "%s", name);
+    HASH_ADD_STR(*groups, name, g);
+    return g;
+}
+
+// Time of the traced process's threads over the interval, exited ones
+// included; the MAX columns are the longest single wait since startup
+void print_thread_report(void) {
+    const __u32 *tids = (const __u32 *)g_thread_stats_rd.keys;
+    const struct tid_stats *st = (const struct tid_stats *)g_thread_stats_rd.vals;
+    const struct thread_exit_key *xkeys = (const struct thread_exit_key *)g_thread_exits_rd.keys;
+    const struct group_stat *xst = (const struct group_stat *)g_thread_exits_rd.vals;
+    struct thread_group *groups = NULL, *g, *tmp;
+    struct thread_prev *p, *ptmp;
+    struct tgid_hist h;
+    char title[96];
+    __u32 rows = 0;
+    int n;
+
+    if (!g_thread_rows || map_reader_read(&g_thread_stats_rd) != 0)
+        return;
+    g_thread_gen++;
+    for (__u32 i = 0; i < g_thread_stats_rd.len; i++) {
+        if (tgid_filter_key(st[i].tgid) != g_filter_tgid)
+            continue;
+        struct thread_prev_key key;
+        memset(&key, 0, sizeof(key));
+        key.tid = tids[i];
+        struct group_stat one = { .offcpu = st[i].offcpu, .blocked = st[i].blocked, .runq = st[i].runq };
+        struct time_stat oncpu = st[i].oncpu;
+        if (g_tid_hists_fd >= 0 && bpf_map_lookup_elem(g_tid_hists_fd, &tids[i], &h) == 0) {
+            one.offcpu_hist = h.offcpu;
+            one.blocked_hist = h.blocked;
+        }
+        p = thread_delta(&key, &one, &oncpu);
+        if (p) {
+            p->tgid = st[i].tgid;
+            memcpy(p->comm, st[i].comm, sizeof(p->comm));
+        }
+
+        struct thread_row *r = &g_thread_rows[rows++];
+        r->tid = tids[i];
+        memcpy(r->comm, st[i].comm, sizeof(r->comm));
+        r->offcpu = one.offcpu;
+        r->blocked = one.blocked;
+        r->runq = one.runq;
+        r->oncpu = oncpu;
+        g = thread_group_get(&groups, st[i].comm);
+        if (!g)
+            continue;
+        g->threads++;
+        group_stat_add(&g->st, &one);
+    }
+    if (map_reader_read(&g_thread_exits_rd) == 0) {
+        for (__u32 i = 0; i < g_thread_exits_rd.len; i++) {
+            if (tgid_filter_key(xkeys[i].tgid) != g_filter_tgid)
+                continue;
+            struct thread_prev_key key;
+            memset(&key, 0, sizeof(key));
+            key.exited = xkeys[i];
+            struct group_stat gone = xst[i];
+            thread_delta(&key, &gone, NULL);
+            if (!gone.offcpu.count && !gone.blocked.count && !gone.runq.count)
+                continue;
+            g = thread_group_get(&groups, xkeys[i].comm);
+            if (g)
+                group_stat_add(&g->st, &gone);
+        }
+    }
+    // A thread that has gone since the last report was folded into
+    // 'thread_exits' whole, including what was reported while it lived
+    HASH_ITER(hh, g_thread_prev, p, ptmp) {
+        if (p->gen != g_thread_gen) {
+            if (p->key.tid != 0 && tgid_filter_key(p->tgid) == g_filter_tgid) {
+                char name[20];
+                comm_pattern(p->comm, name, sizeof(name));
+                HASH_FIND_STR(groups, name, g);
+                if (g)
+                    group_stat_take(&g->st, &p->st);
+            }
+            HASH_DEL(g_thread_prev, p);
+            free(p);
+        }
+    }
+    HASH_SORT(groups, cmp_thread_groups);
+
+    printf("Threads of PID %u by comm, exited threads included (MAX since start)\n", (unsigned)g_filter_tgid);
+    printf("  %-20s %8s %12s %12s %12s %12s\n", "COMM", "THREADS", "OFFCPU_MS", "BLOCKED_MS", "RUNQ_MS", "MAX_RUNQ_MS");
+    n = 0;
+    HASH_ITER(hh, groups, g, tmp) {
+        if (n++ == THREAD_REPORT_GROUPS)
+            break;
+        printf("  %-20s %8u %12.3f %12.3f %12.3f %12.3f\n", g->name, (unsigned)g->threads,
+               (double)g->st.offcpu.total_ns / 1e6, (double)g->st.blocked.total_ns / 1e6,
+               (double)g->st.runq.total_ns / 1e6, (double)g->st.runq.max_ns / 1e6);
+    }
+    n = 0;
+    HASH_ITER(hh, groups, g, tmp) {
+        if (n++ < THREAD_REPORT_HISTS) {
+            snprintf(title, sizeof(title), "Off-cpu time histogram, threads %s", g->name);
+            print_log2_hist(title, (const unsigned long long *)g->st.offcpu_hist.slots, HIST_SLOTS);
+            snprintf(title, sizeof(title), "Blocked time histogram, threads %s", g->name);
+            print_log2_hist(title, (const unsigned long long *)g->st.blocked_hist.slots, HIST_SLOTS);
+        }
+        HASH_DEL(groups, g);
+        free(g);
+    }
+
+    qsort(g_thread_rows, rows, sizeof(*g_thread_rows), cmp_thread_runq);
+    while (rows > 0 && g_thread_rows[rows - 1].runq.count == 0)
+        rows--;
+    if (rows > THREAD_REPORT_STARVED)
+        rows = THREAD_REPORT_STARVED;
+    printf("Threads waiting longest for a CPU (MAX since start)\n");
+    printf("  %-8s %-16s %12s %10s %10s %12s %12s",
+           "TID", "COMM", "RUNQ_MS", "COUNT", "MAX_MS", "OFFCPU_MS", "BLOCKED_MS");
+    if (g_oncpu)
+        printf(" %12s %14s", "ONCPU_MS", "AVG_SLICE_US");
+    printf("\n");
+    for (__u32 i = 0; i < rows; i++) {
+        const struct thread_row *r = &g_thread_rows[i];
+        printf("  %-8u %-16.16s %12.3f %10llu %10.3f %12.3f %12.3f", (unsigned)r->tid, r->comm,
+               (double)r->runq.total_ns / 1e6, (unsigned long long)r->runq.count,
+               (double)r->runq.max_ns / 1e6, (double)r->offcpu.total_ns / 1e6,
+               (double)r->blocked.total_ns / 1e6);
+        if (g_oncpu)
+            printf(" %12.3f %14.1f", (double)r->oncpu.total_ns / 1e6,
+                   r->oncpu.count ? (double)r->oncpu.total_ns / 1e3 / (double)r->oncpu.count : 0.0);
+        printf("\n");
+    }
+}
+
+// On-CPU slices (--oncpu): the programs time every slice from switch-in to
+// switch-out into 'oncpu_hist', the process's totals and 'tgid_hists' entry,
+// and with --threads the thread's totals. Next to the off-CPU side this gives
+// CPU use, switches per second and the average slice, which tell short,
+// often preempted slices from long uninterrupted runs.
+#define ONCPU_REPORT_ROWS 10
+#define ONCPU_REPORT_HISTS 3
+
+struct oncpu_prev {
+    __u32 tgid;                     // key
+    unsigned long long gen;         // report it was last seen in
+    struct time_stat oncpu;         // totals at that report
+    UT_hash_handle hh;
+};
+
+struct oncpu_row {
+    __u32 tgid;
+    struct time_stat delta;
+    __u64 max_ns;
+};
+
+int g_oncpu_hist_fd = -1;
+int g_oncpu_tgid_hists_fd = -1;
+unsigned long long g_oncpu_prev_counts[HIST_BUCKETS];
+unsigned long long g_oncpu_gen = 0;
+unsigned long long g_oncpu_last_ns = 0;
+struct oncpu_prev *g_oncpu_prev = NULL;
+struct oncpu_row *g_oncpu_rows = NULL;
+
+int oncpu_report_init(int hist_fd, int tgid_hists_fd) {
+    g_oncpu_hist_fd = hist_fd;
+    g_oncpu_tgid_hists_fd = tgid_hists_fd;
+    g_oncpu_rows = (struct oncpu_row *)calloc(g_tgid_stats_rd.cap, sizeof(struct oncpu_row));
+    g_oncpu_last_ns = get_monotonic_time_ns();
+    return (hist_fd >= 0 && g_oncpu_rows) ? 0 : -1;
+}
+
+void oncpu_report_free(void) {
+    struct oncpu_prev *p, *tmp;
+
+    HASH_ITER(hh, g_oncpu_prev, p, tmp) {
+        HASH_DEL(g_oncpu_prev, p);
+        free(p);
+    }
+    free(g_oncpu_rows);
+    g_oncpu_rows = NULL;
+}
+
+static int cmp_oncpu_rows(const void *a, const void *b) {
+    __u64 ta = ((const struct oncpu_row *)a)->delta.total_ns;
+    __u64 tb = ((const struct oncpu_row *)b)->delta.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+void print_oncpu_report(const struct interval_snapshot *iv) {
+    const __u32 *tgids = (const __u32 *)g_tgid_stats_rd.keys;
+    const struct tgid_stats *st = (const struct tgid_stats *)g_tgid_stats_rd.vals;
+    unsigned long long counts[HIST_BUCKETS];
+    double secs = (double)(iv->end_ns - g_oncpu_last_ns) / 1e9;
+    struct oncpu_prev *p, *tmp;
+    struct tgid_hist h;
+    char id[24], title[96];
+    __u32 rows = 0;
+
+    g_oncpu_last_ns = iv->end_ns;
+    memset(counts, 0, sizeof(counts));
+    read_hist_delta(g_oncpu_hist_fd, g_oncpu_prev_counts, counts);
+    if (g_filter_tgid != 0)
+        print_pid_total("on-cpu", &iv->pid_interval.oncpu, &iv->pid_total.oncpu);
+    print_hist("On-cpu time slice histogram", "oncpu", counts, HIST_BUCKETS);
+
+    if (!g_oncpu_rows || !g_tgid_stats_fresh)
+        return;
+    g_oncpu_gen++;
+    for (__u32 i = 0; i < g_tgid_stats_rd.len; i++) {
+        HASH_FIND(hh, g_oncpu_prev, &tgids[i], sizeof(__u32), p);
+        if (!p) {
+            p = (struct oncpu_prev *)calloc(1, sizeof(*p));
+            if (!p)
+                continue;
+            p->tgid = tgids[i];
+            HASH_ADD(hh, g_oncpu_prev, tgid, sizeof(__u32), p);
+        }
+        // An evicted and recreated entry starts over
+        if (st[i].oncpu.count < p->oncpu.count)
+            memset(&p->oncpu, 0, sizeof(p->oncpu));
+        struct oncpu_row *r = &g_oncpu_rows[rows];
+        time_stat_sub(&r->delta, &st[i].oncpu, &p->oncpu);
+        p->oncpu = st[i].oncpu;
+        p->gen = g_oncpu_gen;
+        if (r->delta.count && (g_filter_tgid == 0 || tgid_filter_key(tgids[i]) == g_filter_tgid)) {
+            r->tgid = tgids[i];
+            r->max_ns = st[i].oncpu.max_ns;
+            rows++;
+        }
+    }
+    HASH_ITER(hh, g_oncpu_prev, p, tmp) {
+        if (p->gen != g_oncpu_gen) {
+            HASH_DEL(g_oncpu_prev, p);
+            free(p);
+        }
+    }
+    qsort(g_oncpu_rows, rows, sizeof(*g_oncpu_rows), cmp_oncpu_rows);
+    if (rows > ONCPU_REPORT_ROWS)
+        rows = ONCPU_REPORT_ROWS;
+    if (secs <= 0)
+        secs = 1;
+
+    // The kernel keeps the longest slice and the histograms since startup
+    printf("On-cpu time by process (MAX since start)\n");
+    printf("  %-8s %8s %12s %12s %14s %14s\n",
+           "TGID", "CPU%", "ONCPU_MS", "SWITCHES/s", "AVG_SLICE_US", "MAX_SLICE_US");
+    for (__u32 i = 0; i < rows; i++) {
+        const struct oncpu_row *r = &g_oncpu_rows[i];
+        printf("  %-8s %8.1f %12.3f %12.1f %14.1f %14.1f\n", tgid_str(r->tgid, id, sizeof(id)),
+               (double)r->delta.total_ns / (secs * 1e9) * 100.0, (double)r->delta.total_ns / 1e6,
+               (double)r->delta.count / secs, (double)r->delta.total_ns / 1e3 / (double)r->delta.count,
+               (double)r->max_ns / 1e3);
+    }
+    for (__u32 i = 0; i < rows && i < ONCPU_REPORT_HISTS; i++) {
+        if (g_oncpu_tgid_hists_fd < 0 ||
+            bpf_map_lookup_elem(g_oncpu_tgid_hists_fd, &g_oncpu_rows[i].tgid, &h) != 0)
+            continue;
+        snprintf(title, sizeof(title), "On-cpu time slice histogram since start, TGID %s",
+                 tgid_str(g_oncpu_rows[i].tgid, id, sizeof(id)));
+        print_log2_hist(title, (const unsigned long long *)h.oncpu.slots, HIST_SLOTS);
+    }
+}
+
+// Scheduling classes (--sched): run-queue and off-CPU time of tasks per
+// scheduling policy and priority (rt_priority, or nice), as the programs
+// read them from the task at switch-out, and how often tasks of each were
+// switched out while runnable for a task of each band. Reported per interval
+// so the effect of a renice or a cpu.weight change shows right away.
+struct sched_prev {
+    struct sched_key key;
+    unsigned long long gen;         // report it was last seen in
+    struct sched_stat st;           // totals at that report
+    UT_hash_handle hh;
+};
+
+struct sched_row {
+    struct sched_key key;
+    struct sched_stat delta;
+};
+
+int g_sched = 0;
+struct map_reader g_sched_stats_rd = { .fd = -1 };
+unsigned long long g_sched_gen = 0;
+struct sched_prev *g_sched_prev = NULL;
+struct sched_row *g_sched_rows = NULL;
+
+// <sched.h> only has these with _GNU_SOURCE, and older C libraries lack
+// SCHED_DEADLINE altogether; the values are the kernel's.
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+// Indexed by policy number, as in the key
+static const char *const sched_policy_names[] = {
+    [SCHED_OTHER] = "OTHER", [SCHED_FIFO] = "FIFO", [SCHED_RR] = "RR",
+    [SCHED_BATCH] = "BATCH", [SCHED_IDLE] = "IDLE", [SCHED_DEADLINE] = "DEADLINE",
+};
+
+static const char *const sched_band_names[SCHED_BANDS] = {
+    "DEADLINE", "RT", "NICE<0", "NICE_0", "NICE>0",
+};
+
+// Deadline first, then realtime by falling priority, then by rising nice
+static int sched_key_rank(const struct sched_key *k) {
+    switch (k->policy) {
+    case SCHED_DEADLINE: return 0;
+    case SCHED_FIFO:
+    case SCHED_RR: return 100 - k->prio;
+    case SCHED_OTHER: return 200 + k->prio;
+    case SCHED_BATCH: return 300 + k->prio;
+    default: return 400 + k->prio;
+    }
+}
+
+static int cmp_sched_rows(const void *a, const void *b) {
+    const struct sched_key *x = &((const struct sched_row *)a)->key;
+    const struct sched_key *y = &((const struct sched_row *)b)->key;
+    int ra = sched_key_rank(x), rb = sched_key_rank(y);
+    if (ra != rb)
+        return ra < rb ? -1 : 1;
+    return x->policy < y->policy ? -1 : (x->policy > y->policy ? 1 : 0);
+}
+
+int sched_report_init(int fd) {
+    if (map_reader_init(&g_sched_stats_rd, fd, sizeof(struct sched_key), sizeof(struct sched_stat)) != 0)
+        return -1;
+    g_sched_rows = (struct sched_row *)calloc(g_sched_stats_rd.cap, sizeof(struct sched_row));
+    return g_sched_rows ? 0 : -1;
+}
+
+void sched_report_free(void) {
+    struct sched_prev *p, *tmp;
+
+    HASH_ITER(hh, g_sched_prev, p, tmp) {
+        HASH_DEL(g_sched_prev, p);
+        free(p);
+    }
+    map_reader_free(&g_sched_stats_rd);
+    free(g_sched_rows);
+    g_sched_rows = NULL;
+}
+
+static void sched_stat_sub(struct sched_stat *out, const struct sched_stat *a, const struct sched_stat *b) {
+    time_stat_sub(&out->runq, &a->runq, &b->runq);
+    time_stat_sub(&out->offcpu, &a->offcpu, &b->offcpu);
+    for (int i = 0; i < HIST_SLOTS; i++)
+        out->runq_hist.slots[i] = a->runq_hist.slots[i] - b->runq_hist.slots[i];
+    for (int i = 0; i < SCHED_BANDS; i++)
+        out->preempted_by[i] = a->preempted_by[i] - b->preempted_by[i];
+}
+
+static const char *sched_key_str(const struct sched_key *k, char *buf, size_t len) {
+    const char *name = k->policy < sizeof(sched_policy_names) / sizeof(sched_policy_names[0]) ?
+                       sched_policy_names[k->policy] : NULL;
+    if (!name)
+        name = "?";
+    if (k->policy == SCHED_DEADLINE)    // no priority
+        snprintf(buf, len, "%s", name);
+    else
+        snprintf(buf, len, "%s %d", name, (int)k->prio);
+    return buf;
+}
+
+void print_sched_report(void) {
+    const struct sched_key *keys = (const struct sched_key *)g_sched_stats_rd.keys;
+    const struct sched_stat *vals = (const struct sched_stat *)g_sched_stats_rd.vals;
+    struct sched_prev *p, *tmp;
+    char name[32];
+    __u32 rows = 0;
+
+    if (!g_sched_rows || map_reader_read(&g_sched_stats_rd) != 0)
+        return;
+    g_sched_gen++;
+    for (__u32 i = 0; i < g_sched_stats_rd.len; i++) {
+        HASH_FIND(hh, g_sched_prev, &keys[i], sizeof(struct sched_key), p);
+        if (!p) {
+            p = (struct sched_prev *)calloc(1, sizeof(*p));
+            if (!p)
+                continue;
+            p->key = keys[i];
+            HASH_ADD(hh, g_sched_prev, key, sizeof(struct sched_key), p);
+        }
+        // Emptied by a control reset
+        if (vals[i].runq.count < p->st.runq.count || vals[i].offcpu.count < p->st.offcpu.count)
+            memset(&p->st, 0, sizeof(p->st));
+        struct sched_row *r = &g_sched_rows[rows];
+        sched_stat_sub(&r->delta, &vals[i], &p->st);
+        p->st = vals[i];
+        p->gen = g_sched_gen;
+        if (r->delta.runq.count || r->delta.offcpu.count) {
+            r->key = keys[i];
+            rows++;
+        }
+    }
+    HASH_ITER(hh, g_sched_prev, p, tmp) {
+        if (p->gen != g_sched_gen) {
+            HASH_DEL(g_sched_prev, p);
+            free(p);
+        }
+    }
+    qsort(g_sched_rows, rows, sizeof(*g_sched_rows), cmp_sched_rows);
+
+    // The kernel keeps the longest wait since startup
+    printf("Run-queue and off-cpu time by scheduling class (MAX since start)\n");
+    printf("  %-12s %12s %10s %10s %10s %10s %12s %10s\n",
+           "CLASS", "RUNQ_MS", "COUNT", "AVG_US", "P99_US", "MAX_MS", "OFFCPU_MS", "COUNT");
+    for (__u32 i = 0; i < rows; i++) {
+        const struct sched_stat *d = &g_sched_rows[i].delta;
+        printf("  %-12s %12.3f %10llu %10.1f %10.1f %10.3f %12.3f %10llu\n",
+               sched_key_str(&g_sched_rows[i].key, name, sizeof(name)),
+               (double)d->runq.total_ns / 1e6, (unsigned long long)d->runq.count,
+               d->runq.count ? (double)d->runq.total_ns / 1e3 / (double)d->runq.count : 0.0,
+               hist_percentile_us((const unsigned long long *)d->runq_hist.slots, HIST_SLOTS, 0.99),
+               (double)d->runq.max_ns / 1e6, (double)d->offcpu.total_ns / 1e6,
+               (unsigned long long)d->offcpu.count);
+    }
+
+    printf("Preemptions by class of the preempting task\n");
+    printf("  %-12s", "CLASS");
+    for (int b = 0; b < SCHED_BANDS; b++)
+        printf(" %10s", sched_band_names[b]);
+    printf("\n");
+    for (__u32 i = 0; i < rows; i++) {
+        const struct sched_stat *d = &g_sched_rows[i].delta;
+        __u64 total = 0;
+        for (int b = 0; b < SCHED_BANDS; b++)
+            total += d->preempted_by[b];
+        if (total == 0)
+            continue;
+        printf("  %-12s", sched_key_str(&g_sched_rows[i].key, name, sizeof(name)));
+        for (int b = 0; b < SCHED_BANDS; b++)
+            printf(" %10llu", (unsigned long long)d->preempted_by[b]);
+        printf("\n");
+    }
+}
+
+// Preemption attribution (--preempt): when a traced thread is switched out
+// still runnable, the programs note which task took its CPU, and charge the
+// run-queue wait that follows to {victim TGID, preemptor TGID and comm}.
+// Ranked by that wait every interval, the noisiest neighbours come first.
+#define PREEMPT_REPORT_ROWS 15
+
+struct preempt_prev {
+    struct preempt_key key;
+    unsigned long long gen;         // report it was last seen in
+    struct time_stat st;            // totals at that report
+    UT_hash_handle hh;
+};
+
+struct preempt_row {
+    struct preempt_key key;
+    struct time_stat delta;
+};
+
+struct map_reader g_preempt_stats_rd = { .fd = -1 };
+unsigned long long g_preempt_gen = 0;
+struct preempt_prev *g_preempt_prev = NULL;
+struct preempt_row *g_preempt_rows = NULL;
+
+int preempt_report_init(int fd) {
+    if (map_reader_init(&g_preempt_stats_rd, fd, sizeof(struct preempt_key), sizeof(struct time_stat)) != 0)
+        return -1;
+    g_preempt_rows = (struct preempt_row *)calloc(g_preempt_stats_rd.cap, sizeof(struct preempt_row));
+    return g_preempt_rows ? 0 : -1;
+}
+
+void preempt_report_free(void) {
+    struct preempt_prev *p, *tmp;
+
+    HASH_ITER(hh, g_preempt_prev, p, tmp) {
+        HASH_DEL(g_preempt_prev, p);
+        free(p);
+    }
+    map_reader_free(&g_preempt_stats_rd);
+    free(g_preempt_rows);
+    g_preempt_rows = NULL;
+}
+
+static int cmp_preempt_rows(const void *a, const void *b) {
+    __u64 ta = ((const struct preempt_row *)a)->delta.total_ns;
+    __u64 tb = ((const struct preempt_row *)b)->delta.total_ns;
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+void print_preempt_report(void) {
+    const struct preempt_key *keys = (const struct preempt_key *)g_preempt_stats_rd.keys;
+    const struct time_stat *vals = (const struct time_stat *)g_preempt_stats_rd.vals;
+    struct preempt_prev *p, *tmp;
+    char victim[24], preemptor[24];
+    __u32 rows = 0;
+
+    if (!g_preempt_rows || map_reader_read(&g_preempt_stats_rd) != 0)
+        return;
+    g_preempt_gen++;
+    for (__u32 i = 0; i < g_preempt_stats_rd.len; i++) {
+        HASH_FIND(hh, g_preempt_prev, &keys[i], sizeof(struct preempt_key), p);
+        if (!p) {
+            p = (struct preempt_prev *)calloc(1, sizeof(*p));
+            if (!p)
+                continue;
+            p->key = keys[i];
+            HASH_ADD(hh, g_preempt_prev, key, sizeof(struct preempt_key), p);
+        }
+        // An evicted and recreated entry starts over
+        if (vals[i].count < p->st.count)
+            memset(&p->st, 0, sizeof(p->st));
+        struct preempt_row *r = &g_preempt_rows[rows];
+        time_stat_sub(&r->delta, &vals[i], &p->st);
+        p->st = vals[i];
+        p->gen = g_preempt_gen;
+        if (r->delta.count && (g_filter_tgid == 0 || tgid_filter_key(keys[i].victim_tgid) == g_filter_tgid)) {
+            r->key = keys[i];
+            rows++;
+        }
+    }
+    HASH_ITER(hh, g_preempt_prev, p, tmp) {
+        if (p->gen != g_preempt_gen) {
+            HASH_DEL(g_preempt_prev, p);
+            free(p);
+        }
+    }
+    qsort(g_preempt_rows, rows, sizeof(*g_preempt_rows), cmp_preempt_rows);
+    if (rows > PREEMPT_REPORT_ROWS)
+        rows = PREEMPT_REPORT_ROWS;
+
+    // The kernel keeps the longest wait since startup. A preemptor TGID of
+    // "-" was never seen switched out, so only its comm is known.
+    printf("Noisy neighbours: run-queue time after preemption (MAX since start)\n");
+    printf("  %-8s %-9s %-16s %12s %12s %10s %10s\n",
+           "VICTIM", "PREEMPTOR", "COMM", "PREEMPTIONS", "WAIT_MS", "AVG_US", "MAX_MS");
+    for (__u32 i = 0; i < rows; i++) {
+        const struct preempt_row *r = &g_preempt_rows[i];
+        if (r->key.preemptor_tgid)
+            tgid_str(r->key.preemptor_tgid, preemptor, sizeof(preemptor));
+        else
+            snprintf(preemptor, sizeof(preemptor), "-");
+        printf("  %-8s %-9s %-16.16s %12llu %12.3f %10.1f %10.3f\n",
+               tgid_str(r->key.victim_tgid, victim, sizeof(victim)), preemptor, r->key.preemptor_comm,
+               (unsigned long long)r->delta.count, (double)r->delta.total_ns / 1e6,
+               (double)r->delta.total_ns / 1e3 / (double)r->delta.count, (double)r->delta.max_ns / 1e6);
+    }
+}
+
+// Flight recorder (--flight-recorder SECS): the programs write every context
+// switch into a ring of g_flight_size records per CPU that is overwritten in
+// place. We map it read-only and only look at it to dump the last SECS
+// seconds, oldest first, to a CSV file: on SIGUSR1, on the control socket's
+// "dump", or when an interval's p99 first exceeds --flight-p99.
+#define DEFAULT_FLIGHT_SIZE 16384
+
+unsigned int g_flight_secs = 0;
+unsigned int g_flight_size = DEFAULT_FLIGHT_SIZE;   // records per CPU, a power of two
+double g_flight_p99_ms = 0;
+int g_flight_over = 0;              // the last interval's p99 was over it
+int g_flight_dump = 0;              // SIGUSR1 arrived
+unsigned int g_flight_dumps = 0;
+int g_flight_head_fd = -1;
+const struct flight_rec *g_flight_recs = NULL;
+size_t g_flight_map_len = 0;
+__u64 *g_flight_heads = NULL;       // g_ncpus values
+
+struct flight_event {
+    struct flight_rec rec;
+    __u32 cpu;
+};
+
+struct flight_event *g_flight_events = NULL;
+
+// Sizes 'flight_recs' before the object is loaded
+int flight_prepare(struct bpf_object *obj) {
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, "flight_recs");
+    int ncpus = libbpf_num_possible_cpus();
+    unsigned int size = 1;
+
+    while (size < g_flight_size)
+        size <<= 1;
+    g_flight_size = size;
+    if (!map || ncpus <= 0 || (unsigned long long)ncpus * size > UINT32_MAX)
+        return -1;
+    return bpf_map__set_max_entries(map, (__u32)ncpus * size);
+}
+
+int flight_init(int recs_fd, int head_fd) {
+    size_t recs = (size_t)g_ncpus * g_flight_size;
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (recs_fd < 0 || head_fd < 0)
+        return -1;
+    g_flight_map_len = (recs * sizeof(struct flight_rec) + page - 1) / page * page;
+    void *p = mmap(NULL, g_flight_map_len, PROT_READ, MAP_SHARED, recs_fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    g_flight_recs = (const struct flight_rec *)p;
+    g_flight_head_fd = head_fd;
+    g_flight_heads = (__u64 *)calloc(g_ncpus, sizeof(__u64));
+    g_flight_events = (struct flight_event *)calloc(recs, sizeof(struct flight_event));
+    return (g_flight_heads && g_flight_events) ? 0 : -1;
+}
+
+void flight_free(void) {
+    if (g_flight_recs)
+        munmap((void *)g_flight_recs, g_flight_map_len);
+    g_flight_recs = NULL;
+    free(g_flight_heads);
+    free(g_flight_events);
+    g_flight_heads = NULL;
+    g_flight_events = NULL;
+}
+
+static int cmp_flight_events(const void *a, const void *b) {
+    __u64 ta = ((const struct flight_event *)a)->rec.ts_ns;
+    __u64 tb = ((const struct flight_event *)b)->rec.ts_ns;
+    return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+// Writes the last g_flight_secs seconds to flight-<date>-<n>.csv, named in
+// path. Records the programs overwrite while we copy them are dropped by
+// the time check, or at worst come out mixed.
+int flight_dump(const char *why, char *path, size_t len) {
+    unsigned long long now = get_monotonic_time_ns();
+    unsigned long long span = (unsigned long long)g_flight_secs * 1000000000ull;
+    unsigned long long since = now > span ? now - span : 0;
+    __u32 mask = g_flight_size - 1, zero = 0;
+    size_t n = 0;
+    char stamp[32];
+    time_t t = time(NULL);
+
+    if (!g_flight_recs || bpf_map_lookup_elem(g_flight_head_fd, &zero, g_flight_heads) != 0)
+        return -1;
+    for (int cpu = 0; cpu < g_ncpus; cpu++) {
+        __u64 head = g_flight_heads[cpu];
+        __u64 first = head > g_flight_size ? head - g_flight_size : 0;
+        for (__u64 k = first; k < head; k++) {
+            struct flight_rec r = g_flight_recs[(size_t)cpu * g_flight_size + (k & mask)];
+            if (r.ts_ns < since || r.ts_ns > now)
+                continue;
+            g_flight_events[n].rec = r;
+            g_flight_events[n].cpu = (__u32)cpu;
+            n++;
+        }
+    }
+    qsort(g_flight_events, n, sizeof(*g_flight_events), cmp_flight_events);
+
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&t));
+    snprintf(path, len, "flight-%s-%u.csv", stamp, ++g_flight_dumps);
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "cpu,ts_ns,prev_tid,prev_tgid,prev_state,next_tid\n");
+    for (size_t i = 0; i < n; i++) {
+        const struct flight_event *e = &g_flight_events[i];
+        fprintf(f, "%u,%llu,%u,%u,%u,%u\n", (unsigned)e->cpu, (unsigned long long)e->rec.ts_ns,
+                (unsigned)e->rec.prev_tid, (unsigned)e->rec.prev_tgid, (unsigned)e->rec.prev_state,
+                (unsigned)e->rec.next_tid);
+    }
+    if (fclose(f) != 0)
+        return -1;
+    fprintf(stderr, "Flight recorder (%s): wrote %zu switches to %s\n", why, n, path);
+    return 0;
+}
+
+// Dumps once when the p99 of an interval's off-CPU or blocked histogram
+// goes over --flight-p99, not again until it has come back under. These are
+// the histograms the interval report prints, so with --pid or a target set
+// only their intervals count.
+void flight_check_p99(const struct interval_snapshot *iv) {
+    char path[64];
+
+    if (!g_flight_recs || g_flight_p99_ms <= 0)
+        return;
+    int over = hist_percentile_us(iv->offcpu, HIST_BUCKETS, 0.99) > g_flight_p99_ms * 1000.0 ||
+               hist_percentile_us(iv->blocked, HIST_BUCKETS, 0.99) > g_flight_p99_ms * 1000.0;
+    if (over && !g_flight_over && flight_dump("p99", path, sizeof(path)) != 0)
+        fprintf(stderr, "WARNING: flight recorder dump failed: %s\n", strerror(errno));
+    g_flight_over = over;
+}
+
+// Event loop: the main loop sleeps in epoll_wait() on the ring buffers, a
+// timerfd armed for the next deadline, a signalfd and the control socket,
+// so it uses no CPU while nothing happens and ticks on an absolute schedule.
+#define DEFAULT_WAKEUP_BYTES (256u << 10)
+#define MAX_WAKEUP_BYTES (8u << 20)     // half of the 16 MB sample ring
+#define LOOP_MAX_EVENTS 16
+
+enum loop_source { LOOP_RING, LOOP_TIMER, LOOP_SIGNAL, LOOP_CONTROL };
+
+int g_epoll_fd = -1;
+int g_timer_fd = -1;
+int g_signal_fd = -1;
+unsigned int g_wakeup_bytes = DEFAULT_WAKEUP_BYTES;
+
+int loop_add(int fd, enum loop_source src) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = src;
+    return epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Control socket (--control PATH): a line protocol on a Unix stream socket
+// that changes settings while the programs stay attached. Each command is
+// answered with one line starting with "ok" or "error":
+//   pid N                     filter on thread group N (0 = everything)
+//   min-offcpu USEC           do not stream shorter off-CPU intervals
+//   interval SEC              reporting interval (not in daemon/heatmap mode)
+//   enable|disable FEATURE    syscalls, blockio, futex, cgroups, sched or preempt,
+//                             if loaded at startup
+//   max-ks|max-emd|max-p99 V  diff thresholds
+//   format text|csv           output format of the histograms
+//   snapshot                  report now instead of at the end of the interval
+//   dump                      write the flight recorder out (--flight-recorder)
+//   reset                     forget everything accumulated so far
+//   show                      print the current settings
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_LINE_MAX 256
+
+struct control_client {
+    int fd;
+    size_t len;
+    char buf[CONTROL_LINE_MAX];
+};
+
+const char *g_control_path = NULL;
+int g_control_fd = -1;
+struct control_client g_control_clients[CONTROL_MAX_CLIENTS];
+int g_ctl_snapshot = 0;             // acted on by the main loop
+int g_ctl_interval_changed = 0;
+
+struct control_feature {
+    const char *name;
+    __u32 flag;
+    int *enabled;
+    struct map_reader *rd;          // set up at startup iff the programs are loaded
+};
+
+static const struct control_feature control_features[] = {
+    { "syscalls", CFG_SYSCALLS, &g_syscalls, &g_syscall_stats_rd },
+    { "blockio",  CFG_BLOCKIO,  &g_blockio,  &g_io_dev_rd },
+    { "futex",    CFG_FUTEX,    &g_futex,    &g_futex_stats_rd },
+    { "cgroups",  CFG_CGROUP_STATS, &g_cgroups, &g_cgroup_stats_rd },
+    { "sched",    CFG_SCHED,    &g_sched,    &g_sched_stats_rd },
+    { "preempt",  CFG_PREEMPT,  &g_preempt,  &g_preempt_stats_rd },
+};
+#define NUM_CONTROL_FEATURES (sizeof(control_features) / sizeof(control_features[0]))
+
+// Becomes g_config only once the kernel has it.
+int write_config(const struct analyzer_config *cfg) {
+    __u32 zero = 0;
+    if (bpf_map_update_elem(g_config_fd, &zero, cfg, BPF_ANY) != 0)
+        return -1;
+    g_config = *cfg;
+    return 0;
+}
+
+// Deletes every entry of a hash map that has a reader and returns how many,
+// which LRU maps book against their eviction accounting.
+__u64 map_reader_clear(struct map_reader *r) {
+    __u64 deleted = 0;
+
+    if (r->fd < 0 || map_reader_read(r) != 0)
+        return 0;
+    for (__u32 i = 0; i < r->len; i++) {
+        if (bpf_map_delete_elem(r->fd, (char *)r->keys + (size_t)i * r->key_sz) == 0)
+            deleted++;
+    }
+    return deleted;
+}
+
+// Empties a map whose values are too large to read in one go. The next key
+// is taken before the current one is deleted, so the walk does not restart.
+__u64 map_clear_fd(int fd) {
+    struct bpf_map_info info = {};
+    __u32 info_len = sizeof(info);
+    char key[64], next[64];
+    __u64 deleted = 0;
+
+    if (fd < 0 || bpf_obj_get_info_by_fd(fd, &info, &info_len) != 0 || info.key_size > sizeof(key))
+        return 0;
+    int have = bpf_map_get_next_key(fd, NULL, key) == 0;
+    while (have && deleted < info.max_entries) {
+        have = bpf_map_get_next_key(fd, key, next) == 0;
+        if (bpf_map_delete_elem(fd, key) == 0)
+            deleted++;
+        memcpy(key, next, info.key_size);
+    }
+    return deleted;
+}
+
+// Histograms restart empty; the kernel's cumulative maps, everything a
+// report reads from, are emptied, which pinned clients see as well. 'topk'
+// is left alone: it only ever holds the current interval.
+void control_reset(void) {
+    memset(g_capture.offcpu, 0, sizeof(g_capture.offcpu));
+    memset(g_capture.blocked, 0, sizeof(g_capture.blocked));
+    g_capture.intervals = 0;
+    g_ring_head = g_ring_len = 0;
+
+    g_lru_maps[LRU_TGID_STATS].deleted += map_reader_clear(&g_tgid_stats_rd);
+    g_lru_maps[LRU_SYSCALL_STATS].deleted += map_reader_clear(&g_syscall_stats_rd);
+    g_lru_maps[LRU_FUTEX_STATS].deleted += map_reader_clear(&g_futex_stats_rd);
+    g_lru_maps[LRU_CGROUP_STATS].deleted += map_reader_clear(&g_cgroup_stats_rd);
+    memset(&g_cgroup_gone, 0, sizeof(g_cgroup_gone));
+    g_lru_maps[LRU_PREEMPT_STATS].deleted += map_reader_clear(&g_preempt_stats_rd);
+    map_reader_clear(&g_io_dev_rd);
+    if (g_sched_stats_rd.fd >= 0 && map_reader_read(&g_sched_stats_rd) == 0) {
+        for (__u32 i = 0; i < g_sched_stats_rd.len; i++)
+            bpf_map_delete_elem(g_sched_stats_rd.fd, (struct sched_key *)g_sched_stats_rd.keys + i);
+    }
+    if (g_dstate_percpu) {
+        memset(g_dstate_percpu, 0, g_ncpus * sizeof(*g_dstate_percpu));
+        for (__u32 cls = 0; cls < DSTATE_CLASSES; cls++)
+            bpf_map_update_elem(g_dstate_hist_fd, &cls, g_dstate_percpu, BPF_ANY);
+    }
+    if (g_io_counters_fd >= 0) {
+        memset(g_io_counters_percpu, 0, g_ncpus * sizeof(*g_io_counters_percpu));
+        for (__u32 c = 0; c < IO_COUNTERS; c++)
+            bpf_map_update_elem(g_io_counters_fd, &c, g_io_counters_percpu, BPF_ANY);
+    }
+    if (g_target_stats_fd >= 0) {
+        struct group_stat zero;
+        memset(&zero, 0, sizeof(zero));
+        for (__u32 i = 0; i < (__u32)g_num_targets; i++)
+            bpf_map_update_elem(g_target_stats_fd, &i, &zero, BPF_ANY);
+    }
+    // --threads and --top read 'tid_stats', --oncpu and --top 'tgid_hists'
+    g_lru_maps[LRU_TID_STATS].deleted += map_clear_fd(g_lru_maps[LRU_TID_STATS].fd);
+    g_lru_maps[LRU_TID_HISTS].deleted += map_clear_fd(g_lru_maps[LRU_TID_HISTS].fd);
+    g_lru_maps[LRU_THREAD_EXITS].deleted += map_reader_clear(&g_thread_exits_rd);
+    thread_prev_free();
+    g_lru_maps[LRU_TGID_HISTS].deleted += map_clear_fd(g_lru_maps[LRU_TGID_HISTS].fd);
+    if (g_oncpu_hist_fd >= 0 && g_hist_percpu) {
+        memset(g_hist_percpu, 0, g_ncpus * sizeof(*g_hist_percpu));
+        for (__u32 b = 0; b < HIST_BUCKETS; b++)
+            bpf_map_update_elem(g_oncpu_hist_fd, &b, g_hist_percpu, BPF_ANY);
+        memset(g_oncpu_prev_counts, 0, sizeof(g_oncpu_prev_counts));
+    }
+    if (g_flame_rd.fd >= 0) {
+        map_reader_clear(&g_flame_rd);
+        map_clear_fd(g_flame_stacks_fd);
+        memset(g_flame_counters_percpu, 0, g_ncpus * sizeof(*g_flame_counters_percpu));
+        for (__u32 c = 0; c < FLAME_COUNTERS; c++)
+            bpf_map_update_elem(g_flame_counters_fd, &c, g_flame_counters_percpu, BPF_ANY);
+    }
+    memset(&g_pid_stats_prev, 0, sizeof(g_pid_stats_prev));
+}
+
+void control_set_pid(__u32 pid) {
+    __atomic_store_n(&g_filter_tgid, pid, __ATOMIC_RELAXED);
+    g_capture.pid = pid;
+    memset(&g_pid_stats_prev, 0, sizeof(g_pid_stats_prev));
+    if (g_pidns)
+        pidns_refresh();
+    __u32 host = pid != 0 ? pidns_host_tgid(pid) : 0;
+    if (host != 0 && map_reader_read(&g_tgid_stats_rd) == 0) {
+        const struct tgid_stats *st = find_tgid_stats(host);
+        if (st)
+            g_pid_stats_prev = *st;
+    }
+}
+
+void control_command(char *line, char *reply, size_t len) {
+    char *cmd = strtok(line, " \t\r");
+    char *arg = strtok(NULL, " \t\r");
+    char *end = NULL;
+
+    if (!cmd) {
+        snprintf(reply, len, "error empty command");
+        return;
+    }
+    if (strcmp(cmd, "pid") == 0 && arg) {
+        long pid = strtol(arg, &end, 10);
+        if (*end != '\0' || pid < 0) {
+            snprintf(reply, len, "error invalid pid '%s'", arg);
+            return;
+        }
+        struct analyzer_config cfg = g_config;
+        cfg.filter_tgid = (__u32)pid;
+        if (write_config(&cfg) != 0) {
+            snprintf(reply, len, "error failed to write config: %s", strerror(errno));
+            return;
+        }
+        control_set_pid((__u32)pid);
+        snprintf(reply, len, "ok pid %ld", pid);
+    } else if (strcmp(cmd, "min-offcpu") == 0 && arg) {
+        unsigned long long us;
+        if (parse_ull(arg, ULLONG_MAX / 1000ull, &us) != 0) {
+            snprintf(reply, len, "error invalid duration '%s'", arg);
+            return;
+        }
+        struct analyzer_config cfg = g_config;
+        cfg.min_offcpu_ns = us * 1000ull;
+        if (write_config(&cfg) != 0) {
+            snprintf(reply, len, "error failed to write config: %s", strerror(errno));
+            return;
+        }
+        snprintf(reply, len, "ok min-offcpu %llu us", us);
+    } else if (strcmp(cmd, "interval") == 0 && arg) {
+        long secs = strtol(arg, &end, 10);
+        if (*end != '\0' || secs <= 0) {
+            snprintf(reply, len, "error invalid interval '%s'", arg);
+            return;
+        }
+        // The window ring and the heatmap are sized from the interval.
+        if (g_daemon || g_heatmap) {
+            snprintf(reply, len, "error the interval is fixed in daemon and heatmap mode");
+            return;
+        }
+        g_interval_sec = (int)secs;
+        g_capture.interval_sec = (unsigned int)secs;
+        g_ctl_interval_changed = 1;
+        snprintf(reply, len, "ok interval %ld s", secs);
+    } else if ((strcmp(cmd, "enable") == 0 || strcmp(cmd, "disable") == 0) && arg) {
+        int on = cmd[0] == 'e';
+        for (size_t i = 0; i < NUM_CONTROL_FEATURES; i++) {
+            const struct control_feature *f = &control_features[i];
+            if (strcmp(arg, f->name) != 0)
+                continue;
+            if (f->rd->fd < 0) {
+                snprintf(reply, len, "error %s was not loaded; restart with --%s", f->name, f->name);
+                return;
+            }
+            struct analyzer_config cfg = g_config;
+            if (on)
+                cfg.flags |= f->flag;
+            else
+                cfg.flags &= ~f->flag;
+            if (write_config(&cfg) != 0) {
+                snprintf(reply, len, "error failed to write config: %s", strerror(errno));
+                return;
+            }
+            *f->enabled = on;
+            snprintf(reply, len, "ok %s %s", f->name, on ? "enabled" : "disabled");
+            return;
+        }
+        snprintf(reply, len, "error unknown feature '%s'", arg);
+    } else if ((strcmp(cmd, "max-ks") == 0 || strcmp(cmd, "max-emd") == 0 ||
+                strcmp(cmd, "max-p99") == 0) && arg) {
+        double v = 0.0;
+        if (parse_threshold(arg, &v) != 0 || (strcmp(cmd, "max-ks") == 0 && v > 1.0)) {
+            snprintf(reply, len, "error invalid threshold '%s'", arg);
+            return;
+        }
+        if (strcmp(cmd, "max-ks") == 0)
+            g_max_ks = v;
+        else if (strcmp(cmd, "max-emd") == 0)
+            g_max_emd = v;
+        else
+            g_max_p99_pct = v;
+        snprintf(reply, len, "ok %s %g", cmd, v);
+    } else if (strcmp(cmd, "format") == 0 && arg) {
+        if (strcmp(arg, "csv") == 0) {
+            if (!g_csv)
+                g_csv_header = 0;
+            g_csv = 1;
+        } else if (strcmp(arg, "text") == 0) {
+            g_csv = 0;
+        } else {
+            snprintf(reply, len, "error unknown format '%s'", arg);
+            return;
+        }
+        snprintf(reply, len, "ok format %s", arg);
+    } else if (strcmp(cmd, "snapshot") == 0) {
+        g_ctl_snapshot = 1;
+        snprintf(reply, len, "ok snapshot");
+    } else if (strcmp(cmd, "dump") == 0) {
+        char path[64];
+        if (!g_flight_recs)
+            snprintf(reply, len, "error no --flight-recorder");
+        else if (flight_dump("control", path, sizeof(path)) != 0)
+            snprintf(reply, len, "error dump failed: %s", strerror(errno));
+        else
+            snprintf(reply, len, "ok dump %s", path);
+    } else if (strcmp(cmd, "reset") == 0) {
+        control_reset();
+        snprintf(reply, len, "ok reset");
+    } else if (strcmp(cmd, "show") == 0) {
+        int n = snprintf(reply, len, "ok pid %u min-offcpu %llu us interval %d s format %s wakeup-batch %u",
+                         (unsigned)g_config.filter_tgid,
+                         (unsigned long long)g_config.min_offcpu_ns / 1000ull,
+                         g_interval_sec, g_csv ? "csv" : "text", (unsigned)g_config.wakeup_bytes);
+        for (size_t i = 0; i < NUM_CONTROL_FEATURES && n > 0 && (size_t)n < len; i++) {
+            const struct control_feature *f = &control_features[i];
+            n += snprintf(reply + n, len - n, " %s %s", f->name,
+                          f->rd->fd < 0 ? "n/a" : (*f->enabled ? "on" : "off"));
+        }
+    } else {
+        snprintf(reply, len, "error unknown command '%s'", cmd);
+    }
+}
+
+// A socket that refuses connections was left behind by a dead daemon and
+// is replaced; a live one is not.
+int control_open(const char *path) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "ERROR: control socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        g_control_clients[i].fd = -1;
+
+    g_control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_control_fd < 0)
+        return -1;
+    if (bind(g_control_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        if (errno != EADDRINUSE)
+            return -1;
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live) {
+            fprintf(stderr, "ERROR: '%s' is in use by another instance\n", path);
+            return -1;
+        }
+        unlink(path);
+        if (bind(g_control_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+            return -1;
+    }
+    if (chmod(path, 0600) != 0 || listen(g_control_fd, CONTROL_MAX_CLIENTS) != 0)
+        return -1;
+    g_control_path = path;
+    return 0;
+}
+
+void control_drop(struct control_client *cl) {
+    close(cl->fd);
+    cl->fd = -1;
+    cl->len = 0;
+}
+
+// Accepts new connections and answers every complete line. Never blocks.
+void control_poll(void) {
+    char reply[512];
+
+    if (g_control_fd < 0)
+        return;
+    for (;;) {
+        int fd = accept(g_control_fd, NULL, NULL);
+        if (fd < 0)
+            break;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        int slot = -1;
+        for (int i = 0; i < CONTROL_MAX_CLIENTS && slot < 0; i++) {
+            if (g_control_clients[i].fd < 0)
+                slot = i;
+        }
+        if (slot < 0) {
+            static const char busy[] = "error too many connections\n";
+            send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+        g_control_clients[slot].fd = fd;
+        g_control_clients[slot].len = 0;
+        if (g_epoll_fd >= 0)
+            loop_add(fd, LOOP_CONTROL);
+    }
+
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        struct control_client *cl = &g_control_clients[i];
+        if (cl->fd < 0)
+            continue;
+        ssize_t n = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            control_drop(cl);
+            continue;
+        }
+        if (n < 0)
+            continue;
+        cl->len += (size_t)n;
+        cl->buf[cl->len] = '\0';
+
+        char *line = cl->buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            control_command(line, reply, sizeof(reply) - 1);
+            strcat(reply, "\n");
+            send(cl->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+            line = nl + 1;
+        }
+        cl->len -= (size_t)(line - cl->buf);
+        memmove(cl->buf, line, cl->len);
+        if (cl->len == sizeof(cl->buf) - 1) {
+            static const char toolong[] = "error line too long\n";
+            send(cl->fd, toolong, sizeof(toolong) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            control_drop(cl);
+        }
+    }
+}
+
+void control_close(void) {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS && g_control_fd >= 0; i++) {
+        if (g_control_clients[i].fd >= 0)
+            control_drop(&g_control_clients[i]);
+    }
+    if (g_control_fd >= 0)
+        close(g_control_fd);
+    g_control_fd = -1;
+    if (g_control_path)
+        unlink(g_control_path);
+    g_control_path = NULL;
+}
+
+// Longest intervals (--outliers N): the programs keep each CPU's longest
+// off-CPU, blocked and run-queue intervals in 'topk'. Every interval they are
+// switched to the other half of the map, and the half they filled is merged
+// into a global top N, printed and emptied.
+unsigned int g_outliers = 0;
+int g_topk_fd = -1;
+struct topk_list *g_topk_percpu = NULL;     // g_ncpus values of one key
+struct topk_entry *g_topk_merged = NULL;    // every CPU's entries of one kind
+
+int outliers_init(int fd) {
+    g_topk_fd = fd;
+    g_topk_percpu = (struct topk_list *)calloc(g_ncpus, sizeof(struct topk_list));
+    g_topk_merged = (struct topk_entry *)calloc((size_t)g_ncpus * TOPK_ENTRIES, sizeof(struct topk_entry));
+    return (fd >= 0 && g_topk_percpu && g_topk_merged) ? 0 : -1;
+}
+
+void outliers_free(void) {
+    free(g_topk_percpu);
+    free(g_topk_merged);
+    g_topk_percpu = NULL;
+    g_topk_merged = NULL;
+}
+
+static int cmp_topk_entries(const void *a, const void *b) {
+    const struct topk_entry *x = (const struct topk_entry *)a, *y = (const struct topk_entry *)b;
+    return (x->delta_ns < y->delta_ns) - (x->delta_ns > y->delta_ns);
+}
+
+// ps-style letter of a prev_state; a preempted task is still runnable
+static char task_state_char(__u32 state) {
+    static const char letters[] = "SDTtXZPI";
+
+    if (state == 0 || (state & 0x100))
+        return 'R';
+    for (int i = 0; i < 8; i++) {
+        if (state & (1u << i))
+            return letters[i];
+    }
+    return '?';
+}
+
+void print_outliers(void) {
+    static const char *const titles[TOPK_KINDS] = {
+        [TOPK_OFFCPU] = "Longest off-cpu intervals",
+        [TOPK_BLOCKED] = "Longest blocked intervals",
+        [TOPK_RUNQ] = "Longest run-queue waits",
+    };
+    struct analyzer_config cfg = g_config;
+    __u32 slot = cfg.topk_slot & 1;
+    char id[24];
+
+    cfg.topk_slot = slot ^ 1;
+    if (g_topk_fd < 0 || write_config(&cfg) != 0)
+        return;
+    for (__u32 kind = 0; kind < TOPK_KINDS; kind++) {
+        __u32 key = kind * 2 + slot;
+        size_t n = 0;
+
+        if (bpf_map_lookup_elem(g_topk_fd, &key, g_topk_percpu) != 0)
+            continue;
+        for (int cpu = 0; cpu < g_ncpus; cpu++) {
+            const struct topk_list *l = &g_topk_percpu[cpu];
+            for (__u32 i = 0; i < l->len && i < TOPK_ENTRIES; i++)
+                g_topk_merged[n++] = l->e[i];
+        }
+        memset(g_topk_percpu, 0, g_ncpus * sizeof(*g_topk_percpu));
+        bpf_map_update_elem(g_topk_fd, &key, g_topk_percpu, BPF_ANY);
+        qsort(g_topk_merged, n, sizeof(*g_topk_merged), cmp_topk_entries);
+        if (n > g_outliers)
+            n = g_outliers;
+
+        printf("%s\n", titles[kind]);
+        printf("  %-8s %-8s %-16s %16s %12s %s\n", "TID", "TGID", "COMM", "START_S", "MS", "STATE");
+        for (size_t i = 0; i < n; i++) {
+            const struct topk_entry *e = &g_topk_merged[i];
+            printf("  %-8u %-8s %-16.16s %16.6f %12.3f %c\n", (unsigned)e->tid,
+                   tgid_str(e->tgid, id, sizeof(id)), e->comm, (double)e->start_ns / 1e9,
+                   (double)e->delta_ns / 1e6, task_state_char(e->state));
+        }
+    }
+}
+
+// From here on SIGINT, SIGTERM and, with --flight-recorder, SIGUSR1 arrive
+// through the signalfd.
+int loop_open(void) {
+    sigset_t sigs;
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    if (g_flight_secs)
+        sigaddset(&sigs, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &sigs, NULL) != 0)
+        return -1;
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    g_signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (g_epoll_fd < 0 || g_timer_fd < 0 || g_signal_fd < 0)
+        return -1;
+    if (loop_add(g_timer_fd, LOOP_TIMER) != 0 || loop_add(g_signal_fd, LOOP_SIGNAL) != 0)
+        return -1;
+    if (g_control_fd >= 0 && loop_add(g_control_fd, LOOP_CONTROL) != 0)
+        return -1;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if (g_control_clients[i].fd >= 0 && loop_add(g_control_clients[i].fd, LOOP_CONTROL) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void loop_close(void) {
+    if (g_signal_fd >= 0)
+        close(g_signal_fd);
+    if (g_timer_fd >= 0)
+        close(g_timer_fd);
+    if (g_epoll_fd >= 0)
+        close(g_epoll_fd);
+    g_signal_fd = g_timer_fd = g_epoll_fd = -1;
+}
+
+// Arms the timer for an absolute CLOCK_MONOTONIC deadline.
+int loop_arm(unsigned long long deadline_ns) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (deadline_ns == 0)
+        deadline_ns = 1;    // zero would disarm it
+    its.it_value.tv_sec = (time_t)(deadline_ns / 1000000000ull);
+    its.it_value.tv_nsec = (long)(deadline_ns % 1000000000ull);
+    return timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Sleeps until something happens and handles it. Ring buffer records are
+// consumed in whole batches; the caller acts on the deadline.
+int loop_wait(void) {
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    int n = epoll_wait(g_epoll_fd, events, LOOP_MAX_EVENTS, -1);
+    if (n < 0)
+        return errno == EINTR ? 0 : -errno;
+    for (int i = 0; i < n; i++) {
+        switch (events[i].data.u32) {
+        case LOOP_RING: {
+            int ret = ring_buffer__consume(g_rb);
+            if (ret < 0)
+                return ret;
+            break;
+        }
+        case LOOP_TIMER: {
+            __u64 expirations;
+            if (read(g_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return -errno;
+            break;
+        }
+        case LOOP_SIGNAL: {
+            struct signalfd_siginfo si;
+            while (read(g_signal_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                if (si.ssi_signo == SIGUSR1)
+                    g_flight_dump = 1;
+                else
+                    g_exiting = 1;
+            }
+            break;
+        }
+        case LOOP_CONTROL:
+            control_poll();
+            break;
+        }
+    }
+    return 0;
+}
+
+// Top mode (--top): a full-screen view of off-CPU, blocked and run-queue
+// time per process, refreshed from the in-kernel aggregates several times a
+// second. Only the screen lines that changed since the last frame are
+// rewritten, and nothing is streamed through the ring buffer.
+#define TOP_SPARK_LEN 20
+#define TOP_HALF_LIFE_SEC 5.0       // of the decayed histograms behind p99
+#define TOP_LINE_MAX 1024
+#define DEFAULT_TOP_REFRESH_MS 250
+
+enum top_sort { TOP_SORT_OFFCPU, TOP_SORT_BLOCKED, TOP_SORT_RUNQ, TOP_SORTS };
+
+static const char *const top_sort_names[TOP_SORTS] = { "off-cpu", "blocked", "run-queue" };
+
+struct top_row {
+    __u32 id;                       // key: TGID, or TID in g_top_threads
+    unsigned long long gen;         // refresh that last saw it
+    struct time_stat prev[TOP_SORTS];
+    double rate[TOP_SORTS];         // ms per second over the last refresh
+    float history[TOP_SORTS][TOP_SPARK_LEN];
+    struct log2_hist prev_hist[2];  // processes only: off-CPU, blocked
+    double decayed[2][HIST_SLOTS];
+    char comm[16];
+    UT_hash_handle hh;
+};
+
+unsigned int g_top_refresh_ms = DEFAULT_TOP_REFRESH_MS;
+struct map_reader g_tid_stats_rd = { .fd = -1 };
+struct map_reader g_tgid_hist_rd = { .fd = -1 };
+struct top_row *g_top_procs = NULL;
+struct top_row *g_top_threads = NULL;
+struct top_row **g_top_order = NULL;    // rows as drawn, grown as needed
+size_t g_top_order_cap = 0;
+size_t g_top_order_len = 0;
+unsigned long long g_top_gen = 0;
+unsigned int g_top_spark_head = 0;
+enum top_sort g_top_sort = TOP_SORT_OFFCPU;
+__u32 g_top_selected = 0;               // TGID under the cursor
+__u32 g_top_expanded = 0;               // TGID whose threads are shown
+int g_top_baseline_threads = 0;         // next refresh only records thread totals
+int g_top_esc = 0;                      // bytes of an ESC [ sequence read so far
+char (*g_top_frame)[TOP_LINE_MAX] = NULL;   // what each screen line shows now
+int g_top_rows = 0;
+int g_top_cols = 0;
+struct termios g_top_saved_tty;
+
+int top_init(int tid_fd, int hist_fd) {
+    if (map_reader_init(&g_tid_stats_rd, tid_fd, sizeof(__u32), sizeof(struct tid_stats)) != 0 ||
+        map_reader_init(&g_tgid_hist_rd, hist_fd, sizeof(__u32), sizeof(struct tgid_hist)) != 0)
+        return -1;
+    return 0;
+}
+
+void top_free_rows(struct top_row **table) {
+    struct top_row *row, *tmp;
+    HASH_ITER(hh, *table, row, tmp) {
+        HASH_DEL(*table, row);
+        free(row);
+    }
+}
+
+void top_free(void) {
+    top_free_rows(&g_top_procs);
+    top_free_rows(&g_top_threads);
+    map_reader_free(&g_tid_stats_rd);
+    map_reader_free(&g_tgid_hist_rd);
+    free(g_top_order);
+    free(g_top_frame);
+    g_top_order = NULL;
+    g_top_frame = NULL;
+}
+
+struct top_row *top_row_get(struct top_row **table, __u32 id, __u32 tgid) {
+    struct top_row *row;
+    char path[64];
+
+    HASH_FIND(hh, *table, &id, sizeof(__u32), row);
+    if (row)
+        return row;
+    row = (struct top_row *)calloc(1, sizeof(*row));
+    if (!row)
+        return NULL;
+    row->id = id;
+    if (id == tgid)
+        snprintf(path, sizeof(path), "/proc/%u/comm", (unsigned)proc_tgid(id));
+    else
+        snprintf(path, sizeof(path), "/proc/%u/task/%u/comm", (unsigned)proc_tgid(tgid), (unsigned)id);
+    FILE *f = fopen(path, "r");
+    if (!f || !fgets(row->comm, sizeof(row->comm), f))
+        snprintf(row->comm, sizeof(row->comm), "?");
+    row->comm[strcspn(row->comm, "\n")] = '\0';
+    if (f)
+        fclose(f);
+    HASH_ADD(hh, *table, id, sizeof(__u32), row);
+    return row;
+}
+
+void top_row_update(struct top_row *row, const struct time_stat *cur, double dt_sec, int baseline) {
+    for (int s = 0; s < TOP_SORTS; s++) {
+        __u64 delta = cur[s].total_ns >= row->prev[s].total_ns ? cur[s].total_ns - row->prev[s].total_ns : 0;
+        row->rate[s] = baseline || dt_sec <= 0.0 ? 0.0 : (double)delta / 1e6 / dt_sec;
+        row->history[s][g_top_spark_head] = (float)row->rate[s];
+        row->prev[s] = cur[s];
+    }
+    row->gen = g_top_gen;
+}
+
+void top_drop_stale(struct top_row **table) {
+    struct top_row *row, *tmp;
+    HASH_ITER(hh, *table, row, tmp) {
+        if (row->gen != g_top_gen) {
+            HASH_DEL(*table, row);
+            free(row);
+        }
+    }
+}
+
+void top_refresh(double dt_sec) {
+    double alpha = pow(0.5, dt_sec / TOP_HALF_LIFE_SEC);
+    int baseline = g_top_gen == 0;
+
+    g_top_gen++;
+    if (map_reader_read(&g_tgid_stats_rd) == 0) {
+        const __u32 *keys = (const __u32 *)g_tgid_stats_rd.keys;
+        const struct tgid_stats *vals = (const struct tgid_stats *)g_tgid_stats_rd.vals;
+        for (__u32 i = 0; i < g_tgid_stats_rd.len; i++) {
+            if (g_filter_tgid != 0 && tgid_filter_key(keys[i]) != g_filter_tgid)
+                continue;
+            struct top_row *row = top_row_get(&g_top_procs, keys[i], keys[i]);
+            struct time_stat cur[TOP_SORTS] = { vals[i].offcpu, vals[i].blocked, vals[i].runq };
+            if (row)
+                top_row_update(row, cur, dt_sec, baseline);
+        }
+    }
+    if (map_reader_read(&g_tgid_hist_rd) == 0) {
+        const __u32 *keys = (const __u32 *)g_tgid_hist_rd.keys;
+        const struct tgid_hist *vals = (const struct tgid_hist *)g_tgid_hist_rd.vals;
+        for (__u32 i = 0; i < g_tgid_hist_rd.len; i++) {
+            struct top_row *row;
+            HASH_FIND(hh, g_top_procs, &keys[i], sizeof(__u32), row);
+            if (!row)
+                continue;
+            const struct log2_hist *cur[2] = { &vals[i].offcpu, &vals[i].blocked };
+            for (int h = 0; h < 2; h++) {
+                // An evicted or reset entry starts over
+                for (size_t b = 0; b < HIST_SLOTS; b++) {
+                    if (cur[h]->slots[b] < row->prev_hist[h].slots[b]) {
+                        memset(&row->prev_hist[h], 0, sizeof(row->prev_hist[h]));
+                        break;
+                    }
+                }
+                for (size_t b = 0; b < HIST_SLOTS; b++) {
+                    __u64 delta = cur[h]->slots[b] - row->prev_hist[h].slots[b];
+                    row->decayed[h][b] = row->decayed[h][b] * alpha + (double)delta;
+                }
+                row->prev_hist[h] = *cur[h];
+            }
+        }
+    }
+    if (g_top_expanded != 0 && map_reader_read(&g_tid_stats_rd) == 0) {
+        const __u32 *keys = (const __u32 *)g_tid_stats_rd.keys;
+        const struct tid_stats *vals = (const struct tid_stats *)g_tid_stats_rd.vals;
+        for (__u32 i = 0; i < g_tid_stats_rd.len; i++) {
+            if (vals[i].tgid != g_top_expanded)
+                continue;
+            struct top_row *row = top_row_get(&g_top_threads, keys[i], vals[i].tgid);
+            struct time_stat cur[TOP_SORTS] = { vals[i].offcpu, vals[i].blocked, vals[i].runq };
+            if (row)
+                top_row_update(row, cur, dt_sec, baseline || g_top_baseline_threads);
+        }
+        g_top_baseline_threads = 0;
+    }
+    top_drop_stale(&g_top_procs);
+    top_drop_stale(&g_top_threads);
+    g_top_spark_head = (g_top_spark_head + 1) % TOP_SPARK_LEN;
+}
+
+static int cmp_top_rows(const void *a, const void *b) {
+    double ra = (*(struct top_row *const *)a)->rate[g_top_sort];
+    double rb = (*(struct top_row *const *)b)->rate[g_top_sort];
+    return ra < rb ? 1 : (ra > rb ? -1 : 0);
+}
+
+static int top_order_reserve(size_t n) {
+    if (n <= g_top_order_cap)
+        return 0;
+    size_t cap = g_top_order_cap ? g_top_order_cap : 256;
+    while (cap < n)
+        cap *= 2;
+    struct top_row **order = (struct top_row **)realloc(g_top_order, cap * sizeof(*order));
+    if (!order)
+        return -1;
+    g_top_order = order;
+    g_top_order_cap = cap;
+    return 0;
+}
+
+// Processes sorted by the current key, the expanded one followed by its
+// threads in the same order.
+void top_build_order(void) {
+    size_t nprocs = HASH_COUNT(g_top_procs), nthreads = HASH_COUNT(g_top_threads);
+    struct top_row *row, *tmp;
+
+    g_top_order_len = 0;
+    if (top_order_reserve(nprocs + 2 * nthreads) != 0)
+        return;
+    HASH_ITER(hh, g_top_procs, row, tmp)
+        g_top_order[g_top_order_len++] = row;
+    qsort(g_top_order, g_top_order_len, sizeof(*g_top_order), cmp_top_rows);
+
+    // Threads are sorted in the spare room at the end, then moved in place
+    struct top_row **threads = g_top_order + nprocs + nthreads;
+    size_t n = 0;
+    HASH_ITER(hh, g_top_threads, row, tmp)
+        threads[n++] = row;
+    qsort(threads, n, sizeof(*threads), cmp_top_rows);
+    for (size_t i = 0; i < g_top_order_len && n > 0; i++) {
+        if (g_top_order[i]->id != g_top_expanded)
+            continue;
+        memmove(&g_top_order[i + 1 + n], &g_top_order[i + 1], (g_top_order_len - i - 1) * sizeof(*g_top_order));
+        memcpy(&g_top_order[i + 1], threads, n * sizeof(*threads));
+        g_top_order_len += n;
+        break;
+    }
+}
+
+static int top_is_thread(const struct top_row *row) {
+    struct top_row *p;
+    HASH_FIND(hh, g_top_procs, &row->id, sizeof(__u32), p);
+    return p != row;
+}
+
+const char *format_p99(const double *decayed, char *buf, size_t len) {
+    unsigned long long counts[HIST_SLOTS];
+    for (size_t b = 0; b < HIST_SLOTS; b++)
+        counts[b] = (unsigned long long)(decayed[b] * 1000.0 + 0.5);
+    if (hist_total(counts, HIST_SLOTS) == 0) {
+        snprintf(buf, len, "-");
+        return buf;
+    }
+    double us = hist_percentile_us(counts, HIST_SLOTS, 0.99);
+    if (us < 1000.0)
+        snprintf(buf, len, "%.0fus", us);
+    else if (us < 1000000.0)
+        snprintf(buf, len, "%.1fms", us / 1e3);
+    else
+        snprintf(buf, len, "%.1fs", us / 1e6);
+    return buf;
+}
+
+static void top_sparkline(const struct top_row *row, char *out, size_t len) {
+    static const char *const blocks[] = { " ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+    float max = 0.0f;
+    size_t pos = 0;
+
+    for (int i = 0; i < TOP_SPARK_LEN; i++) {
+        if (row->history[g_top_sort][i] > max)
+            max = row->history[g_top_sort][i];
+    }
+    out[0] = '\0';
+    for (int i = 1; i <= TOP_SPARK_LEN; i++) {
+        // Oldest first; the slot at the head is the next one to be written
+        float v = row->history[g_top_sort][(g_top_spark_head + i - 1) % TOP_SPARK_LEN];
+        int level = max > 0.0f ? (int)(v / max * 8.0f + 0.5f) : 0;
+        pos += snprintf(out + pos, len - pos, "%s", blocks[level]);
+        if (pos >= len)
+            break;
+    }
+}
+
+void top_put_line(int line, const char *text) {
+    if (line >= g_top_rows || strcmp(g_top_frame[line], text) == 0)
+        return;
+    printf("\033[%d;1H%s\033[K", line + 1, text);
+    snprintf(g_top_frame[line], TOP_LINE_MAX, "%s", text);
+}
+
+void top_draw(void) {
+    struct winsize ws;
+    char line[TOP_LINE_MAX - 16], p99[2][16], id[24], spark[TOP_SPARK_LEN * 4 + 1];
+    const int header = 3;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != 0 || ws.ws_row == 0) {
+        ws.ws_row = 24;
+        ws.ws_col = 80;
+    }
+    int cols = ws.ws_col < TOP_LINE_MAX / 2 ? ws.ws_col : TOP_LINE_MAX / 2;
+    if (ws.ws_row != g_top_rows || cols != g_top_cols || !g_top_frame) {
+        free(g_top_frame);
+        g_top_frame = calloc(ws.ws_row, sizeof(*g_top_frame));
+        if (!g_top_frame)
+            return;
+        g_top_rows = ws.ws_row;
+        g_top_cols = cols;
+        printf("\033[2J");
+    }
+
+    top_build_order();
+    size_t sel = 0;
+    for (size_t i = 0; i < g_top_order_len; i++) {
+        if (g_top_order[i]->id == g_top_selected && !top_is_thread(g_top_order[i]))
+            sel = i;
+    }
+    if (g_top_order_len > 0)
+        g_top_selected = g_top_order[sel]->id;
+    size_t avail = g_top_rows > header ? (size_t)(g_top_rows - header) : 0;
+    size_t first = (avail > 0 && sel >= avail) ? sel - avail + 1 : 0;
+
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    snprintf(line, sizeof(line), "cpu_analyzer top  %02d:%02d:%02d  refresh %u ms  %u processes  sort: %s",
+             tm.tm_hour, tm.tm_min, tm.tm_sec, g_top_refresh_ms, HASH_COUNT(g_top_procs),
+             top_sort_names[g_top_sort]);
+    line[cols] = '\0';
+    top_put_line(0, line);
+    if (g_lru_warning[0])
+        snprintf(line, sizeof(line), "%s", g_lru_warning);
+    else
+        snprintf(line, sizeof(line), "o/b/r: sort  j/k: select  enter: threads  q: quit");
+    line[cols] = '\0';
+    top_put_line(1, line);
+    int n = snprintf(line, sizeof(line), "  %-8s %-16s %10s %10s %10s %8s %8s  %-*s",
+                     "PID", "COMM", "OFFCPU/s", "BLOCKED/s", "RUNQ/s", "OFF_P99", "BLK_P99", TOP_SPARK_LEN, "HISTORY");
+    if (n > cols)
+        line[cols] = '\0';
+    char hl[TOP_LINE_MAX];
+    snprintf(hl, sizeof(hl), "\033[7m%s\033[0m", line);
+    top_put_line(2, hl);
+
+    for (size_t r = 0; r < avail; r++) {
+        size_t i = first + r;
+        if (i >= g_top_order_len) {
+            top_put_line(header + (int)r, "");
+            continue;
+        }
+        const struct top_row *row = g_top_order[i];
+        if (top_is_thread(row))
+            n = snprintf(line, sizeof(line), "   %-7u %-16.16s %10.1f %10.1f %10.1f %8s %8s",
+                         (unsigned)row->id, row->comm, row->rate[0], row->rate[1], row->rate[2], "-", "-");
+        else
+            n = snprintf(line, sizeof(line), "%c %-8s %-16.16s %10.1f %10.1f %10.1f %8s %8s",
+                         row->id == g_top_expanded ? '-' : '+', tgid_str(row->id, id, sizeof(id)), row->comm,
+                         row->rate[0], row->rate[1], row->rate[2],
+                         format_p99(row->decayed[0], p99[0], sizeof(p99[0])),
+                         format_p99(row->decayed[1], p99[1], sizeof(p99[1])));
+        if (n > cols)
+            n = cols;
+        line[n] = '\0';
+        if (n + 2 + TOP_SPARK_LEN <= cols) {
+            top_sparkline(row, spark, sizeof(spark));
+            snprintf(line + n, sizeof(line) - n, "  %s", spark);
+        }
+        if (i == sel) {
+            snprintf(hl, sizeof(hl), "\033[7m%s\033[0m", line);
+            top_put_line(header + (int)r, hl);
+        } else {
+            top_put_line(header + (int)r, line);
+        }
+    }
+    fflush(stdout);
+}
+
+void top_move_selection(int dir) {
+    __u32 prev = 0;
+    int take_next = 0;
+    for (size_t i = 0; i < g_top_order_len; i++) {
+        const struct top_row *row = g_top_order[i];
+        if (top_is_thread(row))
+            continue;
+        if (take_next) {
+            g_top_selected = row->id;
+            return;
+        }
+        if (row->id == g_top_selected) {
+            if (dir < 0) {
+                if (prev)
+                    g_top_selected = prev;
+                return;
+            }
+            take_next = 1;
+        }
+        prev = row->id;
+    }
+}
+
+void top_toggle_threads(void) {
+    top_free_rows(&g_top_threads);
+    g_top_expanded = g_top_expanded == g_top_selected ? 0 : g_top_selected;
+    g_top_baseline_threads = 1;
+}
+
+// Returns 1 when asked to quit. Arrow keys (ESC [ A / ESC [ B) may arrive
+// split over several reads.
+int top_handle_keys(const char *keys, ssize_t n) {
+    for (ssize_t i = 0; i < n; i++) {
+        if (g_top_esc == 1) {
+            g_top_esc = keys[i] == '[' ? 2 : 0;
+            if (g_top_esc)
+                continue;
+        } else if (g_top_esc == 2) {
+            g_top_esc = 0;
+            if (keys[i] == 'A')
+                top_move_selection(-1);
+            else if (keys[i] == 'B')
+                top_move_selection(1);
+            continue;
+        }
+        switch (keys[i]) {
+        case 'q':
+            return 1;
+        case 'o':
+            g_top_sort = TOP_SORT_OFFCPU;
+            break;
+        case 'b':
+            g_top_sort = TOP_SORT_BLOCKED;
+            break;
+        case 'r':
+            g_top_sort = TOP_SORT_RUNQ;
+            break;
+        case 'j':
+            top_move_selection(1);
+            break;
+        case 'k':
+            top_move_selection(-1);
+            break;
+        case '\r':
+        case '\n':
+        case ' ':
+        case 't':
+            top_toggle_threads();
+            break;
+        case '\033':
+            g_top_esc = 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+int top_tty_setup(void) {
+    struct termios raw;
+
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || tcgetattr(STDIN_FILENO, &g_top_saved_tty) != 0) {
+        fprintf(stderr, "ERROR: --top needs a terminal\n");
+        return -1;
+    }
+    raw = g_top_saved_tty;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0)
+        return -1;
+    // Alternate screen, cursor hidden
+    printf("\033[?1049h\033[?25l");
+    fflush(stdout);
+    return 0;
+}
+
+void top_tty_restore(void) {
+    printf("\033[?25h\033[?1049l");
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSANOW, &g_top_saved_tty);
+}
+
+int run_top(void) {
+    unsigned long long refresh_ns = (unsigned long long)g_top_refresh_ms * 1000000ull;
+    unsigned long long last_ns = get_monotonic_time_ns();
+    unsigned long long next_ns = last_ns;
+    int quit = 0;
+
+    if (top_tty_setup() != 0)
+        return EXIT_FAILURE;
+    if (g_pidns)
+        pidns_refresh();
+    g_top_selected = pidns_host_tgid(g_filter_tgid);
+    g_top_expanded = g_top_selected;
+    while (!quit && !g_exiting) {
+        unsigned long long now = get_monotonic_time_ns();
+        if (now >= next_ns) {
+            top_refresh((double)(now - last_ns) / 1e9);
+            lru_check_evictions();
+            top_draw();
+            last_ns = now;
+            next_ns += refresh_ns;
+            if (next_ns <= now)
+                next_ns = now + refresh_ns;
+        }
+        control_poll();
+
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        int timeout_ms = (int)((next_ns - now) / 1000000ull);
+        if (poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : 0) > 0 && (pfd.revents & POLLIN)) {
+            char keys[32];
+            ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+            if (n > 0) {
+                quit = top_handle_keys(keys, n);
+                top_draw();
+            }
+        }
+    }
+    top_tty_restore();
+    return EXIT_SUCCESS;
+}
+
+// Accepts plain seconds or a value suffixed with s, m or h.
+int parse_duration(const char *arg, unsigned int *secs_out) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long v = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || v == 0)
+        return -1;
+    switch (*end) {
+    case '\0': break;
+    case 's': end++; break;
+    case 'm': v *= 60; end++; break;
+    case 'h': v *= 3600; end++; break;
+    default: return -1;
+    }
+    if (*end != '\0' || v > 7u * 24u * 3600u)
+        return -1;
+    *secs_out = (unsigned int)v;
+    return 0;
+}
+
+// Parses SECS[@EVERY], e.g. "5m" or "15m@1m".
+int parse_window_spec(const char *arg, struct window_spec *w) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", arg);
+    char *at = strchr(buf, '@');
+    if (at)
+        *at++ = '\0';
+    if (parse_duration(buf, &w->secs) != 0)
+        return -1;
+    w->every_secs = w->secs;
+    if (at && parse_duration(at, &w->every_secs) != 0)
+        return -1;
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  sudo %s <interval_sec> [pid]\n", prog);
+    fprintf(stderr, "  sudo %s --time_interval <sec> [--pid <pid>] [options]\n", prog);
+    fprintf(stderr, "  %s diff <baseline> <current> [thresholds]\n", prog);
+    fprintf(stderr, "  sudo %s diff <baseline> --time_interval <sec> [--pid <pid>] [thresholds]\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -i, --time_interval SEC   print (or, with --daemon, sample) every SEC seconds\n");
+    fprintf(stderr, "  -p, --pid PID             only trace the thread group PID\n");
+    fprintf(stderr, "                            (repeatable; with --tid/--comm forms a target set)\n");
+    fprintf(stderr, "      --tid TID             only trace thread TID (repeatable)\n");
+    fprintf(stderr, "      --comm PREFIX         only trace tasks whose comm starts with PREFIX (repeatable)\n");
+    fprintf(stderr, "      --pidns[=NSFILE]      PIDs are those of this PID namespace (default: our own,\n");
+    fprintf(stderr, "                            /proc/self/ns/pid); only its tasks are traced\n");
+    fprintf(stderr, "  -d, --daemon              keep running histograms over trailing windows\n");
+    fprintf(stderr, "  -w, --window LEN[@EVERY]  trailing window to report in daemon mode, e.g. 5m@1m\n");
+    fprintf(stderr, "                            (repeatable; default 1m, 5m@1m, 15m@1m)\n");
+    fprintf(stderr, "  -H, --heatmap             print time x latency heatmaps instead of histograms\n");
+    fprintf(stderr, "      --heatmap-step MS     heatmap column width (default 100)\n");
+    fprintf(stderr, "      --heatmap-out FILE    also write the heatmap matrix to FILE as CSV\n");
+    fprintf(stderr, "      --syscalls            break off-CPU and blocked time down by syscall\n");
+    fprintf(stderr, "      --blockio             split D-state time into block IO and other waits\n");
+    fprintf(stderr, "      --futex               report the most contended futexes (locks)\n");
+    fprintf(stderr, "      --pin                 pin maps and programs in bpffs for --client runs\n");
+    fprintf(stderr, "      --client              read a --pin daemon's maps; attach nothing\n");
+    fprintf(stderr, "      --pin-dir DIR         bpffs directory for --pin/--client (default %s)\n", DEFAULT_PIN_DIR);
+    fprintf(stderr, "      --min-offcpu USEC     do not stream off-CPU intervals shorter than USEC\n");
+    fprintf(stderr, "      --format text|csv     how histograms are printed (default text)\n");
+    fprintf(stderr, "      --control PATH        accept settings changes on a Unix socket at PATH\n");
+    fprintf(stderr, "      --map-budget MB       memory for per-thread and per-process maps (default %d)\n",
+            DEFAULT_MAP_BUDGET_MB);
+    fprintf(stderr, "      --cgroup PATH         only trace tasks in this cgroup v2 subtree\n");
+    fprintf(stderr, "      --cgroups             report time per cgroup, rolled up into parents\n");
+    fprintf(stderr, "      --wakeup-batch BYTES  wake up once BYTES of samples are queued; 0 = each (default %u)\n",
+            DEFAULT_WAKEUP_BYTES);
+    fprintf(stderr, "      --oncpu               also report on-CPU slices: histogram, CPU%%, switches/s\n");
+    fprintf(stderr, "      --sched               run-queue and off-CPU time by scheduling policy and priority\n");
+    fprintf(stderr, "      --preempt             rank who preempts traced threads by the wait it causes\n");
+    fprintf(stderr, "      --threads             with --pid, break its time down by thread, grouped by comm\n");
+    fprintf(stderr, "      --flight-recorder SECS  record every switch in memory; dump the last SECS seconds\n");
+    fprintf(stderr, "                            to flight-*.csv on SIGUSR1 or the control command 'dump'\n");
+    fprintf(stderr, "      --flight-size RECS    flight recorder records per CPU (default %d)\n", DEFAULT_FLIGHT_SIZE);
+    fprintf(stderr, "      --flight-p99 MS       also dump when an interval's p99 goes over MS\n");
+    fprintf(stderr, "      --flame FILE          write on- and off-CPU stacks to FILE as a folded flame graph\n");
+    fprintf(stderr, "      --flame-hz HZ         on-CPU stack samples per second per CPU (default %d)\n",
+            DEFAULT_FLAME_HZ);
+    fprintf(stderr, "      --flame-stacks N      distinct stacks kept for --flame (default %d)\n",
+            DEFAULT_FLAME_STACKS);
+    fprintf(stderr, "      --outliers N          list the N longest intervals of each kind every interval (max %d)\n",
+            TOPK_ENTRIES);
+    fprintf(stderr, "      --top                 live full-screen view ranked by off-CPU time\n");
+    fprintf(stderr, "      --refresh MS          --top refresh period (default %d)\n", DEFAULT_TOP_REFRESH_MS);
+    fprintf(stderr, "  -s, --save FILE           write the cumulative histograms to FILE every interval\n");
+    fprintf(stderr, "  -c, --count N             stop after N intervals\n");
+    fprintf(stderr, "\nDiff thresholds (exit status %d when exceeded):\n", DIFF_EXIT_REGRESSION);
+    fprintf(stderr, "      --max-ks D            Kolmogorov-Smirnov distance, 0..1\n");
+    fprintf(stderr, "      --max-emd B           Earth Mover's distance in log2 buckets\n");
+    fprintf(stderr, "      --max-p99 PCT         p99 increase in percent\n");
+    fprintf(stderr, "      --diff-streak N       live: fail after N intervals over a threshold in a row (default %d)\n",
+            DEFAULT_DIFF_STREAK);
+}
+
+void err_check(int argc, char **argv) {
+    static const struct option long_opts[] = {
+        { "time_interval", required_argument, NULL, 'i' },
+        { "pid",           required_argument, NULL, 'p' },
+        { "tid",           required_argument, NULL, 'I' },
+        { "comm",          required_argument, NULL, 'Q' },
+        { "daemon",        no_argument,       NULL, 'd' },
+        { "window",        required_argument, NULL, 'w' },
+        { "heatmap",       no_argument,       NULL, 'H' },
+        { "heatmap-step",  required_argument, NULL, 'S' },
+        { "heatmap-out",   required_argument, NULL, 'O' },
+        { "syscalls",      no_argument,       NULL, 'Y' },
+        { "blockio",       no_argument,       NULL, 'B' },
+        { "futex",         no_argument,       NULL, 'F' },
+        { "pin",           no_argument,       NULL, 'N' },
+        { "client",        no_argument,       NULL, 'C' },
+        { "pin-dir",       required_argument, NULL, 'D' },
+        { "min-offcpu",    required_argument, NULL, 'M' },
+        { "format",        required_argument, NULL, 'f' },
+        { "control",       required_argument, NULL, 'X' },
+        { "map-budget",    required_argument, NULL, 'm' },
+        { "cgroup",        required_argument, NULL, 'G' },
+        { "cgroups",       no_argument,       NULL, 'A' },
+        { "wakeup-batch",  required_argument, NULL, 'W' },
+        { "top",           no_argument,       NULL, 'T' },
+        { "refresh",       required_argument, NULL, 'R' },
+        { "pidns",         optional_argument, NULL, 'U' },
+        { "outliers",      required_argument, NULL, 'L' },
+        { "threads",       no_argument,       NULL, 'J' },
+        { "oncpu",         no_argument,       NULL, 'u' },
+        { "sched",         no_argument,       NULL, 'x' },
+        { "preempt",       no_argument,       NULL, 'y' },
+        { "flight-recorder", required_argument, NULL, 'Z' },
+        { "flight-size",   required_argument, NULL, 'z' },
+        { "flight-p99",    required_argument, NULL, 'V' },
+        { "flame",         required_argument, NULL, 'g' },
+        { "flame-hz",      required_argument, NULL, 'q' },
+        { "flame-stacks",  required_argument, NULL, 'j' },
+        { "save",          required_argument, NULL, 's' },
+        { "count",         required_argument, NULL, 'c' },
+        { "max-ks",        required_argument, NULL, 'K' },
+        { "max-emd",       required_argument, NULL, 'E' },
+        { "max-p99",       required_argument, NULL, 'P' },
+        { "diff-streak",   required_argument, NULL, 'v' },
+        { "help",          no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int interval = 0;
+    int pid = 0;
+    const char *prog = argv[0];
+    int opt;
+
+    if (argc > 1 && strcmp(argv[1], "diff") == 0) {
+        g_diff_mode = 1;
+        argc--;
+        argv++;
+    }
+
+    while ((opt = getopt_long(argc, argv, "i:p:dw:Hs:c:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'p':
+        case 'I':
+            pid = atoi(optarg);
+            if (pid <= 0) {
+                fprintf(stderr, "%s must be greater than 0 when provided.\n", opt == 'p' ? "PID" : "TID");
+                exit(EXIT_FAILURE);
+            }
+            if (target_add(opt == 'p' ? TARGET_PID : TARGET_TID, (__u32)pid, NULL) != 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'Q':
+            if (optarg[0] == '\0' || strlen(optarg) >= sizeof(g_targets[0].comm)) {
+                fprintf(stderr, "A comm prefix is 1 to 15 characters.\n");
+                exit(EXIT_FAILURE);
+            }
+            if (target_add(TARGET_COMM, 0, optarg) != 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 'd':
+            g_daemon = 1;
+            break;
+        case 'w':
+            if (g_num_windows == MAX_WINDOWS) {
+                fprintf(stderr, "At most %d windows can be given.\n", MAX_WINDOWS);
+                exit(EXIT_FAILURE);
+            }
+            if (parse_window_spec(optarg, &g_windows[g_num_windows]) != 0) {
+                fprintf(stderr, "Invalid window '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            g_num_windows++;
+            break;
+        case 'H':
+            g_heatmap = 1;
+            break;
+        case 'S':
+            g_heatmap_step_ms = (unsigned int)atoi(optarg);
+            if ((int)g_heatmap_step_ms <= 0) {
+                fprintf(stderr, "Heatmap step must be greater than 0 ms.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            g_heatmap_out_path = optarg;
+            g_heatmap = 1;
+            break;
+        case 'Y':
+            g_syscalls = 1;
+            break;
+        case 'B':
+            g_blockio = 1;
+            break;
+        case 'F':
+            g_futex = 1;
+            break;
+        case 'N':
+            g_pin = 1;
+            break;
+        case 'C':
+            g_client = 1;
+            break;
+        case 'D':
+            g_pin_dir = optarg;
+            break;
+        case 'M': {
+            unsigned long long us;
+            if (parse_ull(optarg, ULLONG_MAX / 1000ull, &us) != 0) {
+                fprintf(stderr, "Invalid --min-offcpu '%s'; give microseconds.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            g_config.min_offcpu_ns = us * 1000ull;
+            break;
+        }
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                g_csv = 1;
+            } else if (strcmp(optarg, "text") != 0) {
+                fprintf(stderr, "Unknown format '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'X':
+            g_control_path = optarg;
+            break;
+        case 'm':
+            g_map_budget_mb = (unsigned int)atoi(optarg);
+            if ((int)g_map_budget_mb <= 0) {
+                fprintf(stderr, "Map budget must be greater than 0 MB.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            if (cgroup_normalize(optarg, g_cgroup_path_buf, sizeof(g_cgroup_path_buf)) != 0) {
+                fprintf(stderr, "Invalid cgroup '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            g_cgroup_path = g_cgroup_path_buf;
+            break;
+        case 'A':
+            g_cgroups = 1;
+            break;
+        case 'W': {
+            unsigned long long v = 0;
+            if (parse_ull(optarg, MAX_WAKEUP_BYTES, &v) != 0) {
+                fprintf(stderr, "--wakeup-batch must be between 0 and %u bytes.\n", MAX_WAKEUP_BYTES);
+                exit(EXIT_FAILURE);
+            }
+            g_wakeup_bytes = (unsigned int)v;
+            break;
+        }
+        case 'T':
+            g_top = 1;
+            break;
+        case 'U':
+            g_pidns = 1;
+            if (optarg)
+                g_pidns_path = optarg;
+            break;
+        case 'J':
+            g_threads = 1;
+            break;
+        case 'u':
+            g_oncpu = 1;
+            break;
+        case 'x':
+            g_sched = 1;
+            break;
+        case 'y':
+            g_preempt = 1;
+            break;
+        case 'Z':
+            g_flight_secs = (unsigned int)atoi(optarg);
+            if ((int)g_flight_secs <= 0) {
+                fprintf(stderr, "Flight recorder span must be greater than 0 seconds.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            g_flight_size = (unsigned int)atoi(optarg);
+            if ((int)g_flight_size <= 0) {
+                fprintf(stderr, "Flight recorder size must be greater than 0 records.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'V':
+            g_flight_p99_ms = atof(optarg);
+            if (g_flight_p99_ms <= 0) {
+                fprintf(stderr, "Flight recorder p99 threshold must be greater than 0 ms.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'g':
+            g_flame_path = optarg;
+            break;
+        case 'q': {
+            unsigned long long v = 0;
+            if (parse_ull(optarg, 10000, &v) != 0 || v == 0) {
+                fprintf(stderr, "Flame graph sampling rate must be between 1 and 10000 Hz.\n");
+                exit(EXIT_FAILURE);
+            }
+            g_flame_hz = (unsigned int)v;
+            break;
+        }
+        case 'j': {
+            unsigned long long v = 0;
+            if (parse_ull(optarg, MAX_FLAME_STACKS, &v) != 0 || v == 0) {
+                fprintf(stderr, "--flame-stacks must be between 1 and %u.\n", MAX_FLAME_STACKS);
+                exit(EXIT_FAILURE);
+            }
+            g_flame_stacks = (unsigned int)v;
+            break;
+        }
+        case 'L':
+            g_outliers = (unsigned int)atoi(optarg);
+            if ((int)g_outliers <= 0 || g_outliers > TOPK_ENTRIES) {
+                fprintf(stderr, "Outliers must be between 1 and %d.\n", TOPK_ENTRIES);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R': {
+            unsigned long long v = 0;
+            if (parse_ull(optarg, 3600000, &v) != 0 || v == 0) {
+                fprintf(stderr, "Refresh period must be between 1 and 3600000 ms.\n");
+                exit(EXIT_FAILURE);
+            }
+            g_top_refresh_ms = (unsigned int)v;
+            break;
+        }
+        case 's':
+            g_save_path = optarg;
+            break;
+        case 'c':
+            g_max_intervals = atoi(optarg);
+            if (g_max_intervals <= 0) {
+                fprintf(stderr, "Count must be greater than 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'K':
+        case 'E':
+        case 'P': {
+            double v = 0.0;
+            if (parse_threshold(optarg, &v) != 0 || (opt == 'K' && v > 1.0)) {
+                fprintf(stderr, "Invalid diff threshold '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (opt == 'K')
+                g_max_ks = v;
+            else if (opt == 'E')
+                g_max_emd = v;
+            else
+                g_max_p99_pct = v;
+            break;
+        }
+        case 'v': {
+            unsigned long long v = 0;
+            if (parse_ull(optarg, 1000000, &v) != 0 || v == 0) {
+                fprintf(stderr, "--diff-streak must be between 1 and 1000000.\n");
+                exit(EXIT_FAILURE);
+            }
+            g_diff_streak = (unsigned int)v;
+            break;
+        }
+        case 'h':
+            usage(prog);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(prog);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (g_diff_mode) {
+        if (optind < argc)
+            g_diff_base_path = argv[optind++];
+        if (optind < argc)
+            g_diff_new_path = argv[optind++];
+        if (!g_diff_base_path || optind < argc || g_daemon || g_heatmap || g_top) {
+            usage(prog);
+            exit(EXIT_FAILURE);
+        }
+        // Two saved captures need neither root nor an interval.
+        if (g_diff_new_path)
+            return;
+    }
+
+    // Positional form kept for compatibility: <interval_sec> [pid]
+    if (!g_diff_mode && optind < argc && interval == 0)
+        interval = atoi(argv[optind++]);
+    if (!g_diff_mode && optind < argc && pid == 0) {
+        pid = atoi(argv[optind++]);
+        if (pid <= 0) {
+            fprintf(stderr, "PID must be greater than 0 when provided.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        usage(prog);
+        exit(EXIT_FAILURE);
+    }
+    // A single --pid keeps the plain PID filter and its exact totals;
+    // anything more becomes a target set.
+    if (g_num_targets == 1 && g_targets[0].kind == TARGET_PID) {
+        g_num_targets = 0;
+    } else if (g_num_targets > 0) {
+        pid = 0;
+        if (g_client) {
+            fprintf(stderr, "--client cannot trace a target set.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "This program must be run as root.\n");
+        exit(EXIT_FAILURE);
+    }
+    // The top view refreshes on its own period
+    if (g_top && interval == 0)
+        interval = 1;
+    if (interval <= 0) {
+        fprintf(stderr, "Time interval must be greater than 0.\n");
+        exit(EXIT_FAILURE);
+    }
+    g_interval_sec = interval;
+    g_filter_tgid = (__u32)pid;
+    g_capture.interval_sec = (unsigned int)interval;
+    g_capture.pid = (__u32)pid;
+
+    if (g_daemon && g_heatmap) {
+        fprintf(stderr, "--daemon and --heatmap cannot be combined.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_client && (g_pin || g_heatmap || g_control_path)) {
+        fprintf(stderr, "--client cannot be combined with --pin, --heatmap or --control.\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((g_cgroup_path || g_cgroups) && !cgroup_v2_mounted()) {
+        fprintf(stderr, "--cgroup and --cgroups need cgroup v2 mounted at %s.\n", CGROUP_ROOT);
+        exit(EXIT_FAILURE);
+    }
+    if (g_client && g_cgroup_path && !g_cgroups) {
+        fprintf(stderr, "--client cannot filter by cgroup; use --cgroup with --cgroups to narrow the report.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_client && g_pidns) {
+        fprintf(stderr, "--client cannot translate PIDs; run the --pin daemon with --pidns instead.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_threads && (pid == 0 || g_daemon || g_heatmap || g_client || g_top || g_diff_mode)) {
+        fprintf(stderr, "--threads needs a single --pid and the plain interval report.\n");
+        exit(EXIT_FAILURE);
+    }
+    g_tid_stats = g_top || g_threads;
+    if (g_oncpu && (g_daemon || g_heatmap || g_client || g_top || g_diff_mode)) {
+        fprintf(stderr, "--oncpu only works with the plain interval report.\n");
+        exit(EXIT_FAILURE);
+    }
+    g_tgid_hists = g_top || g_oncpu;
+    if (g_sched && (g_daemon || g_heatmap || g_top || g_diff_mode)) {
+        fprintf(stderr, "--sched only works with the plain interval report.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_preempt && (g_daemon || g_heatmap || g_top || g_diff_mode)) {
+        fprintf(stderr, "--preempt only works with the plain interval report.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_flight_secs && (g_client || g_top)) {
+        fprintf(stderr, "--flight-recorder cannot be combined with --client or --top.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_flight_p99_ms > 0 && !g_flight_secs) {
+        fprintf(stderr, "--flight-p99 needs --flight-recorder.\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((g_flame_hz || g_flame_stacks) && !g_flame_path) {
+        fprintf(stderr, "--flame-hz and --flame-stacks need --flame.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_flame_path && g_client) {
+        fprintf(stderr, "--flame attaches a sampler and cannot be combined with --client.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_outliers && (g_daemon || g_heatmap || g_client || g_top || g_diff_mode)) {
+        fprintf(stderr, "--outliers only works with the plain interval report.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_top && (g_daemon || g_heatmap || g_client)) {
+        fprintf(stderr, "--top cannot be combined with --daemon, --heatmap or --client.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_num_windows && !g_daemon) {
+        fprintf(stderr, "--window needs --daemon.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (g_daemon && g_num_windows == 0) {
+        parse_window_spec("1m", &g_windows[g_num_windows++]);
+        parse_window_spec("5m@1m", &g_windows[g_num_windows++]);
+        parse_window_spec("15m@1m", &g_windows[g_num_windows++]);
+    }
+    for (int i = 0; i < g_num_windows; i++) {
+        if (g_windows[i].every_secs < (unsigned int)interval)
+            g_windows[i].every_secs = (unsigned int)interval;
+        size_t n = window_intervals(g_windows[i].secs);
+        if (n > ((size_t)MAX_WINDOW_RING_MB << 20) / sizeof(struct interval_snapshot)) {
+            fprintf(stderr, "Window of %us needs %zu intervals of %ds, more than %d MiB of history; "
+                    "use a longer --time_interval.\n", g_windows[i].secs, n, interval, MAX_WINDOW_RING_MB);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// The fd of one of the programs' maps: from the loaded object, or as a
+// --client from its pin.
+int map_fd(const char *name) {
+    char path[PATH_MAX];
+
+    if (!g_client) {
+        struct bpf_map *map = g_obj ? bpf_object__find_map_by_name(g_obj, name) : NULL;
+        return map ? bpf_map__fd(map) : -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", g_pin_dir, name);
+    int fd = bpf_obj_get(path);
+    if (fd >= 0 && g_num_pinned_fds < (int)NUM_PINNED_MAPS)
+        g_pinned_fds[g_num_pinned_fds++] = fd;
+    return fd;
+}
+
+// Sets up everything that reads the maps once they exist.
+int setup_readers(void) {
+    g_blocked_hist_fd = map_fd("blocked_hist");
+    if (g_blocked_hist_fd < 0) {
+        fprintf(stderr, "WARNING: could not find map 'blocked_hist' (blocked histogram disabled)\n");
+    }
+    if (hist_percpu_init() != 0) {
+        fprintf(stderr, "ERROR: failed to set up per-CPU histograms\n");
+        return -1;
+    }
+    if (g_client) {
+        g_offcpu_hist_fd = map_fd("offcpu_hist");
+        if (g_offcpu_hist_fd < 0) {
+            fprintf(stderr, "ERROR: could not open pinned map 'offcpu_hist'\n");
+            return -1;
+        }
+    }
+
+    if (map_reader_init(&g_tgid_stats_rd, map_fd("tgid_stats"),
+                        sizeof(__u32), sizeof(struct tgid_stats)) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'tgid_stats'\n");
+        return -1;
+    }
+    if (g_pidns && pidns_init(map_fd("ns_tgids")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'ns_tgids'\n");
+        return -1;
+    }
+    if (g_threads && thread_report_init(map_fd("tid_stats"), map_fd("tid_hists"), map_fd("thread_exits")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'tid_stats' and 'tid_hists'\n");
+        return -1;
+    }
+    if (g_oncpu && oncpu_report_init(map_fd("oncpu_hist"), map_fd("tgid_hists")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'oncpu_hist'\n");
+        return -1;
+    }
+    if (g_flight_secs && flight_init(map_fd("flight_recs"), map_fd("flight_head")) != 0) {
+        fprintf(stderr, "ERROR: failed to map the flight recorder\n");
+        return -1;
+    }
+    if (g_flame_path && flame_init(map_fd("flame_counts"), map_fd("stacks"), map_fd("flame_counters")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'flame_counts', 'stacks' and 'flame_counters'\n");
+        return -1;
+    }
+    if (g_outliers && outliers_init(map_fd("topk")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'topk'\n");
+        return -1;
+    }
+
+    if (g_syscalls && syscall_report_init(map_fd("syscall_stats")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'syscall_stats'\n");
+        return -1;
+    }
+    if (g_blockio && blockio_report_init(map_fd("io_dev_stats"), map_fd("dstate_hist"),
+                                         g_client ? -1 : map_fd("io_counters")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up block IO maps\n");
+        return -1;
+    }
+    if (g_futex && futex_report_init(map_fd("futex_stats")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'futex_stats'\n");
+        return -1;
+    }
+    if (g_sched && sched_report_init(map_fd("sched_stats")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'sched_stats'\n");
+        return -1;
+    }
+    if (g_preempt && preempt_report_init(map_fd("preempt_stats")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'preempt_stats'\n");
+        return -1;
+    }
+    if (g_cgroups && cgroup_report_init(map_fd("cgroup_stats")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'cgroup_stats'\n");
+        return -1;
+    }
+    if (g_top && top_init(map_fd("tid_stats"), map_fd("tgid_hists")) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'tid_stats' and 'tgid_hists'\n");
+        return -1;
+    }
+
+    // A client joins a daemon that has been counting for a while: intervals
+    // start from what the kernel holds now.
+    read_percpu_hist(g_blocked_hist_fd, g_blocked_prev);
+    read_percpu_hist(g_offcpu_hist_fd, g_offcpu_prev);
+    if (g_pidns)
+        pidns_refresh();
+    __u32 host = g_filter_tgid != 0 ? pidns_host_tgid(g_filter_tgid) : 0;
+    if (host != 0 && map_reader_read(&g_tgid_stats_rd) == 0) {
+        const struct tgid_stats *st = find_tgid_stats(host);
+        if (st)
+            g_pid_stats_prev = *st;
+    }
+    return 0;
+}
+
+// --pin: the links keep the programs attached for as long as they are
+// pinned, so clients never attach a second copy. Undone on a clean exit;
+// after a crash the directory stays and has to be removed by hand.
+int pin_objects(void) {
+    char path[PATH_MAX];
+
+    if (mkdir(g_pin_dir, 0700) != 0) {
+        if (errno == EEXIST)
+            fprintf(stderr, "ERROR: '%s' exists: another daemon is running, or remove it if stale\n", g_pin_dir);
+        else
+            fprintf(stderr, "ERROR: cannot create '%s': %s\n", g_pin_dir, strerror(errno));
+        return -1;
+    }
+    g_pinned = 1;
+    for (size_t i = 0; i < NUM_PINNED_MAPS; i++) {
+        struct bpf_map *map = bpf_object__find_map_by_name(g_obj, pinned_maps[i]);
+        snprintf(path, sizeof(path), "%s/%s", g_pin_dir, pinned_maps[i]);
+        if (!map || bpf_map__pin(map, path) != 0) {
+            fprintf(stderr, "ERROR: failed to pin map '%s'\n", pinned_maps[i]);
+            return -1;
+        }
+    }
+    for (int i = 0; i < g_num_links; i++) {
+        snprintf(path, sizeof(path), "%s/link_%s", g_pin_dir, g_link_names[i]);
+        if (bpf_link__pin(g_links[i], path) != 0) {
+            fprintf(stderr, "ERROR: failed to pin program '%s'\n", g_link_names[i]);
+            return -1;
+        }
+    }
+    fprintf(stderr, "Pinned maps and programs under %s\n", g_pin_dir);
+    return 0;
+}
+
+void unpin_objects(void) {
+    if (!g_pinned)
+        return;
+    for (size_t i = 0; i < NUM_PINNED_MAPS; i++) {
+        struct bpf_map *map = bpf_object__find_map_by_name(g_obj, pinned_maps[i]);
+        if (map && bpf_map__is_pinned(map))
+            bpf_map__unpin(map, NULL);
+    }
+    for (int i = 0; i < g_num_links; i++)
+        bpf_link__unpin(g_links[i]);
+    if (rmdir(g_pin_dir) != 0)
+        fprintf(stderr, "WARNING: failed to remove '%s': %s\n", g_pin_dir, strerror(errno));
+    g_pinned = 0;
+}
+
+// --client: use a --pin daemon's maps. Reports the daemon does not collect
+// are dropped with a warning.
+int open_pinned(void) {
+    __u32 zero = 0;
+
+    g_config_fd = map_fd("config");
+    if (g_config_fd < 0 || bpf_map_lookup_elem(g_config_fd, &zero, &g_config) != 0) {
+        fprintf(stderr, "ERROR: no pinned maps under '%s'; is a --pin daemon running?\n", g_pin_dir);
+        return -1;
+    }
+    if (g_syscalls && !(g_config.flags & CFG_SYSCALLS)) {
+        fprintf(stderr, "WARNING: the daemon does not collect --syscalls\n");
+        g_syscalls = 0;
+    }
+    if (g_blockio && !(g_config.flags & CFG_BLOCKIO)) {
+        fprintf(stderr, "WARNING: the daemon does not collect --blockio\n");
+        g_blockio = 0;
+    }
+    if (g_futex && !(g_config.flags & CFG_FUTEX)) {
+        fprintf(stderr, "WARNING: the daemon does not collect --futex\n");
+        g_futex = 0;
+    }
+    if (g_sched && !(g_config.flags & CFG_SCHED)) {
+        fprintf(stderr, "WARNING: the daemon does not collect --sched\n");
+        g_sched = 0;
+    }
+    if (g_preempt && !(g_config.flags & CFG_PREEMPT)) {
+        fprintf(stderr, "WARNING: the daemon does not collect --preempt\n");
+        g_preempt = 0;
+    }
+    return setup_readers();
+}
+
+int load_bpf_program(__u32 pid)
+{
+    struct bpf_program *prog;
+    int err;
+
+    fprintf(stderr, "Loading BPF code in memory\n");
+    g_obj = bpf_object__open_file("cpu_analyzer.bpf.o", NULL);
+    if (libbpf_get_error(g_obj)) {
+        fprintf(stderr, "ERROR: opening BPF object file failed\n");
+        return -1;
+    }
+
+    // Opt-in programs stay out of the kernel unless asked for.
+    if (!g_syscalls) {
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_sys_enter"), false);
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_sys_exit"), false);
+    }
+    if (!g_blockio) {
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_block_rq_issue"), false);
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_block_rq_complete"), false);
+    }
+    if (!g_futex) {
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_futex_enter"), false);
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_futex_exit"), false);
+    }
+    if (g_num_targets == 0)
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_process_fork"), false);
+    if (!g_flame_path)
+        bpf_program__set_autoload(bpf_object__find_program_by_name(g_obj, "handle_cpu_sample"), false);
+
+    if (size_lru_maps(g_obj) != 0)
+        return -1;
+    if (g_flight_secs && flight_prepare(g_obj) != 0) {
+        fprintf(stderr, "ERROR: failed to size the flight recorder\n");
+        return -1;
+    }
+    if (g_flame_path && flame_prepare(g_obj) != 0) {
+        fprintf(stderr, "ERROR: failed to size the flame graph maps\n");
+        return -1;
+    }
+
+    fprintf(stderr, "Loading and verifying the code in the kernel\n");
+    err = bpf_object__load(g_obj);
+    if (err) {
+        fprintf(stderr, "ERROR: loading BPF object file failed: %d\n", err);
+        return -1;
+    }
+
+    struct bpf_map *config_map = bpf_object__find_map_by_name(g_obj, "config");
+    if (!config_map) {
+        fprintf(stderr, "ERROR: could not find map 'config'\n");
+        return -1;
+    }
+    g_config_fd = bpf_map__fd(config_map);
+    g_config.flags = (g_syscalls ? CFG_SYSCALLS : 0) | (g_blockio ? CFG_BLOCKIO : 0) |
+                     (g_futex ? CFG_FUTEX : 0) | (g_pin ? CFG_OFFCPU_HIST : 0) |
+                     (g_top ? CFG_NO_SAMPLES | CFG_TID_STATS | CFG_TID_ALL | CFG_TGID_HIST : 0) |
+                     (g_threads ? CFG_TID_STATS | CFG_TID_HIST : 0) |
+                     (g_cgroups ? CFG_CGROUP_STATS : 0) | (g_pidns ? CFG_PIDNS : 0) |
+                     (g_outliers ? CFG_OUTLIERS : 0) | (g_flight_secs ? CFG_FLIGHT : 0) |
+                     (g_oncpu ? CFG_ONCPU | CFG_TGID_HIST : 0) | (g_flame_path ? CFG_FLAME : 0) |
+                     (g_sched ? CFG_SCHED : 0) | (g_preempt ? CFG_PREEMPT : 0);
+    g_config.flight_mask = g_flight_size - 1;
+    if (g_pidns && pidns_open(&g_config) != 0)
+        return -1;
+    if (g_cgroup_path) {
+        struct bpf_map *filter_map = bpf_object__find_map_by_name(g_obj, "cgroup_filter");
+        if (!filter_map || cgroup_filter_set(bpf_map__fd(filter_map)) != 0) {
+            fprintf(stderr, "ERROR: failed to set up the cgroup filter\n");
+            return -1;
+        }
+        g_config.flags |= CFG_CGROUP_FILTER;
+    }
+    if (g_num_targets > 0) {
+        if (targets_setup(g_obj) != 0) {
+            fprintf(stderr, "ERROR: failed to set up the target set\n");
+            return -1;
+        }
+        g_config.flags |= CFG_TARGETS;
+    }
+    g_config.wakeup_bytes = g_wakeup_bytes;
+    g_config.filter_tgid = pid;
+    if (write_config(&g_config) != 0) {
+        fprintf(stderr, "ERROR: failed to write 'config'\n");
+        return -1;
+    }
+
+    // The sampler is attached per CPU by flame_attach()
+    bpf_object__for_each_program(prog, g_obj) {
+        if (!bpf_program__autoload(prog) || bpf_program__type(prog) == BPF_PROG_TYPE_PERF_EVENT)
+            continue;
+        struct bpf_link *link = bpf_program__attach(prog);
+        if (libbpf_get_error(link) || g_num_links == MAX_LINKS) {
+            fprintf(stderr, "ERROR: attaching program '%s' failed\n", bpf_program__name(prog));
+            return -1;
+        }
+        g_link_names[g_num_links] = bpf_program__name(prog);
+        g_links[g_num_links++] = link;
+    }
+    if (g_flame_path && flame_attach(g_obj) != 0)
+        return -1;
+
+    fprintf(stderr, "BPF programs loaded and attached. Set PID=%u\n", pid);
+
+    if (g_pin && pin_objects() != 0)
+        return -1;
+    if (setup_readers() != 0)
+        return -1;
+    if (lru_stats_init(g_obj) != 0) {
+        fprintf(stderr, "ERROR: failed to set up 'lru_ops'\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    err_check(argc, argv);
+
+    // SIGUSR1 kills by default: hold it from the start so a dump requested
+    // while the programs load waits for the signalfd instead.
+    if (g_flight_secs) {
+        sigset_t usr1;
+        sigemptyset(&usr1);
+        sigaddset(&usr1, SIGUSR1);
+        sigprocmask(SIG_BLOCK, &usr1, NULL);
+    }
+
+    if (g_diff_mode && g_diff_new_path)
+        return run_file_diff();
+    if (g_diff_mode && load_capture(g_diff_base_path, &g_baseline) != 0) {
+        fprintf(stderr, "ERROR: could not read capture '%s'\n", g_diff_base_path);
+        return EXIT_FAILURE;
+    }
+
+    __u32 pid = g_filter_tgid;
+    int interval = g_interval_sec;
+    int exit_code = EXIT_SUCCESS;
+
+    if (g_daemon && window_ring_init() != 0) {
+        fprintf(stderr, "ERROR: failed to allocate window history\n");
+        return EXIT_FAILURE;
+    }
+
+    // Ctrl-C ends the run cleanly, which matters most when pins are to be
+    // removed.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (g_client) {
+        if (open_pinned() != 0) {
+            exit_code = EXIT_FAILURE;
+            goto cleanup;
+        }
+    } else if (load_bpf_program(pid) != 0) {
+        fprintf(stderr, "Failed to load/attach BPF program.\n");
+        exit_code = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // Nothing is streamed in top mode
+    if (!g_client && !g_top) {
+        struct bpf_map *rb_map = bpf_object__find_map_by_name(g_obj, "rb");
+        if (!rb_map) {
+            fprintf(stderr, "ERROR: could not find ring buffer map 'rb'\n");
+            exit_code = EXIT_FAILURE;
+            goto cleanup;
+        }
+        int rb_fd = bpf_map__fd(rb_map);
+        if (rb_fd < 0) {
+            fprintf(stderr, "ERROR: failed to get ring buffer fd\n");
+            exit_code = EXIT_FAILURE;
+            goto cleanup;
+        }
+        g_rb = ring_buffer__new(rb_fd, handle_rb_event, NULL, NULL);
+        if (!g_rb) {
+            fprintf(stderr, "ERROR: failed to create ring buffer consumer\n");
+            exit_code = EXIT_FAILURE;
+            goto cleanup;
+        }
+        struct bpf_map *exit_rb_map = bpf_object__find_map_by_name(g_obj, "exit_rb");
+        if (!exit_rb_map || ring_buffer__add(g_rb, bpf_map__fd(exit_rb_map), handle_exit_event, NULL) != 0) {
+            fprintf(stderr, "ERROR: failed to add exit ring buffer\n");
+            exit_code = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+
+    if (g_control_path && control_open(g_control_path) != 0) {
+        fprintf(stderr, "ERROR: failed to set up control socket '%s'\n", g_control_path);
+        exit_code = EXIT_FAILURE;
+        goto cleanup;
+    }
+    if (g_top) {
+        exit_code = run_top();
+        goto cleanup;
     }
 
     unsigned long long interval_ns = (unsigned long long)interval * 1000000000ull;
-    unsigned long long next_print_ns = get_monotonic_time_ns() + interval_ns;
+    unsigned long long start_ns = get_monotonic_time_ns();
+    unsigned long long next_print_ns = start_ns + interval_ns;
+    if (g_heatmap && heatmap_open(start_ns) != 0) {
+        fprintf(stderr, "ERROR: failed to set up heatmap\n");
+        exit_code = EXIT_FAILURE;
+        goto cleanup;
+    }
+    for (int i = 0; i < g_num_windows; i++)
+        g_windows[i].next_report_ns = next_print_ns - interval_ns +
+                                      (unsigned long long)g_windows[i].every_secs * 1000000000ull;
+    if (loop_open() != 0) {
+        fprintf(stderr, "ERROR: failed to set up the event loop: %s\n", strerror(errno));
+        exit_code = EXIT_FAILURE;
+        goto cleanup;
+    }
+    // Heatmap columns are filled straight from the samples, so that mode
+    // keeps consuming on this thread.
+    if (g_rb && !g_heatmap) {
+        if (consumer_start() != 0) {
+            fprintf(stderr, "ERROR: failed to start the ring buffer consumer: %s\n", strerror(errno));
+            exit_code = EXIT_FAILURE;
+            goto cleanup;
+        }
+    } else if (g_rb && loop_add(ring_buffer__epoll_fd(g_rb), LOOP_RING) != 0) {
+        fprintf(stderr, "ERROR: failed to set up the event loop: %s\n", strerror(errno));
+        exit_code = EXIT_FAILURE;
+        goto cleanup;
+    }
     for (;;) {
-        unsigned long long now = get_monotonic_time_ns();
-        long long remain_ns = (long long)(next_print_ns - now);
-        int timeout_ms;
-        if (remain_ns <= 0) {
-            timeout_ms = 0;
-        } else {
-            unsigned long long remain_ms = (unsigned long long)(remain_ns / 1000000ll);
-            if (remain_ms == 0) remain_ms = 1;
-            if (remain_ms > 250) remain_ms = 250;
-            timeout_ms = (int)remain_ms;
+        unsigned long long deadline_ns = next_print_ns;
+        if (g_heatmap && g_heat_next_step_ns < deadline_ns)
+            deadline_ns = g_heat_next_step_ns;
+        if (loop_arm(deadline_ns) != 0) {
+            fprintf(stderr, "ERROR: failed to arm interval timer: %s\n", strerror(errno));
+            break;
         }
-
-        int ret = ring_buffer__poll(g_rb, timeout_ms);
-        if (ret < 0 && ret != -EINTR) {
-            fprintf(stderr, "ERROR: ring_buffer__poll failed: %d\n", ret);
+        int ret = loop_wait();
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: event loop failed: %d\n", ret);
+            break;
+        }
+        if (g_exiting)
             break;
+        if (g_flight_dump) {
+            char path[64];
+            g_flight_dump = 0;
+            if (flight_dump("signal", path, sizeof(path)) != 0)
+                fprintf(stderr, "WARNING: flight recorder dump failed: %s\n", strerror(errno));
         }
 
-        now = get_monotonic_time_ns();
-        if (now >= next_print_ns) {
-            print_off_cpu_histogram();
-            print_blocked_histogram();
+        unsigned long long now = get_monotonic_time_ns();
+        if (g_ctl_interval_changed) {
+            interval_ns = (unsigned long long)g_interval_sec * 1000000000ull;
+            next_print_ns = now + interval_ns;
+            g_ctl_interval_changed = 0;
+        }
+        // Daemon windows are made of whole intervals, so a snapshot only
+        // reprints them.
+        if (g_ctl_snapshot && g_daemon) {
+            for (int i = 0; i < g_num_windows; i++)
+                print_window(&g_windows[i]);
+            fflush(stdout);
+            g_ctl_snapshot = 0;
+        }
+        // Records may be waiting below the wakeup threshold
+        if (g_rb && g_cut_req_fd < 0 && (now >= next_print_ns || g_ctl_snapshot ||
+                     (g_heatmap && now >= g_heat_next_step_ns)))
+            ring_buffer__consume(g_rb);
+        if (g_heatmap && now >= g_heat_next_step_ns) {
+            unsigned long long from = g_heat_next_step_ns - g_heat_step_ns;
+            do {
+                g_heat_next_step_ns += g_heat_step_ns;
+            } while (g_heat_next_step_ns <= now);
+            heatmap_sample_blocked(from, g_heat_next_step_ns - g_heat_step_ns);
+        }
+        if (now >= next_print_ns || g_ctl_snapshot) {
+            // A snapshot reports what has come in so far on top of the
+            // schedule: it does not move the next report, count towards
+            // --count or fail a diff.
+            int scheduled = now >= next_print_ns;
+            g_ctl_snapshot = 0;
+            struct interval_snapshot *iv = g_daemon ? window_ring_push() : &g_interval;
+            collect_interval(iv, now);
+            if (scheduled)
+                g_capture.intervals++;
+            flight_check_p99(iv);
+            lru_check_evictions();
+            if (g_daemon) {
+                report_windows(now);
+            } else if (g_heatmap) {
+                report_heatmap(now);
+            } else if (g_diff_mode) {
+                int over = print_capture_diff(&g_baseline, &g_capture);
+                if (scheduled) {
+                    g_diff_violations = over ? g_diff_violations + 1 : 0;
+                    if (g_diff_violations >= g_diff_streak)
+                        exit_code = DIFF_EXIT_REGRESSION;
+                }
+            } else {
+                print_off_cpu_histogram(iv);
+                print_blocked_histogram(iv);
+                if (g_oncpu)
+                    print_oncpu_report(iv);
+                if (g_sched)
+                    print_sched_report();
+                if (g_preempt)
+                    print_preempt_report();
+                if (g_syscalls)
+                    print_syscall_report();
+                if (g_blockio)
+                    print_blockio_report();
+                if (g_futex)
+                    print_futex_report();
+                if (g_cgroups)
+                    print_cgroup_report();
+                if (g_num_targets > 0)
+                    print_target_report();
+                if (g_threads)
+                    print_thread_report();
+                if (g_outliers)
+                    print_outliers();
+            }
+            if (g_save_path && save_capture(g_save_path, &g_capture) != 0)
+                fprintf(stderr, "WARNING: failed to save capture to '%s'\n", g_save_path);
+            if (!scheduled)
+                continue;
+            // With --count a failed diff still runs to the end
+            if ((exit_code != EXIT_SUCCESS && !g_max_intervals) ||
+                (g_max_intervals && g_capture.intervals >= (unsigned long long)g_max_intervals))
+                break;
             do {
                 next_print_ns += interval_ns;
             } while (next_print_ns <= now);
@@ -539,14 +6031,41 @@ int main(int argc, char **argv) {
     }
 
 cleanup:
+    consumer_stop();
+    if (g_flame_rd.keys && flame_write(g_flame_path) != 0)
+        fprintf(stderr, "WARNING: failed to write the flame graph to '%s'\n", g_flame_path);
     if (g_rb) {
         ring_buffer__free(g_rb);
         g_rb = NULL;
     }
     free_tid_tgid_cache();
-    if (g_link_switch) bpf_link__destroy(g_link_switch);
-    if (g_link_wakeup) bpf_link__destroy(g_link_wakeup);
-    if (g_link_wakeup_new) bpf_link__destroy(g_link_wakeup_new);
+    free_tgid_agg();
+    window_ring_free();
+    heatmap_close();
+    map_reader_free(&g_tgid_stats_rd);
+    syscall_report_free();
+    blockio_report_free();
+    futex_report_free();
+    cgroup_report_free();
+    outliers_free();
+    thread_report_free();
+    oncpu_report_free();
+    pidns_free();
+    sched_report_free();
+    preempt_report_free();
+    flight_free();
+    flame_free();
+    top_free();
+    symbolize_free();
+    free(g_hist_percpu);
+    lru_stats_free();
+    loop_close();
+    control_close();
+    unpin_objects();
+    for (int i = 0; i < g_num_pinned_fds; i++)
+        close(g_pinned_fds[i]);
+    for (int i = 0; i < g_num_links; i++)
+        bpf_link__destroy(g_links[i]);
     if (g_obj) bpf_object__close(g_obj);
-    return EXIT_SUCCESS;
+    return exit_code;
 }
\ No newline at end of file
@@ -0,0 +1,358 @@
+#ifndef __CPU_ANALYZER_H
+#define __CPU_ANALYZER_H
+
+// Types shared by cpu_analyzer.bpf.c and cpu_analyzer.c. The includer provides
+// __u32/__u64 (vmlinux.h on the BPF side, linux/types.h via libbpf otherwise).
+
+#define BLOCKED_HIST_BUCKETS 64
+
+// Off-CPU interval of one thread, streamed through 'rb'.
+struct offcpu_sample {
+    __u32 tid;
+    __u32 tgid;
+    __u64 t0_ns;
+    __u64 t2_ns;
+    __u64 delta_ns;
+    __u32 ns_tid;   // IDs in the --pidns namespace, 0 without it
+    __u32 ns_tgid;
+};
+
+// Sent through 'exit_rb' when a thread exits so userspace can drop what it
+// cached about the TID before it is recycled.
+struct exit_event {
+    __u32 tid;
+    __u32 tgid;
+};
+
+// Value of the per-thread start maps: the start of an interval for one
+// thread, with the thread group it belongs to so the end of the interval
+// can be charged without asking userspace.
+struct task_start {
+    __u64 ts_ns;
+    __u32 tgid;
+    __s32 syscall;  // syscall in progress at switch-out, with --syscalls
+    __u32 flags;    // START_* below
+    __u32 target;   // index of the target set entry it matched, or TARGET_NONE
+    __u64 cgid;     // cgroup v2 id at switch-out, with --cgroups
+    __u32 ns_tid;   // IDs in the --pidns namespace; 0 outside it
+    __u32 ns_tgid;
+    __u32 state;    // prev_state at switch-out
+    __s32 user_stack;   // --flame: ids in 'stacks' at switch-out, negative if none
+    __s32 kern_stack;
+    __u16 policy;   // --sched: scheduling class at switch-out, as in struct sched_key
+    __s16 prio;
+    __u32 preemptor_tgid;   // --preempt: the task that displaced it while runnable, or 0
+    char preemptor_comm[16];
+    __u32 pad;
+};
+
+#define START_D_STATE   (1u << 0)  // switched out uninterruptible
+#define START_IO_DONE   (1u << 1)  // a block request it issued completed meanwhile
+#define START_IN_CGROUP (1u << 2)  // inside the --cgroup subtree at switch-out
+#define START_SCHED     (1u << 3)  // policy and prio were read at switch-out
+#define START_PREEMPTED (1u << 4)  // switched out runnable; preemptor_* say for whom
+
+// Exact totals of one kind of interval, in nanoseconds
+struct time_stat {
+    __u64 total_ns;
+    __u64 count;
+    __u64 max_ns;
+};
+
+// Value of 'tgid_stats': what each thread group spent off-CPU, blocked and
+// waiting in a run queue since the programs were attached.
+struct tgid_stats {
+    struct time_stat offcpu;
+    struct time_stat blocked;
+    struct time_stat runq;
+    struct time_stat io_wait;       // --blockio: D-state waits that saw the task's IO complete
+    struct time_stat dstate_other;  // --blockio: all other D-state waits
+    struct time_stat oncpu;         // --oncpu: slices from switch-in to switch-out
+};
+
+// Value of 'tid_stats': the same totals for one thread
+struct tid_stats {
+    __u32 tgid;
+    __u32 pad;
+    struct time_stat offcpu;
+    struct time_stat blocked;
+    struct time_stat runq;
+    struct time_stat oncpu;     // --oncpu
+    char comm[16];      // as of its last switch-in
+};
+
+// Keyed histograms use log2(usecs) slots 0..21 plus one slot for everything
+// longer, which is as much as the histograms print.
+#define HIST_SLOTS 23
+
+struct log2_hist {
+    __u64 slots[HIST_SLOTS];
+};
+
+// Value of 'tgid_hists' and 'tid_hists'
+struct tgid_hist {
+    struct log2_hist offcpu;
+    struct log2_hist blocked;
+    struct log2_hist oncpu;     // --oncpu
+};
+
+// Value of 'cgroup_stats', keyed by cgroup v2 id (time of the cgroup's own
+// tasks, not including child cgroups), of 'target_stats' and of
+// 'thread_exits'.
+struct group_stat {
+    struct time_stat offcpu;
+    struct time_stat blocked;
+    struct time_stat runq;
+    struct log2_hist offcpu_hist;
+    struct log2_hist blocked_hist;
+};
+
+// --threads: key of 'thread_exits', which keeps the totals and histograms of
+// exited threads by the comm they last ran as
+struct thread_exit_key {
+    __u32 tgid;
+    char comm[16];
+};
+
+// Target set: up to MAX_TARGETS PIDs, TIDs and comm prefixes, each with its
+// own 'target_stats' entry
+#define MAX_TARGETS 8
+#define TARGET_NONE 0xffffffffu
+
+// Key of 'target_comms', a longest-prefix-match trie over the comm bytes
+struct comm_key {
+    __u32 prefixlen;    // in bits
+    char comm[16];
+};
+
+// Features switched on in the single-entry 'config' map
+#define CFG_SYSCALLS (1u << 0)  // attribute off-CPU time to the syscall in progress
+#define CFG_BLOCKIO  (1u << 1)  // split D-state time into block IO and other waits
+#define CFG_FUTEX    (1u << 2)  // aggregate futex waits per {tgid, uaddr}
+#define CFG_OFFCPU_HIST (1u << 3)  // keep the off-CPU histogram in kernel for pinned clients
+#define CFG_NO_SAMPLES  (1u << 4)  // do not stream off-CPU samples through 'rb'
+#define CFG_TID_STATS   (1u << 5)  // keep per-thread totals in 'tid_stats'
+#define CFG_TGID_HIST   (1u << 6)  // keep per-process histograms in 'tgid_hists'
+#define CFG_CGROUP_FILTER (1u << 7)  // only stream and histogram tasks under 'cgroup_filter'
+#define CFG_CGROUP_STATS  (1u << 8)  // aggregate per cgroup id in 'cgroup_stats'
+#define CFG_TARGETS       (1u << 9)  // only stream and histogram the target set
+#define CFG_PIDNS         (1u << 10) // only follow tasks of the pidns_dev/pidns_ino namespace
+#define CFG_OUTLIERS      (1u << 11) // keep the longest intervals in 'topk'
+#define CFG_TID_HIST      (1u << 12) // per-thread histograms in 'tid_hists', exits in 'thread_exits'
+#define CFG_FLIGHT        (1u << 13) // record every switch in 'flight_recs'
+#define CFG_ONCPU         (1u << 14) // account on-CPU slices
+#define CFG_FLAME         (1u << 15) // charge sampled and blocked stacks in 'flame_counts'
+#define CFG_SCHED         (1u << 16) // aggregate per scheduling policy and priority in 'sched_stats'
+#define CFG_PREEMPT       (1u << 17) // charge run-queue waits after a preemption in 'preempt_stats'
+#define CFG_TID_ALL       (1u << 18) // keep 'tid_stats' for every task, not only the followed ones
+
+// Rewritten while the programs run (--control); each program reads it once.
+struct analyzer_config {
+    __u32 flags;
+    __u32 filter_tgid;      // only stream and histogram this thread group; 0 = all
+    __u64 min_offcpu_ns;    // off-CPU intervals shorter than this are not streamed
+    __u32 wakeup_bytes;     // wake the ring buffer consumer once this much is queued; 0 = every record
+    __u32 topk_slot;        // half of 'topk' the programs fill; userspace reads the other
+    __u64 pidns_dev;        // with CFG_PIDNS: the PID namespace whose IDs filter_tgid and
+    __u64 pidns_ino;        // the target set are given in
+    __u32 flight_mask;      // records per CPU in 'flight_recs' - 1, a power of two - 1
+    __u32 pad;
+};
+
+// --outliers: each CPU keeps its TOPK_ENTRIES longest intervals of each kind,
+// so a global top-N up to that many is exact once merged.
+#define TOPK_ENTRIES 16
+
+enum topk_kind {
+    TOPK_OFFCPU,
+    TOPK_BLOCKED,
+    TOPK_RUNQ,
+    TOPK_KINDS,
+};
+
+struct topk_entry {
+    __u64 delta_ns;
+    __u64 start_ns;     // bpf_ktime_get_ns() when the interval began
+    __u32 tid;
+    __u32 tgid;
+    __u32 state;        // prev_state the task was switched out in
+    __u32 pad;
+    char comm[16];      // at the end of the interval
+};
+
+// Value of 'topk', keyed by kind * 2 + slot
+struct topk_list {
+    __u32 len;
+    __u32 min_idx;      // shortest entry, once len == TOPK_ENTRIES
+    struct topk_entry e[TOPK_ENTRIES];
+};
+
+// --flight-recorder: one context switch, as kept in each CPU's ring of
+// 'flight_recs'
+struct flight_rec {
+    __u64 ts_ns;
+    __u32 prev_tid;
+    __u32 prev_tgid;
+    __u32 next_tid;
+    __u32 prev_state;
+};
+
+// --flame: frames kept per stack in 'stacks'
+#define FLAME_MAX_DEPTH 127
+
+// Key of 'flame_counts', whose value is the nanoseconds charged to the pair
+// of stacks: sampled on CPU, or blocked from switch-out to wakeup.
+struct flame_key {
+    __u32 tgid;
+    __u32 oncpu;
+    __s32 user_stack;   // ids in 'stacks'; negative when there was none
+    __s32 kern_stack;
+    char comm[16];
+};
+
+// Samples and blocked intervals left out of 'flame_counts', as keys of
+// 'flame_counters'
+enum flame_counter {
+    FLAME_STACK_LOST,   // bpf_get_stackid() failed: 'stacks' full or a hash collision
+    FLAME_COUNT_LOST,   // 'flame_counts' full
+    FLAME_COUNTERS,
+};
+
+// --sched: key of 'sched_stats'. prio is rt_priority (1..99) for SCHED_FIFO
+// and SCHED_RR, 0 for SCHED_DEADLINE and the nice value otherwise.
+struct sched_key {
+    __u32 policy;       // SCHED_OTHER, SCHED_FIFO, ...
+    __s32 prio;
+};
+
+// Bands the tasks that preempt others are counted in. They come from the
+// kernel prio sched_switch reports for the next task, which does not tell
+// SCHED_BATCH or SCHED_IDLE from SCHED_OTHER.
+enum sched_band {
+    SCHED_BAND_DEADLINE,
+    SCHED_BAND_RT,
+    SCHED_BAND_NICE_NEG,    // nice < 0
+    SCHED_BAND_NICE_0,
+    SCHED_BAND_NICE_POS,    // nice > 0
+    SCHED_BANDS,
+};
+
+// Value of 'sched_stats': what tasks of one policy and priority waited
+struct sched_stat {
+    struct time_stat runq;
+    struct time_stat offcpu;
+    struct log2_hist runq_hist;
+    __u64 preempted_by[SCHED_BANDS];    // switched out runnable for a task of each band
+};
+
+// --preempt: key of 'preempt_stats', whose value is the run-queue time the
+// victim spent after being switched out runnable for the preemptor
+struct preempt_key {
+    __u32 victim_tgid;
+    __u32 preemptor_tgid;
+    char preemptor_comm[16];
+};
+
+// Syscall number recorded for intervals that did not start inside a syscall
+#define SYSCALL_NONE (-1)
+
+struct syscall_key {
+    __u32 tgid;
+    __s32 nr;
+};
+
+// Value of 'syscall_stats': off-CPU and blocked time of one thread group
+// that started while it was inside one syscall.
+struct syscall_stat {
+    struct time_stat offcpu;
+    struct time_stat blocked;
+    struct log2_hist offcpu_hist;
+    struct log2_hist blocked_hist;
+};
+
+// Keys of 'dstate_hist'
+enum dstate_class {
+    DSTATE_BLOCK_IO,
+    DSTATE_OTHER,
+    DSTATE_CLASSES,
+};
+
+// Block requests 'io_inflight' lost track of, as keys of 'io_counters'
+enum io_counter {
+    IO_REPLACED,    // issued again at the same {dev, sector} before it completed
+    IO_STALE,       // completed after IO_STALE_NS, taken for a missed completion
+    IO_COUNTERS,
+};
+
+#define IO_STALE_NS (30ull * 1000000000ull)
+
+// --blockio: a block request in flight and who issued it
+struct io_req_key {
+    __u32 dev;
+    __u32 pad;
+    __u64 sector;
+};
+
+struct io_req {
+    __u64 issue_ns;
+    __u32 tid;
+    __u32 tgid;
+};
+
+// Value of 'io_dev_stats': issue-to-complete latency of one block device,
+// keyed by the kernel's dev_t (major << 20 | minor).
+struct io_dev_stat {
+    struct time_stat lat;
+    struct log2_hist hist;
+};
+
+struct futex_key {
+    __u32 tgid;
+    __u32 pad;
+    __u64 uaddr;
+};
+
+// Value of 'futex_stats': contention on one futex word of a thread group.
+struct futex_stat {
+    struct time_stat wait;      // blocked intervals of waiters, ended by their wakeup
+    struct log2_hist hist;      // of the same intervals
+    __u64 waits;                // wait calls, including ones that did not sleep
+    __s64 waiters;              // threads inside a wait call right now
+    __u64 max_waiters;          // most waiters seen at once
+};
+
+// Value of 'futex_waits': the futex word a thread is waiting on
+struct futex_wait {
+    __u64 uaddr;
+    __u32 tgid;
+    __u32 pad;
+};
+
+// LRU maps whose evictions are tracked, as keys of 'lru_ops'. Once the
+// counts say a map may be full, userspace counts its entries and takes what
+// is missing as evicted.
+enum lru_map_id {
+    LRU_OFFCPU_START,
+    LRU_BLOCKED_START,
+    LRU_RUNQ_START,
+    LRU_FUTEX_WAITS,
+    LRU_TGID_STATS,
+    LRU_SYSCALL_STATS,
+    LRU_FUTEX_STATS,
+    LRU_TID_STATS,
+    LRU_TGID_HISTS,
+    LRU_CGROUP_STATS,
+    LRU_NS_TGIDS,
+    LRU_TID_HISTS,
+    LRU_PREEMPT_STATS,
+    LRU_IO_INFLIGHT,
+    LRU_THREAD_EXITS,
+    LRU_MAPS,
+};
+
+struct lru_ops {
+    __u64 inserts;      // new keys created by the programs
+    __u64 deletes;      // keys the programs deleted
+};
+
+#endif /* __CPU_ANALYZER_H */